@@ -2,66 +2,132 @@ import os
 import sys
 import subprocess
 import time
+import threading
+import itertools
+import queue
+import struct
 from flask import Flask, render_template, request
 
 app = Flask(__name__)
 
+FRAME_QUERY = 1
+FRAME_DOCS = 2
+FRAME_RELOAD = 4
+FRAME_REPLY = 0x80
+FRAME_ERROR = 0xFF
+RESULTS_PER_PAGE = 50
+
+
 class SearchEngine:
+    """bin/search в режиме --binary --threads: запросы уходят кадрами с
+    номером и не ждут друг друга, поток чтения раскладывает ответы по
+    номерам. Заголовки и адреса запрашиваются одним кадром на страницу."""
+
     def __init__(self):
         self.process = None
+        self.lock = threading.Lock()
+        self.pending = {}
+        self.ids = itertools.count(1)
         self.start()
-        
+
     def start(self):
         if not os.path.exists("bin/search"):
             return
-            
+
         self.process = subprocess.Popen(
-            ["bin/search", "index"],
+            ["bin/search", "--rank", "--binary", "--threads", str(os.cpu_count() or 1), "index"],
             stdin=subprocess.PIPE,
             stdout=subprocess.PIPE,
-            text=True,
-            bufsize=1
+            bufsize=0
         )
         line = self.process.stdout.readline()
-        
+        threading.Thread(target=self.read_responses, args=(self.process,), daemon=True).start()
+
+    def read_responses(self, process):
+        stream = process.stdout
+        while True:
+            header = stream.read(9)
+            if len(header) < 9:
+                break
+            kind, tag, size = struct.unpack("<BII", header)
+            data = stream.read(size)
+            with self.lock:
+                waiter = self.pending.pop(tag, None)
+            if waiter:
+                waiter.put((kind, data))
+        with self.lock:
+            for waiter in self.pending.values():
+                waiter.put((FRAME_ERROR, b""))
+            self.pending.clear()
+
+    def request(self, kind, payload):
+        waiter = queue.Queue(maxsize=1)
+        with self.lock:
+            if not self.process or self.process.poll() is not None:
+                self.start()
+            if not self.process:
+                return FRAME_ERROR, b""
+            tag = next(self.ids) & 0xFFFFFFFF
+            self.pending[tag] = waiter
+            self.process.stdin.write(struct.pack("<BII", kind, tag, len(payload)) + payload)
+            self.process.stdin.flush()
+        return waiter.get(timeout=30)
+
     def search(self, query):
-        if not self.process or self.process.poll() is not None:
-            self.start()
-            
         try:
-            self.process.stdin.write(query + "\n")
-            self.process.stdin.flush()
-            
-            results = []
-            header = self.process.stdout.readline()
-            if not header or not header.startswith("Found"): 
+            kind, data = self.request(FRAME_QUERY, struct.pack("<I", RESULTS_PER_PAGE) + query.encode())
+            if kind != FRAME_QUERY | FRAME_REPLY:
                 return [], 0
-            
-            try:
-                count_str = header.split()[1]
-                total = int(count_str) if count_str.isdigit() else 0
-            except (IndexError, ValueError):
-                total = 0
-            
-            while True:
-                line = self.process.stdout.readline()
-                if not line or "__END_QUERY__" in line:
-                    break
-                
-                parts = line.strip().rsplit(' (', 1)
-                if len(parts) == 2:
-                    title = parts[0]
-                    url = parts[1][:-1]
-                    if not title: title = url
-                    results.append({'title': title, 'url': url})
-                else:
-                    results.append({'title': line.strip(), 'url': '#'})
-                    
+            total, count = struct.unpack_from("<QI", data)
+            doc_ids = [struct.unpack_from("<I", data, 12 + 8 * i)[0] for i in range(count)]
+            if not doc_ids:
+                return [], total
+
+            kind, data = self.request(FRAME_DOCS, struct.pack(f"<I{len(doc_ids)}I", len(doc_ids), *doc_ids))
+            if kind != FRAME_DOCS | FRAME_REPLY:
+                return [], total
+
+            results = []
+            offset = 0
+            for _ in doc_ids:
+                fields = []
+                for _ in range(2):
+                    (size,) = struct.unpack_from("<H", data, offset)
+                    fields.append(data[offset + 2:offset + 2 + size].decode("utf-8", "replace"))
+                    offset += 2 + size
+                url, title = fields
+                results.append({'title': title or url, 'url': url})
+
             return results, total
         except Exception as e:
             return [], 0
 
-engine = SearchEngine()
+    def reload(self, index_dir=""):
+        """Подменяет индекс, не останавливая поиск; пустой путь - прежний
+        каталог. Возвращает число документов нового индекса или None."""
+        try:
+            kind, data = self.request(FRAME_RELOAD, index_dir.encode())
+        except queue.Empty:
+            return None
+        if kind != FRAME_RELOAD | FRAME_REPLY:
+            return None
+        return struct.unpack_from("<Q", data)[0]
+
+class LibraryEngine:
+    """Индекс открыт в этом процессе через bin/libsearch.so."""
+
+    def __init__(self):
+        from search_engine.libsearch import SearchIndex
+        self.index = SearchIndex("index", "bin/libsearch.so", mmap=True, rank=True)
+
+    def search(self, query):
+        try:
+            return self.index.search(query, RESULTS_PER_PAGE)
+        except Exception as e:
+            return [], 0
+
+
+engine = LibraryEngine() if os.path.exists("bin/libsearch.so") else SearchEngine()
 
 @app.route('/')
 def index():
@@ -49,6 +49,49 @@ def benchmark_tokenization():
     print(f"Speed: {mb_per_sec:.2f} MB/s")
     print(f"Tokens generated: {token_count}")
 
+def benchmark_batch_tokenization():
+    tokenizer_path = "bin/tokenizer"
+    if not os.path.exists(tokenizer_path):
+        return
+
+    sample_text = "dna crispr cas9 gene editing protein sequence mutation " * 1000
+    target_size_mb = 50
+    multiplier = int(target_size_mb * 1024 * 1024 / len(sample_text))
+    batch = (sample_text + "\n") * multiplier + "__END_BATCH__\n"
+    actual_size_mb = len(batch.encode('utf-8')) / 1024 / 1024
+
+    start = time.time()
+
+    proc = subprocess.Popen(
+        [tokenizer_path, "--batch"],
+        stdin=subprocess.PIPE,
+        stdout=subprocess.PIPE,
+        stderr=subprocess.PIPE,
+        text=True,
+        bufsize=1024*1024
+    )
+
+    try:
+        proc.stdin.write(batch)
+        proc.stdin.close()
+
+        token_count = 0
+        for line in proc.stdout:
+            if line != "__END_BATCH__\n":
+                token_count += line.count(" ") + 1
+
+        proc.wait()
+
+    except Exception as e:
+        return
+
+    elapsed = time.time() - start
+    mb_per_sec = actual_size_mb / elapsed
+
+    print(f"Batch mode: processed {actual_size_mb:.2f} MB in {elapsed:.4f}s")
+    print(f"Speed: {mb_per_sec:.2f} MB/s")
+    print(f"Tokens generated: {token_count}")
+
 def benchmark_search_queries(index_dir):
     search_bin = "bin/search"
     if not os.path.exists(search_bin):
@@ -97,6 +140,7 @@ def benchmark_search_queries(index_dir):
 def main():
     index_dir = "index"
     benchmark_tokenization()
+    benchmark_batch_tokenization()
     
     if os.path.exists(index_dir):
         benchmark_search_queries(index_dir)
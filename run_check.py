@@ -0,0 +1,195 @@
+#!/usr/bin/env python3
+"""Дифференциальная проверка bin/search (make check).
+
+Строит из случайного корпуса обычный, сжатый, сегментированный (--append с
+обновлениями, до и после --merge) и шардированный (hash и range) индексы и
+сравнивает булеву выдачу bin/search с эталонным движком search_engine.search
+на тех же данных: число найденных документов и первые RESULT_LIMIT из них в
+порядке doc_id. У шардированного индекса порядок общий, как у обычного.
+Ранжированный поиск libsearch.so с limit 0 должен дать те же числа.
+"""
+import argparse
+import os
+import random
+import subprocess
+import sys
+import tempfile
+
+from search_engine.libsearch import SearchIndex
+from search_engine.search import SearchEngine, open_index_reader
+from search_engine.tokenizer_wrapper import TokenizerClient
+
+# Столько документов bin/search печатает на запрос в текстовом режиме
+RESULT_LIMIT = 50
+
+SYLLABLES = ["ka", "to", "ri", "ne", "mo", "sa", "lu", "pe", "di", "go",
+             "ba", "fi", "ze", "xu", "qo", "wa", "yi", "ho", "je", "cu"]
+
+def make_vocab(rng: random.Random, size: int) -> list:
+    vocab = set()
+    while len(vocab) < size:
+        vocab.add("".join(rng.choice(SYLLABLES) for _ in range(rng.randint(2, 4))))
+    return sorted(vocab)
+
+def pick_word(rng: random.Random, vocab: list) -> str:
+    # Частые слова дают длинные списки (блоки-карты v8), редкие - короткие
+    if rng.random() < 0.5:
+        return rng.choice(vocab[:20])
+    return rng.choice(vocab)
+
+def make_doc(rng: random.Random, vocab: list, num: int, version: int) -> str:
+    words = [pick_word(rng, vocab) for _ in range(rng.randint(5, 120))]
+    if rng.random() < 0.2:
+        words = [w.upper() for w in words]
+    title = f"Title {num}.{version} {rng.choice(vocab)}"
+    return f"http://check.example/{num}\t{title}\t{' '.join(words)}\n"
+
+def make_query(rng: random.Random, vocab: list, depth: int = 0) -> str:
+    r = rng.random()
+    if depth > 2 or r < 0.35:
+        return pick_word(rng, vocab)
+    if r < 0.45:
+        n = rng.randint(2, 3)
+        phrase = '"' + " ".join(pick_word(rng, vocab) for _ in range(n)) + '"'
+        return phrase + f" / {rng.randint(n, n + 4)}" if rng.random() < 0.3 else phrase
+    if r < 0.55:
+        return "!" + make_query(rng, vocab, depth + 1)
+    if r < 0.65:
+        return "(" + make_query(rng, vocab, depth + 1) + ")"
+    op = rng.choice([" && ", " || ", " "])
+    return make_query(rng, vocab, depth + 1) + op + make_query(rng, vocab, depth + 1)
+
+def write_lines(path: str, lines: list):
+    with open(path, "w", encoding="utf-8") as f:
+        f.writelines(lines)
+
+def run_indexer(args, options: list, index_dir: str, input_path: str):
+    os.makedirs(index_dir, exist_ok=True)
+    with open(input_path, "rb") as f:
+        result = subprocess.run([os.path.join(args.bin_dir, "indexer")] + options + [index_dir],
+                                stdin=f, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+    if result.returncode != 0:
+        raise RuntimeError(f"indexer {' '.join(options)} {index_dir} failed: {result.stderr.decode(errors='replace')}")
+
+def expected_answers(args, index_dir: str, queries: list) -> list:
+    reader = open_index_reader(index_dir)
+    try:
+        engine = SearchEngine(reader, TokenizerClient(os.path.join(args.bin_dir, "tokenizer")))
+        answers = []
+        for q in queries:
+            docs = sorted(engine.execute(q))
+            lines = []
+            for doc_id in docs[:RESULT_LIMIT]:
+                info = reader.get_doc_info(doc_id)
+                lines.append(f"{info['title']} ({info['url']})")
+            answers.append([f"Found {len(docs)} docs."] + lines)
+        return answers
+    finally:
+        reader.close()
+
+def search_answers(args, options: list, index_dir: str, queries: list) -> list:
+    text = "".join(q + "\n" for q in queries) + "exit\n"
+    result = subprocess.run([os.path.join(args.bin_dir, "search")] + options + [index_dir],
+                            input=text, capture_output=True, text=True)
+    lines = result.stdout.split("\n")
+    if not lines or lines[0] != "Ready":
+        raise RuntimeError(f"search {index_dir} did not start: {result.stderr}")
+    answers = []
+    current = []
+    for line in lines[1:]:
+        if line == "__END_QUERY__":
+            answers.append(current)
+            current = []
+        elif line:
+            current.append(line)
+    return answers
+
+def library_counts(args, index_dir: str, queries: list) -> list:
+    """Ранжированный поиск через libsearch.so с limit 0: только число
+    найденных. В процессе открывается один индекс."""
+    index = SearchIndex(index_dir, lib_path=os.path.join(args.bin_dir, "libsearch.so"))
+    # Без кэша результатов каждый запрос действительно вычисляется
+    index.set_cache_limits(0, 0)
+    answers = []
+    for q in queries:
+        total, hits = index.query(q, 0)
+        answers.append([f"Found {total} docs."] + [f"{len(hits)} hits for limit 0"] * bool(hits))
+    index.close()
+    return answers
+
+def compare(name: str, queries: list, expected: list, actual: list) -> int:
+    bad = 0
+    if len(actual) != len(expected):
+        print(f"FAIL {name}: {len(actual)} answers for {len(expected)} queries")
+        return len(expected)
+    for q, e, a in zip(queries, expected, actual):
+        if e != a:
+            bad += 1
+            if bad <= 3:
+                print(f"FAIL {name}: {q!r}: expected {e[:3]}, got {a[:3]}")
+    print(f"{'ok  ' if bad == 0 else 'FAIL'} {name}: {len(queries)} queries, {bad} mismatches")
+    return bad
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--bin-dir", default="bin")
+    parser.add_argument("--docs", type=int, default=3000)
+    parser.add_argument("--queries", type=int, default=300)
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+
+    rng = random.Random(args.seed)
+    vocab = make_vocab(rng, 2000)
+    docs = [make_doc(rng, vocab, n, 0) for n in range(args.docs)]
+    updates = [make_doc(rng, vocab, n, 1) for n in sorted(rng.sample(range(args.docs), args.docs // 10))]
+    queries = [make_query(rng, vocab) for _ in range(args.queries)]
+
+    bad = 0
+    with tempfile.TemporaryDirectory(prefix="search-check-") as tmp:
+        def path(name):
+            return os.path.join(tmp, name)
+
+        half = args.docs // 2
+        write_lines(path("all.tsv"), docs)
+        write_lines(path("first.tsv"), docs[:half])
+        write_lines(path("second.tsv"), docs[half:])
+        write_lines(path("updates.tsv"), updates)
+
+        run_indexer(args, [], path("plain"), path("all.tsv"))
+        expected = expected_answers(args, path("plain"), queries)
+        bad += compare("plain", queries, expected, search_answers(args, [], path("plain"), queries))
+        bad += compare("plain --mmap", queries, expected, search_answers(args, ["--mmap"], path("plain"), queries))
+
+        run_indexer(args, ["--codec", "streamvbyte", "--docs-codec", "lz"], path("packed"), path("all.tsv"))
+        bad += compare("streamvbyte + lz", queries, expected, search_answers(args, [], path("packed"), queries))
+
+        for split in ["hash", "range"]:
+            name = f"sharded-{split}"
+            run_indexer(args, ["--shards", "3", "--shard-by", split], path(name), path("all.tsv"))
+            bad += compare(f"3 shards by {split}", queries, expected, search_answers(args, [], path(name), queries))
+
+        # Обновления: в сегментированном индексе новые версии документов идут
+        # в конце, прежние помечены удалёнными
+        for name in ["seg", "sharded-hash"]:
+            if name == "seg":
+                run_indexer(args, ["--append", "--no-merge"], path(name), path("first.tsv"))
+                run_indexer(args, ["--append", "--no-merge"], path(name), path("second.tsv"))
+            run_indexer(args, ["--append", "--no-merge"], path(name), path("updates.tsv"))
+        expected = expected_answers(args, path("seg"), queries)
+        bad += compare("segmented", queries, expected, search_answers(args, [], path("seg"), queries))
+        bad += compare("3 shards by hash, appended", queries, expected,
+                       search_answers(args, [], path("sharded-hash"), queries))
+
+        run_indexer(args, ["--merge"], path("seg"), os.devnull)
+        bad += compare("segmented, merged", queries, expected, search_answers(args, [], path("seg"), queries))
+        bad += compare("segmented, merged, reference", queries, expected,
+                       expected_answers(args, path("seg"), queries))
+        bad += compare("libsearch, ranked, limit 0", queries, [e[:1] for e in expected],
+                       library_counts(args, path("seg"), queries))
+
+    if bad:
+        print(f"{bad} mismatches")
+        sys.exit(1)
+
+if __name__ == "__main__":
+    main()
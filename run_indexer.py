@@ -20,6 +20,10 @@ def main():
     parser.add_argument("--config", required=True)
     parser.add_argument("--out-dir", default="index")
     parser.add_argument("--limit", type=int, default=0)
+    parser.add_argument("--append", action="store_true",
+                        help="дописать документы новым сегментом в сегментированный индекс")
+    parser.add_argument("--shards", type=int, default=0,
+                        help="разбить индекс на N шардов по хешу url")
     args = parser.parse_args()
     
     if not os.path.exists("bin/indexer"):
@@ -36,7 +40,8 @@ def main():
         cursor = cursor.limit(args.limit)
     
     process = subprocess.Popen(
-        ["bin/indexer", args.out_dir],
+        ["bin/indexer"] + (["--append"] if args.append else [])
+        + (["--shards", str(args.shards)] if args.shards > 0 else []) + [args.out_dir],
         stdin=subprocess.PIPE,
         text=True,
         bufsize=1024*1024
@@ -16,14 +16,19 @@ def main_cli():
     parser.add_argument("--query")
     parser.add_argument("--input-file")
     parser.add_argument("--output-file")
+    parser.add_argument("--rank", action="store_true")
     args = parser.parse_args()
 
     search_bin = "bin/search"
     if not os.path.exists(search_bin):
         return
 
+    cmd = [search_bin, args.index_dir]
+    if args.rank:
+        cmd.insert(1, "--rank")
+
     process = subprocess.Popen(
-        [search_bin, args.index_dir],
+        cmd,
         stdin=subprocess.PIPE,
         stdout=subprocess.PIPE,
         stderr=subprocess.PIPE,
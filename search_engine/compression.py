@@ -52,3 +52,93 @@ def decode_delta(deltas: List[int]) -> List[int]:
         current += d
         numbers.append(current)
     return numbers
+
+def decode_varbyte_values(data: bytes, offset: int, n: int) -> tuple[List[int], int]:
+    values = []
+    for _ in range(n):
+        value, offset = decode_varbyte_stream(data, offset)
+        values.append(value)
+    return values, offset
+
+def decode_streamvbyte(data: bytes, offset: int, n: int) -> tuple[List[int], int]:
+    """StreamVByte: (n + 3) // 4 управляющих байта по 2 бита длины на число,
+    затем байты чисел little-endian."""
+    ctrl = offset
+    ptr = offset + (n + 3) // 4
+    values = []
+    for i in range(n):
+        length = ((data[ctrl + i // 4] >> (2 * (i % 4))) & 3) + 1
+        values.append(int.from_bytes(data[ptr:ptr + length], "little"))
+        ptr += length
+    return values, ptr
+
+def decode_bitmap_gaps(data: bytes, offset: int, n: int) -> tuple[List[int], int]:
+    """Разности n номеров из битовой карты блока постингов v8 (бит k - номер
+    base + k); возвращает их и смещение за картой."""
+    gaps = []
+    prev = 0
+    byte = 0
+    while len(gaps) < n:
+        bits = data[offset + byte]
+        bit = 0
+        while bits and len(gaps) < n:
+            if bits & 1:
+                doc = byte * 8 + bit
+                gaps.append(doc - prev)
+                prev = doc
+            bits >>= 1
+            bit += 1
+        byte += 1
+    return gaps, offset + byte
+
+LZ_MIN_MATCH = 4
+
+def lz_decompress(data: bytes, raw_size: int) -> bytes:
+    """Распаковка блока LZ index.docs v4 (формат блоков LZ4, см.
+    Compression::lz_decompress в src/compression.hpp)."""
+    out = bytearray()
+    ip = 0
+    n = len(data)
+
+    def read_length(length: int) -> int:
+        nonlocal ip
+        while True:
+            if ip >= n:
+                raise ValueError("Truncated LZ block")
+            b = data[ip]
+            ip += 1
+            length += b
+            if b != 255:
+                return length
+
+    while True:
+        if ip >= n:
+            raise ValueError("Truncated LZ block")
+        token = data[ip]
+        ip += 1
+        literals = token >> 4
+        if literals == 15:
+            literals = read_length(literals)
+        if ip + literals > n:
+            raise ValueError("Bad LZ literals")
+        out += data[ip:ip + literals]
+        ip += literals
+        if ip == n:
+            break
+        if n - ip < 2:
+            raise ValueError("Truncated LZ block")
+        offset = data[ip] | data[ip + 1] << 8
+        ip += 2
+        length = token & 15
+        if length == 15:
+            length = read_length(length)
+        length += LZ_MIN_MATCH
+        if offset == 0 or offset > len(out):
+            raise ValueError("Bad LZ match")
+        start = len(out) - offset
+        # Совпадение может перекрывать само себя (offset < length)
+        for k in range(length):
+            out.append(out[start + k])
+    if len(out) != raw_size:
+        raise ValueError("Bad LZ block size")
+    return bytes(out)
@@ -0,0 +1,134 @@
+"""
+Обёртка ctypes над bin/libsearch.so (C ABI из src/libsearch.h): индекс
+открывается в этом же процессе, запросы идут без подпроцесса, канала и
+разбора текста. ctypes отпускает GIL на время вызова, поэтому запросы из
+разных потоков Python выполняются параллельно.
+"""
+import ctypes
+import os
+from typing import List, Tuple, Dict, Optional
+
+SEARCH_OPEN_MMAP = 1
+SEARCH_OPEN_RANK = 2
+
+
+class CacheStats(ctypes.Structure):
+    _fields_ = [("hits", ctypes.c_uint64), ("misses", ctypes.c_uint64), ("evictions", ctypes.c_uint64),
+                ("entries", ctypes.c_uint64), ("bytes", ctypes.c_uint64), ("limit", ctypes.c_uint64)]
+
+DEFAULT_LIB_PATH = os.path.join("bin", "libsearch.so")
+
+_lib = None
+_lib_path = None
+
+
+def load_library(path: str = DEFAULT_LIB_PATH) -> ctypes.CDLL:
+    global _lib, _lib_path
+    if _lib is not None:
+        if os.path.abspath(path) != _lib_path:
+            raise RuntimeError(f"libsearch already loaded from {_lib_path}")
+        return _lib
+    if not os.path.exists(path):
+        raise FileNotFoundError(f"libsearch not found: {path}")
+
+    lib = ctypes.CDLL(os.path.abspath(path))
+    lib.search_last_error.restype = ctypes.c_char_p
+    lib.search_last_error.argtypes = []
+    lib.search_open.restype = ctypes.c_void_p
+    lib.search_open.argtypes = [ctypes.c_char_p, ctypes.c_int]
+    lib.search_close.restype = None
+    lib.search_close.argtypes = [ctypes.c_void_p]
+    lib.search_doc_count.restype = ctypes.c_uint32
+    lib.search_doc_count.argtypes = [ctypes.c_void_p]
+    lib.search_query.restype = ctypes.c_int64
+    lib.search_query.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_uint32,
+                                 ctypes.POINTER(ctypes.c_uint32), ctypes.POINTER(ctypes.c_float),
+                                 ctypes.POINTER(ctypes.c_uint32)]
+    lib.search_get_doc.restype = ctypes.c_int
+    lib.search_get_doc.argtypes = [ctypes.c_void_p, ctypes.c_uint32,
+                                   ctypes.POINTER(ctypes.c_char_p), ctypes.POINTER(ctypes.c_size_t),
+                                   ctypes.POINTER(ctypes.c_char_p), ctypes.POINTER(ctypes.c_size_t)]
+    lib.search_set_cache_limits.restype = None
+    lib.search_set_cache_limits.argtypes = [ctypes.c_void_p, ctypes.c_size_t, ctypes.c_size_t]
+    lib.search_get_cache_stats.restype = None
+    lib.search_get_cache_stats.argtypes = [ctypes.c_void_p, ctypes.POINTER(CacheStats), ctypes.POINTER(CacheStats)]
+    lib.search_tokenize.restype = ctypes.c_size_t
+    lib.search_tokenize.argtypes = [ctypes.c_char_p, ctypes.c_size_t, ctypes.c_char_p, ctypes.c_size_t]
+    _lib = lib
+    _lib_path = os.path.abspath(path)
+    return lib
+
+
+def _error(lib) -> str:
+    return lib.search_last_error().decode("utf-8", "replace")
+
+
+class SearchIndex:
+    """Индекс в памяти процесса; в процессе может быть открыт только один."""
+
+    def __init__(self, index_dir: str, lib_path: str = DEFAULT_LIB_PATH,
+                 mmap: bool = True, rank: bool = True):
+        self.lib = load_library(lib_path)
+        flags = (SEARCH_OPEN_MMAP if mmap else 0) | (SEARCH_OPEN_RANK if rank else 0)
+        self.handle = self.lib.search_open(index_dir.encode(), flags)
+        if not self.handle:
+            raise RuntimeError(f"Cannot open index {index_dir}: {_error(self.lib)}")
+        self.doc_count = self.lib.search_doc_count(self.handle)
+
+    def query(self, query: str, limit: int = 50) -> Tuple[int, List[Tuple[int, float]]]:
+        """Полное число найденных и до limit пар (doc_id, score)."""
+        doc_ids = (ctypes.c_uint32 * limit)()
+        scores = (ctypes.c_float * limit)()
+        count = ctypes.c_uint32(0)
+        total = self.lib.search_query(self.handle, query.encode(), limit, doc_ids, scores, ctypes.byref(count))
+        if total < 0:
+            raise RuntimeError(_error(self.lib))
+        return total, [(doc_ids[i], scores[i]) for i in range(count.value)]
+
+    def doc(self, doc_id: int) -> Optional[Tuple[str, str]]:
+        """(url, title) документа или None."""
+        url, url_len = ctypes.c_char_p(), ctypes.c_size_t()
+        title, title_len = ctypes.c_char_p(), ctypes.c_size_t()
+        if self.lib.search_get_doc(self.handle, doc_id, ctypes.byref(url), ctypes.byref(url_len),
+                                   ctypes.byref(title), ctypes.byref(title_len)) != 0:
+            return None
+        return (ctypes.string_at(url, url_len.value).decode("utf-8", "replace"),
+                ctypes.string_at(title, title_len.value).decode("utf-8", "replace"))
+
+    def search(self, query: str, limit: int = 50) -> Tuple[List[Dict[str, str]], int]:
+        """Страница результатов в формате app.py: [{'title', 'url'}], всего."""
+        total, hits = self.query(query, limit)
+        results = []
+        for doc_id, _ in hits:
+            doc = self.doc(doc_id)
+            if doc:
+                url, title = doc
+                results.append({'title': title or url, 'url': url})
+        return results, total
+
+    def set_cache_limits(self, result_bytes: int, postings_bytes: int):
+        """Лимиты кеша результатов и кеша списков в байтах, 0 - без кеша."""
+        self.lib.search_set_cache_limits(self.handle, result_bytes, postings_bytes)
+
+    def cache_stats(self) -> Dict[str, Dict[str, int]]:
+        """Счётчики кешей: {'results': {...}, 'postings': {...}}."""
+        results, postings = CacheStats(), CacheStats()
+        self.lib.search_get_cache_stats(self.handle, ctypes.byref(results), ctypes.byref(postings))
+        return {name: {field: getattr(s, field) for field, _ in CacheStats._fields_}
+                for name, s in (("results", results), ("postings", postings))}
+
+    def close(self):
+        if self.handle:
+            self.lib.search_close(self.handle)
+            self.handle = None
+
+
+def tokenize(text: str, lib_path: str = DEFAULT_LIB_PATH) -> List[str]:
+    """Термы текста так же, как их видит индексатор."""
+    lib = load_library(lib_path)
+    data = text.encode("utf-8", "replace")
+    out = ctypes.create_string_buffer(len(data) + 1)
+    n = lib.search_tokenize(data, len(data), out, len(out))
+    if n == 0:
+        return []
+    return out.raw[:n].decode("utf-8", "replace").split("\n")
@@ -1,4 +1,5 @@
 import argparse
+import mmap
 import os
 import struct
 import time
@@ -10,8 +11,16 @@ from .tokenizer_wrapper import TokenizerClient
 MAGIC_DOCS = b'DOCS'
 MAGIC_DICT = b'DICT'
 MAGIC_POST = b'POST'
+MAGIC_POSN = b'POSN'
+
+CODEC_VARBYTE = 0
+CODEC_STREAMVBYTE = 1
+DOC_BLOCK_BITMAP = 1
 
 class CompressedIndexReader:
+    """Одиночный индекс (или сегмент) в форматах bin/indexer: index.docs
+    v3/v4, index.dict v3/v4, index.postings v3 и v5-v8 с index.positions."""
+
     def __init__(self, index_dir: str):
         self.index_dir = index_dir
         self.doc_infos: List[Dict[str, str]] = []
@@ -19,8 +28,7 @@ class CompressedIndexReader:
         
         self._load_docs()
         self._load_dict()
-        
-        self.post_file = open(os.path.join(index_dir, "index.postings"), "rb")
+        self._open_postings()
         
     def _load_docs(self):
         path = os.path.join(self.index_dir, "index.docs")
@@ -30,6 +38,9 @@ class CompressedIndexReader:
                 raise ValueError("Invalid DOCS file")
             ver = struct.unpack('<H', f.read(2))[0]
             count = struct.unpack('<I', f.read(4))[0]
+            if ver >= 4:
+                self._load_doc_blocks(f, count)
+                return
             
             offsets = []
             for _ in range(count):
@@ -47,6 +58,26 @@ class CompressedIndexReader:
                     title = f.read(title_len).decode('utf-8')
                 
                 self.doc_infos.append({"url": url, "title": title})
+
+    def _load_doc_blocks(self, f, count: int):
+        # v4: записи v3 подряд по block_docs документов, каждый блок сжат LZ
+        block_docs = struct.unpack('<H', f.read(2))[0]
+        if block_docs == 0:
+            raise ValueError("Invalid DOCS block size")
+        blocks = (count + block_docs - 1) // block_docs
+        offsets = struct.unpack(f'<{blocks + 1}Q', f.read(8 * (blocks + 1)))
+        for b in range(blocks):
+            f.seek(offsets[b])
+            raw_size = struct.unpack('<I', f.read(4))[0]
+            data = compression.lz_decompress(f.read(offsets[b + 1] - offsets[b] - 4), raw_size)
+            ptr = 0
+            for _ in range(min(block_docs, count - b * block_docs)):
+                fields = []
+                for _ in range(2):
+                    (length,) = struct.unpack_from('<H', data, ptr)
+                    fields.append(data[ptr + 2:ptr + 2 + length].decode('utf-8'))
+                    ptr += 2 + length
+                self.doc_infos.append({"url": fields[0], "title": fields[1]})
                 
     def _load_dict(self):
         path = os.path.join(self.index_dir, "index.dict")
@@ -56,6 +87,9 @@ class CompressedIndexReader:
                 raise ValueError("Invalid DICT file")
             ver = struct.unpack('<H', f.read(2))[0]
             count = struct.unpack('<I', f.read(4))[0]
+            if ver >= 4:
+                self._load_sorted_dict(f.read(), count)
+                return
             
             for _ in range(count):
                 length = struct.unpack('<B', f.read(1))[0]
@@ -64,9 +98,59 @@ class CompressedIndexReader:
                 doc_count = struct.unpack('<I', f.read(4))[0]
                 self.term_dict[term] = (offset, doc_count)
 
+    def _load_sorted_dict(self, data: bytes, count: int):
+        # v4: термы блоками по block_size с front coding. Блок открывает
+        # полный терм и смещение постингов (uint64), у следующих - длина
+        # общего префикса, суффикс и разность смещений varbyte; у каждого
+        # терма затем doc_freq varbyte. Данные идут после 10 байт заголовка.
+        block_size, block_count, index_offset = struct.unpack_from('<HIQ', data, 0)
+        index_offset -= 10
+        for b in range(block_count):
+            (ptr,) = struct.unpack_from('<Q', data, index_offset + 8 * b)
+            ptr -= 10
+            term = b""
+            offset = 0
+            for i in range(min(block_size, count - b * block_size)):
+                if i == 0:
+                    length = data[ptr]
+                    term = data[ptr + 1:ptr + 1 + length]
+                    ptr += 1 + length
+                    (offset,) = struct.unpack_from('<Q', data, ptr)
+                    ptr += 8
+                else:
+                    prefix, suffix = data[ptr], data[ptr + 1]
+                    term = term[:prefix] + data[ptr + 2:ptr + 2 + suffix]
+                    ptr += 2 + suffix
+                    delta, ptr = compression.decode_varbyte_stream(data, ptr)
+                    offset += delta
+                doc_count, ptr = compression.decode_varbyte_stream(data, ptr)
+                self.term_dict[term.decode('utf-8')] = (offset, doc_count)
+
+    def _open_postings(self):
+        self.post_file = open(os.path.join(self.index_dir, "index.postings"), "rb")
+        header = self.post_file.read(10)
+        if header[:4] != MAGIC_POST:
+            raise ValueError("Invalid POST file")
+        self.post_version = struct.unpack_from('<H', header, 4)[0]
+        self.pos_file = None
+        if self.post_version < 5:
+            return
+        if self.post_version > 8:
+            raise ValueError(f"Unsupported POST v{self.post_version}")
+        self.block_size = struct.unpack_from('<H', header, 6)[0]
+        self.codec = struct.unpack_from('<H', header, 8)[0] if self.post_version >= 6 else CODEC_VARBYTE
+        self.skip_entry_size = 16 if self.post_version >= 7 else 12
+        self.post_data = mmap.mmap(self.post_file.fileno(), 0, access=mmap.ACCESS_READ)
+        self.pos_file = open(os.path.join(self.index_dir, "index.positions"), "rb")
+        self.pos_data = mmap.mmap(self.pos_file.fileno(), 0, access=mmap.ACCESS_READ)
+        if self.pos_data[:4] != MAGIC_POSN:
+            raise ValueError("Invalid POSN file")
+
     def get_postings(self, term: str) -> Dict[int, List[int]]:
         if term not in self.term_dict:
             return {}
+        if self.post_version >= 5:
+            return self._get_block_postings(self.term_dict[term][0])
             
         offset, expected_doc_count = self.term_dict[term]
         self.post_file.seek(offset)
@@ -112,6 +196,58 @@ class CompressedIndexReader:
             
         return result
 
+    def _decode_values(self, ptr: int, n: int) -> tuple:
+        if self.codec == CODEC_STREAMVBYTE:
+            return compression.decode_streamvbyte(self.post_data, ptr, n)
+        return compression.decode_varbyte_values(self.post_data, ptr, n)
+
+    def _get_block_postings(self, offset: int) -> Dict[int, List[int]]:
+        # v5-v8: doc_freq, смещение позиций терма (uint64), таблица пропусков
+        # (последний doc_id, смещение блока, смещение позиций блока, в v7+
+        # ещё max freq), затем блоки: разности doc_id (в v8 с тегом, или
+        # битовая карта от последнего doc_id прошлого блока) и freq.
+        # Позиции документа - разности varbyte от нуля в index.positions.
+        data = self.post_data
+        doc_freq, ptr = compression.decode_varbyte_stream(data, offset)
+        (positions_base,) = struct.unpack_from('<Q', data, ptr)
+        skips = ptr + 8
+        block_count = (doc_freq + self.block_size - 1) // self.block_size
+        blocks = skips + block_count * self.skip_entry_size
+
+        result = {}
+        base = 0
+        for b in range(block_count):
+            last, block_offset, pos_offset = struct.unpack_from('<III', data, skips + b * self.skip_entry_size)
+            n = min(self.block_size, doc_freq - b * self.block_size)
+            ptr = blocks + block_offset
+            if self.post_version >= 8:
+                tag = data[ptr]
+                ptr += 1
+                if tag == DOC_BLOCK_BITMAP:
+                    gaps, ptr = compression.decode_bitmap_gaps(data, ptr, n)
+                else:
+                    gaps, ptr = self._decode_values(ptr, n)
+            else:
+                gaps, ptr = self._decode_values(ptr, n)
+            freqs, ptr = self._decode_values(ptr, n)
+
+            pos_ptr = positions_base + pos_offset
+            doc = base
+            for gap, freq in zip(gaps, freqs):
+                doc += gap
+                positions = []
+                curr_pos = 0
+                for _ in range(freq):
+                    pos_delta, pos_ptr = compression.decode_varbyte_stream(self.pos_data, pos_ptr)
+                    curr_pos += pos_delta
+                    positions.append(curr_pos)
+                result[doc] = positions
+            base = last
+        return result
+
+    def doc_ids(self) -> Set[int]:
+        return set(range(len(self.doc_infos)))
+
     def get_doc_info(self, doc_id: int) -> Dict[str, str]:
         if 0 <= doc_id < len(self.doc_infos):
             return self.doc_infos[doc_id]
@@ -121,13 +257,82 @@ class CompressedIndexReader:
         return self.get_doc_info(doc_id)["url"]
         
     def close(self):
+        if self.post_version >= 5:
+            self.post_data.close()
+            self.pos_data.close()
+            self.pos_file.close()
         self.post_file.close()
 
+class SegmentedIndexReader:
+    """Сегментированный индекс (--append): сегменты из index.segments идут
+    подряд в общей нумерации, удалённые документы в выдачу не попадают."""
+
+    def __init__(self, index_dir: str):
+        self.index_dir = index_dir
+        self.doc_infos: List[Dict[str, str]] = []
+        self.segments: List[Tuple[int, CompressedIndexReader, Set[int]]] = []
+        with open(os.path.join(index_dir, "index.segments"), "rb") as f:
+            if f.read(4) != b'SEGS' or struct.unpack('<H', f.read(2))[0] != 1:
+                raise ValueError("Invalid SEGS file")
+            _next_id, count = struct.unpack('<II', f.read(8))
+            entries = [struct.unpack('<IIII', f.read(16)) for _ in range(count)]
+        for seg_id, doc_count, del_gen, _del_count in entries:
+            seg_dir = os.path.join(index_dir, f"seg-{seg_id:06d}")
+            reader = CompressedIndexReader(seg_dir)
+            if len(reader.doc_infos) != doc_count:
+                raise ValueError(f"Segment {seg_dir} does not match the manifest")
+            deleted = self._read_deletions(seg_dir, del_gen, doc_count) if del_gen else set()
+            self.segments.append((len(self.doc_infos), reader, deleted))
+            self.doc_infos.extend(reader.doc_infos)
+
+    @staticmethod
+    def _read_deletions(seg_dir: str, gen: int, doc_count: int) -> Set[int]:
+        with open(os.path.join(seg_dir, f"index.deleted.{gen}"), "rb") as f:
+            if f.read(4) != b'DELS' or struct.unpack('<H', f.read(2))[0] != 1:
+                raise ValueError("Invalid DELS file")
+            if struct.unpack('<I', f.read(4))[0] != doc_count:
+                raise ValueError("Deletions do not match the segment")
+            bits = f.read((doc_count + 7) // 8)
+        return {d for d in range(doc_count) if bits[d >> 3] >> (d & 7) & 1}
+
+    def get_postings(self, term: str) -> Dict[int, List[int]]:
+        result = {}
+        for base, reader, deleted in self.segments:
+            for doc_id, positions in reader.get_postings(term).items():
+                if doc_id not in deleted:
+                    result[base + doc_id] = positions
+        return result
+
+    def doc_ids(self) -> Set[int]:
+        result = set()
+        for base, reader, deleted in self.segments:
+            result.update(base + d for d in range(len(reader.doc_infos)) if d not in deleted)
+        return result
+
+    def get_doc_info(self, doc_id: int) -> Dict[str, str]:
+        if 0 <= doc_id < len(self.doc_infos):
+            return self.doc_infos[doc_id]
+        return {"url": "", "title": ""}
+
+    def get_doc_url(self, doc_id: int) -> str:
+        return self.get_doc_info(doc_id)["url"]
+
+    def close(self):
+        for _, reader, _ in self.segments:
+            reader.close()
+
+def open_index_reader(index_dir: str):
+    if os.path.exists(os.path.join(index_dir, "index.shards")):
+        raise ValueError(f"{index_dir} is a sharded index; open one of its shard-K directories or serve it with bin/search")
+    if os.path.exists(os.path.join(index_dir, "index.segments")):
+        return SegmentedIndexReader(index_dir)
+    return CompressedIndexReader(index_dir)
+
 class SearchEngine:
-    def __init__(self, reader: CompressedIndexReader, tokenizer: TokenizerClient):
+    def __init__(self, reader, tokenizer: TokenizerClient):
         self.reader = reader
         self.tokenizer = tokenizer
-        self.all_docs = set(range(len(reader.doc_infos)))
+        self.all_docs = reader.doc_ids()
 
     def execute(self, query: str) -> Set[int]:
         tokens = self._tokenize(query)
@@ -202,7 +407,8 @@ class SearchEngine:
                         output.append(('OP', stack.pop()))
                     if stack: stack.pop()
                 else:
-                    while stack and stack[-1] != '(' and PRECEDENCE.get(stack[-1], 0) >= PRECEDENCE.get(val, 0):
+                    # Унарный ! правоассоциативен: "!!a" - это !(!a)
+                    while stack and stack[-1] != '(' and val != '!' and PRECEDENCE.get(stack[-1], 0) >= PRECEDENCE.get(val, 0):
                         output.append(('OP', stack.pop()))
                     stack.append(val)
         
@@ -317,7 +523,7 @@ def main_cli():
     
     try:
         try:
-            reader = CompressedIndexReader(args.index_dir)
+            reader = open_index_reader(args.index_dir)
         except Exception as e:
             print(f"Error loading index: {e}")
             return
@@ -1,13 +1,26 @@
 import os
 import subprocess
 from typing import List
+from . import libsearch
+
+END_BATCH = "__END_BATCH__"
 
 class TokenizerClient:
+    """bin/tokenizer в пакетном режиме: документы пакета уходят одной
+    записью, ответ на каждый - одна строка термов. Если рядом лежит
+    libsearch.so, токенизация идёт в этом же процессе без подпроцесса."""
+
     def __init__(self, tokenizer_path: str):
         if not os.path.exists(tokenizer_path):
             raise FileNotFoundError(f"Tokenizer not found: {tokenizer_path}")
+        self.process = None
+        self.lib_path = os.path.join(os.path.dirname(tokenizer_path), "libsearch.so")
+        if os.path.exists(self.lib_path):
+            libsearch.load_library(self.lib_path)
+            return
+        self.lib_path = None
         self.process = subprocess.Popen(
-            [tokenizer_path],
+            [tokenizer_path, "--batch"],
             stdin=subprocess.PIPE,
             stdout=subprocess.PIPE,
             text=True,
@@ -17,26 +30,36 @@ class TokenizerClient:
     def tokenize(self, text: str) -> List[str]:
         if not text:
             return []
-        
-        sanitized_text = text.replace('\n', ' ')
-        
+        return self.tokenize_batch([text])[0]
+
+    def tokenize_batch(self, texts: List[str]) -> List[List[str]]:
+        if self.lib_path:
+            return [libsearch.tokenize(text, self.lib_path) if text else [] for text in texts]
+
+        lines = []
+        for text in texts:
+            line = text.replace('\n', ' ')
+            # Строка-маркер была бы принята за конец пакета
+            lines.append(' ' + line if line == END_BATCH else line)
+
         try:
-            self.process.stdin.write(sanitized_text + '\n')
+            self.process.stdin.write("\n".join(lines) + "\n" + END_BATCH + "\n")
             self.process.stdin.flush()
         except BrokenPipeError:
-            return []
+            return [[] for _ in texts]
 
-        tokens = []
+        results = []
         while True:
             line = self.process.stdout.readline()
             if not line:
                 break
-            line = line.strip()
-            if line == "__END_DOC__":
+            line = line.rstrip('\n')
+            if line == END_BATCH:
                 break
-            if line:
-                tokens.append(line)
-        return tokens
+            results.append(line.split(' ') if line else [])
+        while len(results) < len(texts):
+            results.append([])
+        return results
 
     def close(self):
         if self.process:
@@ -0,0 +1,145 @@
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <utility>
+#include "common.hpp"
+
+// Арена байтовых потоков: память выделяется плитами по SLAB_SIZE и
+// раздаётся кусками без возврата. Куски больше четверти плиты выделяются
+// отдельно. reset() отдаёт все плиты под повторное заполнение, не
+// освобождая их.
+class ByteArena {
+public:
+    static const size_t SLAB_SIZE = 1 << 20;
+
+    ByteArena() : in_use(0), used(SLAB_SIZE) {}
+
+    ByteArena(const ByteArena&) = delete;
+    ByteArena& operator=(const ByteArena&) = delete;
+
+    ~ByteArena() {
+        for (size_t i = 0; i < slabs.size; ++i) std::free(slabs[i]);
+        release_large();
+    }
+
+    uint8_t* alloc(size_t n) {
+        if (n > SLAB_SIZE / 4) {
+            uint8_t* p = (uint8_t*)std::malloc(n);
+            if (!p) throw std::bad_alloc();
+            large.push_back(p);
+            large_bytes += n;
+            return p;
+        }
+        if (used + n > SLAB_SIZE) {
+            if (in_use == slabs.size) {
+                uint8_t* p = (uint8_t*)std::malloc(SLAB_SIZE);
+                if (!p) throw std::bad_alloc();
+                slabs.push_back(p);
+            }
+            in_use++;
+            used = 0;
+        }
+        uint8_t* p = slabs[in_use - 1] + used;
+        used += n;
+        return p;
+    }
+
+    void reset() {
+        in_use = 0;
+        used = SLAB_SIZE;
+        release_large();
+    }
+
+    // Занятая память с точностью до плиты
+    size_t bytes() const { return in_use * SLAB_SIZE + large_bytes; }
+
+    void swap(ByteArena& other) {
+        std::swap(slabs, other.slabs);
+        std::swap(large, other.large);
+        std::swap(in_use, other.in_use);
+        std::swap(used, other.used);
+        std::swap(large_bytes, other.large_bytes);
+    }
+
+private:
+    SimpleVector<uint8_t*> slabs;
+    SimpleVector<uint8_t*> large;
+    size_t in_use;
+    size_t used;
+    size_t large_bytes = 0;
+
+    void release_large() {
+        for (size_t i = 0; i < large.size; ++i) std::free(large[i]);
+        large.reset();
+        large_bytes = 0;
+    }
+};
+
+// Поток байтов в цепочке кусков арены. Куски растут от 16 байт до 1 КБ,
+// последние 8 байт куска хранят указатель на следующий.
+struct ByteChain {
+    static const int MAX_LEVEL = 6;
+    static const size_t LINK = sizeof(uint8_t*);
+
+    uint8_t* head = nullptr;
+    uint8_t* pos = nullptr;
+    uint8_t* end = nullptr;
+    int level = 0;
+
+    static size_t chunk_size(int level) { return (size_t)16 << level; }
+
+    void push(ByteArena& arena, uint8_t byte) {
+        if (pos == end) {
+            if (!head) {
+                head = pos = arena.alloc(chunk_size(0));
+                end = head + chunk_size(0) - LINK;
+            } else {
+                if (level < MAX_LEVEL) level++;
+                uint8_t* next = arena.alloc(chunk_size(level));
+                std::memcpy(end, &next, LINK);
+                pos = next;
+                end = next + chunk_size(level) - LINK;
+            }
+        }
+        *pos++ = byte;
+    }
+
+    void push_varbyte(ByteArena& arena, uint32_t number) {
+        while (number >= 128) {
+            push(arena, (number & 0x7F) | 0x80);
+            number >>= 7;
+        }
+        push(arena, number & 0x7F);
+    }
+};
+
+// Последовательное чтение ByteChain; get() возвращает -1 в конце потока
+class ByteChainReader {
+public:
+    ByteChainReader() : cur(nullptr), end(nullptr), stop(nullptr), level(0) {}
+
+    explicit ByteChainReader(const ByteChain& c)
+        : cur(c.head), end(c.head ? c.head + ByteChain::chunk_size(0) - ByteChain::LINK : nullptr), stop(c.pos), level(0) {}
+
+    int get() {
+        if (cur == stop) return -1;
+        if (cur == end) {
+            std::memcpy(&cur, end, ByteChain::LINK);
+            if (level < ByteChain::MAX_LEVEL) level++;
+            end = cur + ByteChain::chunk_size(level) - ByteChain::LINK;
+        }
+        return *cur++;
+    }
+
+private:
+    uint8_t* cur;
+    uint8_t* end;
+    uint8_t* stop;
+    int level;
+};
+
+#endif
@@ -0,0 +1,498 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <cerrno>
+
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "common.hpp"
+#include "compression.hpp"
+#include "hash_table.hpp"
+#include "tokenizer_lib.hpp"
+#include "bitset.hpp"
+#include "search_core.hpp"
+
+// Бенчмарки поиска, make bench:
+//   bench micro - распаковка постингов, операции над списками и битовыми
+//                 картами, поиск в хеш-таблицах и стемминг на синтетических
+//                 данных с фиксированным зерном;
+//   bench load [--mmap] [--repeat N] <index_dir> - время open_index;
+//   bench replay [--queries FILE] [--repeat N] -- <команда bin/search> -
+//                 журнал запросов (строка - запрос) подаётся запущенному
+//                 bin/search по одному, задержка меряется от отправки
+//                 запроса до строки __END_QUERY__ (bin/search без --threads:
+//                 там строки запросов несут id).
+// Результаты идут в stdout, чтобы прогоны можно было сравнивать между
+// сборками. Кеш результатов bin/search отвечает на повторы журнала из
+// памяти; чтобы мерить вычисление, передайте ему --result-cache-mb 0.
+typedef std::chrono::steady_clock Clock;
+
+const double MIN_BENCH_SECONDS = 0.3;
+
+volatile uint64_t sink = 0;
+
+double seconds_since(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Повторяет f не меньше MIN_BENCH_SECONDS после прогрева и печатает время
+// на единицу работы; f возвращает, сколько единиц обработала
+template <typename F>
+void run_bench(const char *name, const char *unit, F f)
+{
+    f();
+    uint64_t units = 0;
+    double secs = 0;
+    Clock::time_point start = Clock::now();
+    do
+    {
+        units += f();
+        secs = seconds_since(start);
+    } while (secs < MIN_BENCH_SECONDS);
+    std::cout << std::left << std::setw(28) << name << std::right << std::fixed << std::setprecision(2)
+              << std::setw(10) << secs * 1e9 / units << " ns/" << std::left << std::setw(8) << unit << std::right
+              << std::setw(10) << units / secs / 1e6 << " M" << unit << "/s" << std::endl;
+}
+
+// Разности doc_id: в основном однобайтные, часть двух- и трёхбайтных
+SimpleVector<uint32_t> make_gaps(std::mt19937 &rng, size_t n)
+{
+    SimpleVector<uint32_t> gaps;
+    for (size_t i = 0; i < n; ++i)
+    {
+        uint32_t r = rng() % 100;
+        uint32_t limit = r < 70 ? 128 : r < 95 ? 16384 : 1 << 20;
+        gaps.push_back(1 + rng() % (limit - 1));
+    }
+    return gaps;
+}
+
+// n различных возрастающих doc_id из [0, universe)
+SimpleVector<int> make_list(std::mt19937 &rng, size_t n, int universe)
+{
+    SimpleVector<int> all;
+    for (size_t i = 0; i < n; ++i)
+        all.push_back(rng() % universe);
+    std::sort(all.begin(), all.end());
+    SimpleVector<int> res;
+    for (size_t i = 0; i < all.size; ++i)
+        if (res.size == 0 || res[res.size - 1] != all[i])
+            res.push_back(all[i]);
+    return res;
+}
+
+void bench_decode(std::mt19937 &rng)
+{
+    const size_t block = 128;
+    SimpleVector<uint32_t> gaps = make_gaps(rng, 1 << 20);
+    SimpleVector<uint8_t> varbyte;
+    SimpleVector<uint8_t> svb;
+    for (size_t i = 0; i < gaps.size; ++i)
+        Compression::encode_varbyte(gaps[i], varbyte);
+    for (size_t i = 0; i < gaps.size; i += block)
+        Compression::encode_streamvbyte(gaps.data + i, block, svb);
+
+    run_bench("decode_varbyte", "value", [&]()
+              {
+        size_t offset = 0;
+        uint64_t sum = 0;
+        for (size_t i = 0; i < gaps.size; ++i)
+        {
+            auto p = Compression::decode_varbyte(varbyte.data, offset);
+            sum += p.first;
+            offset = p.second;
+        }
+        sink += sum;
+        return gaps.size; });
+
+    run_bench("decode_varbyte_block", "value", [&]()
+              {
+        uint32_t out[block];
+        const uint8_t *p = varbyte.data;
+        for (size_t i = 0; i < gaps.size; i += block)
+        {
+            p += Compression::decode_varbyte_block(p, block, out);
+            sink += out[0];
+        }
+        return gaps.size; });
+
+    run_bench("decode_streamvbyte", "value", [&]()
+              {
+        uint32_t out[block];
+        const uint8_t *p = svb.data;
+        for (size_t i = 0; i < gaps.size; i += block)
+        {
+            p += Compression::decode_streamvbyte(p, block, out);
+            sink += out[0];
+        }
+        return gaps.size; });
+}
+
+void bench_sets(std::mt19937 &rng)
+{
+    const int universe = 1 << 20;
+    SimpleVector<int> a = make_list(rng, 100000, universe);
+    SimpleVector<int> b = make_list(rng, 100000, universe);
+    SimpleVector<int> small = make_list(rng, 1000, universe);
+
+    run_bench("set_intersect 100k x 100k", "doc", [&]()
+              {
+        sink += set_intersect(a, b).size;
+        return a.size + b.size; });
+    run_bench("set_intersect 1k x 100k", "doc", [&]()
+              {
+        sink += set_intersect(small, a).size;
+        return small.size + a.size; });
+    run_bench("set_union 100k x 100k", "doc", [&]()
+              {
+        sink += set_union(a, b).size;
+        return a.size + b.size; });
+
+    DocBitset x, y;
+    x.assign(universe, false);
+    y.assign(universe, false);
+    for (size_t i = 0; i < a.size; ++i)
+        x.set(a[i]);
+    for (size_t i = 0; i < b.size; ++i)
+        y.set(b[i]);
+    // Операции идемпотентны, поэтому результат копируется один раз
+    DocBitset r = x;
+    run_bench("DocBitset and 1M docs", "word", [&]()
+              {
+        r.and_with(y);
+        return (size_t)universe / 64; });
+    r = x;
+    run_bench("DocBitset or 1M docs", "word", [&]()
+              {
+        r.or_with(y);
+        return (size_t)universe / 64; });
+    run_bench("DocBitset count 1M docs", "word", [&]()
+              {
+        sink += r.count();
+        return (size_t)universe / 64; });
+}
+
+void bench_hash(std::mt19937 &rng)
+{
+    const size_t n = 100000;
+    SimpleVector<std::string> keys;
+    SimpleVector<std::string> missing;
+    for (size_t i = 0; i < n; ++i)
+    {
+        keys.push_back("term" + std::to_string(rng()));
+        missing.push_back("miss" + std::to_string(rng()));
+    }
+    HashMap<int> map;
+    FlatHashMap<int> flat;
+    for (size_t i = 0; i < n; ++i)
+    {
+        map.insert(keys[i], (int)i);
+        flat[keys[i]] = (int)i;
+    }
+
+    run_bench("HashMap::get hit", "lookup", [&]()
+              {
+        uint64_t sum = 0;
+        for (size_t i = 0; i < n; ++i)
+            sum += *map.get(keys[i]);
+        sink += sum;
+        return n; });
+    run_bench("HashMap::get miss", "lookup", [&]()
+              {
+        uint64_t found = 0;
+        for (size_t i = 0; i < n; ++i)
+            found += map.get(missing[i]) != nullptr;
+        sink += found;
+        return n; });
+    run_bench("FlatHashMap::get hit", "lookup", [&]()
+              {
+        uint64_t sum = 0;
+        for (size_t i = 0; i < n; ++i)
+            sum += *flat.get(keys[i]);
+        sink += sum;
+        return n; });
+}
+
+void bench_stem(std::mt19937 &rng)
+{
+    static const char *stems[] = {"gene", "edit", "sequenc", "express", "mutat", "protein", "regulat", "bind",
+                                  "transcript", "cell", "organ", "format", "activ", "differ", "relat", "nation"};
+    static const char *suffixes[] = {"", "s", "ed", "ing", "ation", "ational", "ness", "ly", "ful", "ism",
+                                     "ization", "iveness", "able", "ement", "ous"};
+    SimpleVector<std::string> words;
+    for (size_t i = 0; i < 20000; ++i)
+    {
+        std::string w = stems[rng() % 16];
+        w += suffixes[rng() % 15];
+        words.push_back(w);
+    }
+
+    run_bench("TokenizerLib::stem", "word", [&]()
+              {
+        size_t len = 0;
+        for (size_t i = 0; i < words.size; ++i)
+            len += TokenizerLib::stem(words[i]).size();
+        sink += len;
+        return words.size; });
+    run_bench("stem_in_place (no cache)", "word", [&]()
+              {
+        char buf[64];
+        size_t len = 0;
+        for (size_t i = 0; i < words.size; ++i)
+        {
+            std::memcpy(buf, words[i].data(), words[i].size());
+            len += TokenizerLib::stem_in_place(buf, words[i].size());
+        }
+        sink += len;
+        return words.size; });
+}
+
+int run_micro()
+{
+    std::mt19937 rng(29);
+    bench_decode(rng);
+    bench_sets(rng);
+    bench_hash(rng);
+    bench_stem(rng);
+    return 0;
+}
+
+int run_load(int argc, char *argv[])
+{
+    size_t repeat = 5;
+    std::string dir;
+    for (int i = 0; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--mmap")
+            use_mmap = true;
+        else if (arg == "--repeat" && i + 1 < argc)
+            repeat = std::max(1ul, std::stoul(argv[++i]));
+        else
+            dir = arg;
+    }
+    if (dir.empty())
+    {
+        std::cerr << "Usage: bench load [--mmap] [--repeat N] <index_dir>" << std::endl;
+        return 1;
+    }
+
+    double best = 0, sum = 0;
+    for (size_t i = 0; i < repeat; ++i)
+    {
+        Clock::time_point start = Clock::now();
+        open_index(dir);
+        double secs = seconds_since(start);
+        best = i == 0 ? secs : std::min(best, secs);
+        sum += secs;
+    }
+    std::cout << std::fixed << std::setprecision(2) << "load_index" << (use_mmap ? " (mmap)" : "") << ": "
+              << index_doc_count() << " docs, best " << best * 1e3 << " ms, mean " << sum / repeat * 1e3
+              << " ms over " << repeat << " runs" << std::endl;
+    return 0;
+}
+
+// Запущенный bin/search в текстовом режиме
+class SearchProcess
+{
+public:
+    explicit SearchProcess(SimpleVector<std::string> &args)
+    {
+        int to_child[2], from_child[2];
+        if (pipe(to_child) != 0 || pipe(from_child) != 0)
+            throw std::runtime_error("Cannot create pipe");
+        SimpleVector<char *> argv;
+        for (size_t i = 0; i < args.size; ++i)
+            argv.push_back(&args[i][0]);
+        argv.push_back(nullptr);
+
+        pid = fork();
+        if (pid == 0)
+        {
+            dup2(to_child[0], 0);
+            dup2(from_child[1], 1);
+            ::close(to_child[0]);
+            ::close(to_child[1]);
+            ::close(from_child[0]);
+            ::close(from_child[1]);
+            execvp(argv.data[0], argv.data);
+            _exit(127);
+        }
+        ::close(to_child[0]);
+        ::close(from_child[1]);
+        if (pid < 0)
+            throw std::runtime_error("Cannot start " + args[0]);
+        in = fdopen(to_child[1], "w");
+        out = fdopen(from_child[0], "r");
+        std::string line;
+        while (line != "Ready")
+            if (!read_line(line))
+                throw std::runtime_error(args[0] + " failed to start");
+    }
+
+    ~SearchProcess()
+    {
+        std::fputs("exit\n", in);
+        std::fclose(in);
+        std::fclose(out);
+        std::free(buf);
+        waitpid(pid, nullptr, 0);
+    }
+
+    SearchProcess(const SearchProcess &) = delete;
+    SearchProcess &operator=(const SearchProcess &) = delete;
+
+    // Отправляет запрос и читает ответ до __END_QUERY__; found - число из
+    // "Found N docs.", -1 при ошибке
+    void query(const std::string &q, long long &found)
+    {
+        std::fputs(q.c_str(), in);
+        std::fputc('\n', in);
+        std::fflush(in);
+        found = -1;
+        std::string line;
+        while (true)
+        {
+            if (!read_line(line))
+                throw std::runtime_error("Search process exited");
+            if (line == "__END_QUERY__")
+                return;
+            if (found < 0 && line.compare(0, 6, "Found ") == 0)
+                found = std::atoll(line.c_str() + 6);
+        }
+    }
+
+private:
+    pid_t pid;
+    FILE *in = nullptr;
+    FILE *out = nullptr;
+    char *buf = nullptr;
+    size_t buf_size = 0;
+
+    bool read_line(std::string &line)
+    {
+        ssize_t n = getline(&buf, &buf_size, out);
+        if (n < 0)
+            return false;
+        if (n > 0 && buf[n - 1] == '\n')
+            n--;
+        line.assign(buf, n);
+        return true;
+    }
+};
+
+int run_replay(int argc, char *argv[])
+{
+    std::string queries_path = "bench_queries.txt";
+    size_t repeat = 1;
+    SimpleVector<std::string> command;
+    for (int i = 0; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--")
+        {
+            for (++i; i < argc; ++i)
+                command.push_back(argv[i]);
+        }
+        else if (arg == "--queries" && i + 1 < argc)
+            queries_path = argv[++i];
+        else if (arg == "--repeat" && i + 1 < argc)
+            repeat = std::max(1ul, std::stoul(argv[++i]));
+        else
+            break;
+    }
+    if (command.size == 0)
+    {
+        std::cerr << "Usage: bench replay [--queries FILE] [--repeat N] -- <search command...>" << std::endl;
+        return 1;
+    }
+
+    SimpleVector<std::string> queries;
+    FILE *f = std::fopen(queries_path.c_str(), "r");
+    if (!f)
+    {
+        std::cerr << "Cannot open " << queries_path << std::endl;
+        return 1;
+    }
+    char *line = nullptr;
+    size_t line_size = 0;
+    ssize_t n;
+    while ((n = getline(&line, &line_size, f)) >= 0)
+    {
+        std::string q(line, n > 0 && line[n - 1] == '\n' ? n - 1 : n);
+        if (!q.empty() && q != "exit")
+            queries.push_back(q);
+    }
+    std::free(line);
+    std::fclose(f);
+    if (queries.size == 0)
+    {
+        std::cerr << "No queries in " << queries_path << std::endl;
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    SimpleVector<double> latencies;
+    long long found_sum = 0;
+    size_t errors = 0;
+    double wall = 0;
+    {
+        SearchProcess search(command);
+        Clock::time_point start = Clock::now();
+        for (size_t r = 0; r < repeat; ++r)
+        {
+            for (size_t i = 0; i < queries.size; ++i)
+            {
+                long long found;
+                Clock::time_point sent = Clock::now();
+                search.query(queries[i], found);
+                latencies.push_back(seconds_since(sent));
+                if (found < 0)
+                    errors++;
+                else
+                    found_sum += found;
+            }
+        }
+        wall = seconds_since(start);
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](size_t p)
+    { return latencies[(latencies.size - 1) * p / 100] * 1e6; };
+    std::cout << std::fixed << std::setprecision(1) << "replay: " << latencies.size << " queries in " << std::setprecision(3)
+              << wall << " s, " << std::setprecision(1) << latencies.size / wall << " qps, latency p50 " << percentile(50) << " us, p90 "
+              << percentile(90) << " us, p99 " << percentile(99) << " us, max " << percentile(100) << " us"
+              << std::endl;
+    std::cout << "replay: found " << found_sum << " docs in total, " << errors << " errors" << std::endl;
+    return errors == 0 ? 0 : 1;
+}
+
+int main(int argc, char *argv[])
+{
+    std::string mode = argc > 1 ? argv[1] : "";
+    try
+    {
+        if (mode == "micro")
+            return run_micro();
+        if (mode == "load")
+            return run_load(argc - 2, argv + 2);
+        if (mode == "replay")
+            return run_replay(argc - 2, argv + 2);
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    std::cerr << "Usage: bench micro | load [--mmap] [--repeat N] <index_dir> |"
+                 " replay [--queries FILE] [--repeat N] -- <search command...>" << std::endl;
+    return 1;
+}
@@ -84,6 +84,12 @@ public:
         size++;
     }
 
+    void pop_back() {
+        if (size == 0) throw std::out_of_range("pop_back on empty vector");
+        size--;
+        data[size].~T();
+    }
+
     T& operator[](size_t index) {
         if (index >= size) throw std::out_of_range("Index out of bounds");
         return data[index];
@@ -105,6 +111,14 @@ public:
         size = 0;
         capacity = 0;
     }
+
+    // Удаляет элементы, но оставляет буфер для повторного заполнения
+    void reset() {
+        for(size_t i=0; i<size; ++i) {
+            data[i].~T();
+        }
+        size = 0;
+    }
     
     T* begin() { return data; }
     T* end() { return data + size; }
@@ -1,11 +1,16 @@
 #ifndef COMPRESSION_HPP
 #define COMPRESSION_HPP
 
+#include <algorithm>
 #include "common.hpp"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
 namespace Compression {
 
-void encode_varbyte(uint32_t number, SimpleVector<uint8_t>& out) {
+inline void encode_varbyte(uint32_t number, SimpleVector<uint8_t>& out) {
     while (number >= 128) {
         out.push_back((number & 0x7F) | 0x80);
         number >>= 7;
@@ -13,7 +18,7 @@ void encode_varbyte(uint32_t number, SimpleVector<uint8_t>& out) {
     out.push_back(number & 0x7F);
 }
 
-std::pair<uint32_t, size_t> decode_varbyte(const uint8_t* data, size_t offset) {
+inline std::pair<uint32_t, size_t> decode_varbyte(const uint8_t* data, size_t offset) {
     uint32_t value = 0;
     int shift = 0;
     while (true) {
@@ -25,7 +30,234 @@ std::pair<uint32_t, size_t> decode_varbyte(const uint8_t* data, size_t offset) {
     return {value, offset};
 }
 
-void encode_delta_varbyte(const SimpleVector<int>& values, SimpleVector<uint8_t>& out) {
+// Декодирование n значений varbyte подряд без возврата пары на каждое
+// значение; возвращает число прочитанных байт.
+inline size_t decode_varbyte_block(const uint8_t* in, size_t n, uint32_t* out) {
+    const uint8_t* p = in;
+    for (size_t i = 0; i < n; ++i) {
+        uint32_t byte = *p++;
+        if (byte < 0x80) {
+            out[i] = byte;
+            continue;
+        }
+        uint32_t value = byte & 0x7F;
+        int shift = 7;
+        do {
+            byte = *p++;
+            value |= (byte & 0x7F) << shift;
+            shift += 7;
+        } while (byte & 0x80);
+        out[i] = value;
+    }
+    return p - in;
+}
+
+// Пропускает n значений varbyte; возвращает число пропущенных байт.
+inline size_t skip_varbyte(const uint8_t* in, size_t n) {
+    const uint8_t* p = in;
+    while (n > 0) {
+        if (!(*p++ & 0x80)) n--;
+    }
+    return p - in;
+}
+
+// StreamVByte (Lemire, Kurz, Rupp): на каждые 4 числа один управляющий
+// байт с длинами (по 2 бита на число), затем байты самих чисел. Все
+// управляющие байты блока идут перед данными, что позволяет распаковывать
+// по 4 числа за одну перестановку pshufb.
+inline uint8_t streamvbyte_length(uint32_t v) {
+    if (v < (1u << 8)) return 1;
+    if (v < (1u << 16)) return 2;
+    if (v < (1u << 24)) return 3;
+    return 4;
+}
+
+inline void encode_streamvbyte(const uint32_t* in, size_t n, SimpleVector<uint8_t>& out) {
+    size_t ctrl_start = out.size;
+    for (size_t i = 0; i < (n + 3) / 4; ++i) out.push_back(0);
+    for (size_t i = 0; i < n; ++i) {
+        uint8_t len = streamvbyte_length(in[i]);
+        out.data[ctrl_start + i / 4] |= (len - 1) << (2 * (i % 4));
+        for (uint8_t b = 0; b < len; ++b) out.push_back((in[i] >> (8 * b)) & 0xFF);
+    }
+}
+
+struct StreamVByteTables {
+    uint8_t length[256];
+    uint8_t shuffle[256][16];
+
+    StreamVByteTables() {
+        for (int c = 0; c < 256; ++c) {
+            int offset = 0;
+            for (int k = 0; k < 4; ++k) {
+                int len = ((c >> (2 * k)) & 3) + 1;
+                for (int b = 0; b < 4; ++b)
+                    shuffle[c][4 * k + b] = b < len ? offset + b : 0xFF;
+                offset += len;
+            }
+            length[c] = offset;
+        }
+    }
+};
+
+inline const StreamVByteTables& streamvbyte_tables() {
+    static const StreamVByteTables tables;
+    return tables;
+}
+
+inline size_t decode_streamvbyte_scalar(const uint8_t* in, size_t n, uint32_t* out) {
+    const uint8_t* ctrl = in;
+    const uint8_t* p = in + (n + 3) / 4;
+    for (size_t i = 0; i < n; ++i) {
+        int len = ((ctrl[i / 4] >> (2 * (i % 4))) & 3) + 1;
+        uint32_t value = 0;
+        for (int b = 0; b < len; ++b) value |= (uint32_t)p[b] << (8 * b);
+        p += len;
+        out[i] = value;
+    }
+    return p - in;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("ssse3")))
+inline size_t decode_streamvbyte_ssse3(const uint8_t* in, size_t n, uint32_t* out) {
+    const StreamVByteTables& t = streamvbyte_tables();
+    const uint8_t* ctrl = in;
+    size_t ctrl_len = (n + 3) / 4;
+    const uint8_t* p = in + ctrl_len;
+
+    // Длина данных известна из управляющих байтов: загрузки по 16 байт
+    // делаются только пока они не выходят за конец блока.
+    size_t data_len = 0;
+    for (size_t i = 0; i < n / 4; ++i) data_len += t.length[ctrl[i]];
+    const uint8_t* safe_end = p + data_len;
+
+    size_t i = 0;
+    for (; i + 4 <= n && p + 16 <= safe_end; i += 4) {
+        uint8_t c = ctrl[i / 4];
+        __m128i data = _mm_loadu_si128((const __m128i*)p);
+        __m128i mask = _mm_loadu_si128((const __m128i*)t.shuffle[c]);
+        _mm_storeu_si128((__m128i*)(out + i), _mm_shuffle_epi8(data, mask));
+        p += t.length[c];
+    }
+    for (; i < n; ++i) {
+        int len = ((ctrl[i / 4] >> (2 * (i % 4))) & 3) + 1;
+        uint32_t value = 0;
+        for (int b = 0; b < len; ++b) value |= (uint32_t)p[b] << (8 * b);
+        p += len;
+        out[i] = value;
+    }
+    return p - in;
+}
+#endif
+
+inline size_t decode_streamvbyte(const uint8_t* in, size_t n, uint32_t* out) {
+#if defined(__x86_64__) || defined(__i386__)
+    static const bool has_ssse3 = __builtin_cpu_supports("ssse3");
+    if (has_ssse3) return decode_streamvbyte_ssse3(in, n, out);
+#endif
+    return decode_streamvbyte_scalar(in, n, out);
+}
+
+// Кодек блоков постингов, выбирается при построении индекса и
+// записывается в заголовок index.postings.
+enum Codec : uint16_t {
+    CODEC_VARBYTE = 0,
+    CODEC_STREAMVBYTE = 1,
+};
+
+inline bool parse_codec(const std::string& name, Codec& codec) {
+    if (name == "varbyte") codec = CODEC_VARBYTE;
+    else if (name == "streamvbyte") codec = CODEC_STREAMVBYTE;
+    else return false;
+    return true;
+}
+
+inline void encode_block(Codec codec, const uint32_t* in, size_t n, SimpleVector<uint8_t>& out) {
+    if (codec == CODEC_STREAMVBYTE) {
+        encode_streamvbyte(in, n, out);
+        return;
+    }
+    for (size_t i = 0; i < n; ++i) encode_varbyte(in[i], out);
+}
+
+inline size_t decode_block(Codec codec, const uint8_t* in, size_t n, uint32_t* out) {
+    if (codec == CODEC_STREAMVBYTE) return decode_streamvbyte(in, n, out);
+    return decode_varbyte_block(in, n, out);
+}
+
+// Блок doc_id постингов v8 начинается с байта-тега: разности кодеком
+// файла или битовая карта. Бит k карты - документ base + k, где base -
+// последний doc_id предыдущего блока (0 для первого); карта кончается
+// байтом с последним документом блока. Кодировщик берёт то, что короче,
+// поэтому плотные блоки частых термов занимают бит на номер диапазона, а
+// редкие остаются разностями.
+enum DocBlockTag : uint8_t {
+    DOC_BLOCK_GAPS = 0,
+    DOC_BLOCK_BITMAP = 1,
+};
+
+inline void encode_doc_block(Codec codec, const uint32_t* gaps, size_t n, SimpleVector<uint8_t>& out) {
+    size_t start = out.size;
+    out.push_back(DOC_BLOCK_GAPS);
+    encode_block(codec, gaps, n, out);
+
+    uint64_t span = 0;
+    for (size_t i = 0; i < n; ++i) span += gaps[i];
+    size_t bitmap_bytes = span / 8 + 1;
+    if (bitmap_bytes >= out.size - start - 1) return;
+
+    while (out.size > start) out.pop_back();
+    out.push_back(DOC_BLOCK_BITMAP);
+    size_t first = out.size;
+    for (size_t i = 0; i < bitmap_bytes; ++i) out.push_back(0);
+    uint64_t bit = 0;
+    for (size_t i = 0; i < n; ++i) {
+        bit += gaps[i];
+        out.data[first + bit / 8] |= (uint8_t)(1 << (bit % 8));
+    }
+}
+
+// Разности n документов из битовой карты; возвращает длину карты в байтах
+inline size_t decode_bitmap_block(const uint8_t* in, size_t n, uint32_t* gaps) {
+    size_t i = 0;
+    size_t byte = 0;
+    uint32_t prev = 0;
+    while (i < n) {
+        uint32_t bits = in[byte];
+        while (bits && i < n) {
+            uint32_t doc = byte * 8 + __builtin_ctz(bits);
+            gaps[i++] = doc - prev;
+            prev = doc;
+            bits &= bits - 1;
+        }
+        byte++;
+    }
+    return byte;
+}
+
+// Разности doc_id блока v8 с тегом; возвращает число прочитанных байт
+inline size_t decode_doc_block(Codec codec, const uint8_t* in, size_t n, uint32_t* gaps) {
+    if (in[0] == DOC_BLOCK_BITMAP) return 1 + decode_bitmap_block(in + 1, n, gaps);
+    if (in[0] != DOC_BLOCK_GAPS) throw std::runtime_error("Bad postings block tag");
+    return 1 + decode_block(codec, in + 1, n, gaps);
+}
+
+// Длина документа в одном байте: до 31 хранится точно, дальше - порядок
+// и 3 бита мантиссы (ошибка до 1/8, округление вниз). Коды монотонны.
+inline uint8_t encode_length_byte(uint32_t len) {
+    if (len < 32) return (uint8_t)len;
+    int e = 31 - __builtin_clz(len);
+    return (uint8_t)(32 + (e - 5) * 8 + ((len >> (e - 3)) & 7));
+}
+
+inline uint32_t decode_length_byte(uint8_t code) {
+    if (code < 32) return code;
+    int e = 5 + (code - 32) / 8;
+    return (uint32_t)(8 + (code - 32) % 8) << (e - 3);
+}
+
+inline void encode_delta_varbyte(const SimpleVector<int>& values, SimpleVector<uint8_t>& out) {
     int prev = 0;
     for (size_t i = 0; i < values.size; ++i) {
         int delta = values[i] - prev;
@@ -34,6 +266,99 @@ void encode_delta_varbyte(const SimpleVector<int>& values, SimpleVector<uint8_t>
     }
 }
 
+// LZ77 в формате блоков LZ4: последовательности из байта-маркера (старшие
+// 4 бита - число литералов, младшие - длина совпадения минус 4, значение
+// 15 продолжается байтами до первого, меньшего 255), литералов, смещения
+// совпадения (uint16) и продолжения длины совпадения. Последняя
+// последовательность состоит из одних литералов. Сжатие жадное, с
+// хеш-таблицей последних позиций 4-байтовых подстрок: для коротких
+// повторяющихся строк (адреса одного сайта, похожие заголовки) этого
+// хватает, а распаковка - одно копирование на последовательность.
+const size_t LZ_MIN_MATCH = 4;
+const int LZ_HASH_BITS = 12;
+
+inline void lz_put_length(size_t len, SimpleVector<uint8_t>& out) {
+    while (len >= 255) {
+        out.push_back(255);
+        len -= 255;
+    }
+    out.push_back((uint8_t)len);
+}
+
+inline void lz_put_sequence(const uint8_t* lit, size_t lit_len, size_t offset, size_t match_len,
+                            SimpleVector<uint8_t>& out) {
+    size_t m = match_len ? match_len - LZ_MIN_MATCH : 0;
+    out.push_back((uint8_t)((std::min<size_t>(lit_len, 15) << 4) | std::min<size_t>(m, 15)));
+    if (lit_len >= 15) lz_put_length(lit_len - 15, out);
+    for (size_t i = 0; i < lit_len; ++i) out.push_back(lit[i]);
+    if (match_len == 0) return;
+    out.push_back((uint8_t)offset);
+    out.push_back((uint8_t)(offset >> 8));
+    if (m >= 15) lz_put_length(m - 15, out);
+}
+
+inline void lz_compress(const uint8_t* in, size_t n, SimpleVector<uint8_t>& out) {
+    uint32_t table[1 << LZ_HASH_BITS] = {};
+    size_t anchor = 0, i = 0;
+    while (i + LZ_MIN_MATCH <= n) {
+        uint32_t seq;
+        std::memcpy(&seq, in + i, 4);
+        uint32_t h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        size_t cand = table[h];
+        table[h] = (uint32_t)i + 1;
+        uint32_t prev;
+        if (cand == 0 || i - (cand - 1) > 0xFFFF || (std::memcpy(&prev, in + cand - 1, 4), prev != seq)) {
+            i++;
+            continue;
+        }
+        size_t from = cand - 1, len = LZ_MIN_MATCH;
+        while (i + len < n && in[from + len] == in[i + len]) len++;
+        lz_put_sequence(in + anchor, i - anchor, i - from, len, out);
+        i += len;
+        anchor = i;
+    }
+    lz_put_sequence(in + anchor, n - anchor, 0, 0, out);
+}
+
+// Распаковывает ровно raw_size байт в out; на повреждённых данных
+// бросает std::runtime_error
+inline void lz_decompress(const uint8_t* in, size_t n, uint8_t* out, size_t raw_size) {
+    size_t ip = 0, op = 0;
+    auto get_length = [&](size_t len) {
+        uint8_t b;
+        do {
+            if (ip >= n) throw std::runtime_error("Truncated LZ block");
+            b = in[ip++];
+            len += b;
+        } while (b == 255);
+        return len;
+    };
+    while (true) {
+        if (ip >= n) throw std::runtime_error("Truncated LZ block");
+        uint8_t token = in[ip++];
+        size_t lit = token >> 4;
+        if (lit == 15) lit = get_length(lit);
+        if (lit > n - ip || lit > raw_size - op) throw std::runtime_error("Bad LZ literals");
+        std::memcpy(out + op, in + ip, lit);
+        ip += lit;
+        op += lit;
+        if (ip == n) break;
+        if (n - ip < 2) throw std::runtime_error("Truncated LZ block");
+        size_t offset = in[ip] | (size_t)in[ip + 1] << 8;
+        ip += 2;
+        size_t len = token & 15;
+        if (len == 15) len = get_length(len);
+        len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || len > raw_size - op) throw std::runtime_error("Bad LZ match");
+        // Совпадение может перекрывать само себя (offset < len)
+        const uint8_t* from = out + op - offset;
+        if (offset >= len) std::memcpy(out + op, from, len);
+        else for (size_t k = 0; k < len; ++k) out[op + k] = from[k];
+        op += len;
+    }
+    if (op != raw_size) throw std::runtime_error("Bad LZ block size");
+}
+
 }
 
 #endif
@@ -0,0 +1,130 @@
+#ifndef DOCSTORE_HPP
+#define DOCSTORE_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include "common.hpp"
+#include "compression.hpp"
+#include "mmap_file.hpp"
+
+// Адреса и заголовки документов, index.docs. Файл отображается в память и
+// читается по требованию через таблицу смещений: в памяти процесса
+// оказываются только страницы прочитанных документов, а не все строки
+// корпуса.
+//
+// v3: "DOCS", версия (uint16), число документов (uint32), смещение записи
+// документа от начала файла (uint64 на документ), затем записи: (uint16
+// длина, url), (uint16 длина, title).
+// v4: те же записи подряд по BLOCK_DOCS документов, каждый блок сжат
+// Compression::lz_compress. После числа документов - размер блока в
+// документах (uint16) и смещения блоков (uint64, на одно больше числа
+// блоков: последнее - конец файла), затем блоки: длина распакованных
+// записей (uint32) и сжатые байты.
+namespace DocStore {
+
+const uint16_t RAW_VERSION = 3;
+const uint16_t BLOCK_VERSION = 4;
+const uint16_t BLOCK_DOCS = 32;
+
+// Последний распакованный блок v4; у каждого читающего потока свой
+struct BlockBuffer {
+    uint64_t store = 0;
+    uint32_t block = 0;
+    std::string data;
+};
+
+class Reader {
+public:
+    void open(const std::string& path) {
+        file.open(path);
+        if (file.size < 10 || std::memcmp(file.data, "DOCS", 4) != 0)
+            throw std::runtime_error("Bad header in " + path);
+        version = load_le<uint16_t>(file.data + 4);
+        count = load_le<uint32_t>(file.data + 6);
+        if (version == BLOCK_VERSION) {
+            if (file.size < 12) throw std::runtime_error("Truncated " + path);
+            block_docs = load_le<uint16_t>(file.data + 10);
+            if (block_docs == 0) throw std::runtime_error("Bad block size in " + path);
+            size_t blocks = ((size_t)count + block_docs - 1) / block_docs;
+            table = file.data + 12;
+            if (file.size < 12 + (blocks + 1) * 8 || load_le<uint64_t>(table + blocks * 8) > file.size)
+                throw std::runtime_error("Truncated " + path);
+        } else if (version == RAW_VERSION) {
+            table = file.data + 10;
+            if (file.size < 10 + (size_t)count * 8) throw std::runtime_error("Truncated " + path);
+        } else {
+            throw std::runtime_error("Unsupported docs version in " + path);
+        }
+        static std::atomic<uint64_t> next_store{0};
+        store = ++next_store;
+    }
+
+    uint32_t size() const { return count; }
+
+    bool compressed() const { return version == BLOCK_VERSION; }
+
+    // url и title документа id < size(). В v4 представления смотрят в buf и
+    // действительны до следующего чтения с тем же buf, в v3 - пока открыт
+    // файл.
+    void get(uint32_t id, BlockBuffer& buf, std::string_view& url, std::string_view& title) const {
+        const uint8_t* p;
+        const uint8_t* end;
+        if (version == RAW_VERSION) {
+            p = file.data + load_le<uint64_t>(table + (size_t)id * 8);
+            end = file.data + file.size;
+        } else {
+            uint32_t block = id / block_docs;
+            if (buf.store != store || buf.block != block) unpack(block, buf);
+            p = (const uint8_t*)buf.data.data();
+            end = p + buf.data.size();
+            for (uint32_t i = block * block_docs; i < id; ++i) p = skip_record(p, end);
+        }
+        url = read_string(p, end);
+        title = read_string(p, end);
+    }
+
+private:
+    MappedFile file;
+    uint16_t version = 0;
+    uint32_t count = 0;
+    uint16_t block_docs = 0;
+    const uint8_t* table = nullptr;
+    // Номер открытия: отличает блоки этого файла в буферах потоков от
+    // блоков закрытых хранилищ, даже если память объекта использована снова
+    uint64_t store = 0;
+
+    void unpack(uint32_t block, BlockBuffer& buf) const {
+        uint64_t start = load_le<uint64_t>(table + (size_t)block * 8);
+        uint64_t stop = load_le<uint64_t>(table + (size_t)block * 8 + 8);
+        if (start + 4 > stop || stop > file.size) throw std::runtime_error("Bad docs block offset");
+        uint32_t raw = load_le<uint32_t>(file.data + start);
+        buf.store = 0;
+        buf.data.resize(raw);
+        Compression::lz_decompress(file.data + start + 4, stop - start - 4, (uint8_t*)&buf.data[0], raw);
+        buf.store = store;
+        buf.block = block;
+    }
+
+    static std::string_view read_string(const uint8_t*& p, const uint8_t* end) {
+        if (end - p < 2) throw std::runtime_error("Truncated docs record");
+        size_t len = load_le<uint16_t>(p);
+        if ((size_t)(end - p) < 2 + len) throw std::runtime_error("Truncated docs record");
+        std::string_view s((const char*)p + 2, len);
+        p += 2 + len;
+        return s;
+    }
+
+    static const uint8_t* skip_record(const uint8_t* p, const uint8_t* end) {
+        read_string(p, end);
+        read_string(p, end);
+        return p;
+    }
+};
+
+}
+
+#endif
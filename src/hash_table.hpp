@@ -2,8 +2,17 @@
 #define HASH_TABLE_HPP
 
 #include "common.hpp"
+#include "arena.hpp"
 #include <string>
+#include <string_view>
 #include <utility>
+#include <type_traits>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 template <typename T>
 class HashMap
@@ -277,4 +286,357 @@ public:
     Iterator end() { return Iterator(table + capacity, table + capacity); }
 };
 
+// Хеш строки в стиле wyhash: 64-битные чтения и перемешивание через
+// 128-битное произведение.
+namespace FlatHash
+{
+    inline uint64_t mix(uint64_t a, uint64_t b)
+    {
+        __uint128_t r = (__uint128_t)a * b;
+        return (uint64_t)r ^ (uint64_t)(r >> 64);
+    }
+
+    inline uint64_t read64(const uint8_t *p)
+    {
+        uint64_t v;
+        std::memcpy(&v, p, 8);
+        return v;
+    }
+
+    inline uint64_t read32(const uint8_t *p)
+    {
+        uint32_t v;
+        std::memcpy(&v, p, 4);
+        return v;
+    }
+
+    inline uint64_t hash(std::string_view key)
+    {
+        const uint64_t P0 = 0xa0761d6478bd642full, P1 = 0xe7037ed1a0b428dbull;
+        const uint64_t P2 = 0x8ebc6af09c88c6e3ull, P3 = 0x589965cc75374cc3ull;
+        const uint8_t *p = (const uint8_t *)key.data();
+        size_t len = key.size();
+        uint64_t seed = P0;
+        uint64_t a, b;
+        if (len <= 16)
+        {
+            if (len >= 4)
+            {
+                a = (read32(p) << 32) | read32(p + ((len >> 3) << 2));
+                b = (read32(p + len - 4) << 32) | read32(p + len - 4 - ((len >> 3) << 2));
+            }
+            else if (len > 0)
+            {
+                a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+                b = 0;
+            }
+            else
+                a = b = 0;
+        }
+        else
+        {
+            size_t i = len;
+            if (i > 48)
+            {
+                uint64_t see1 = seed, see2 = seed;
+                do
+                {
+                    seed = mix(read64(p) ^ P1, read64(p + 8) ^ seed);
+                    see1 = mix(read64(p + 16) ^ P2, read64(p + 24) ^ see1);
+                    see2 = mix(read64(p + 32) ^ P3, read64(p + 40) ^ see2);
+                    p += 48;
+                    i -= 48;
+                } while (i > 48);
+                seed ^= see1 ^ see2;
+            }
+            while (i > 16)
+            {
+                seed = mix(read64(p) ^ P1, read64(p + 8) ^ seed);
+                i -= 16;
+                p += 16;
+            }
+            a = read64(p + i - 16);
+            b = read64(p + i - 8);
+        }
+        __uint128_t r = (__uint128_t)(a ^ P1) * (b ^ seed);
+        return mix((uint64_t)r ^ P0 ^ len, (uint64_t)(r >> 64) ^ P1);
+    }
+}
+
+// Открытая адресация в духе Swiss table: ёмкость - степень двойки, на
+// слот приходится управляющий байт (EMPTY или 7 младших бит хеша), поиск
+// сравнивает сразу группу из 16 байт (SSE2) и сверяет строки только при
+// совпадении отпечатка и полного хеша. Ключи копируются в арену и после
+// вставки не двигаются, при росте таблицы переносятся только слоты.
+// erase() оставляет в слоте метку DELETED: поиск идёт сквозь неё, вставка
+// занимает её заново. Когда меток и мёртвых ключей накапливается много,
+// таблица перестраивается той же ёмкости, и живые ключи переписываются в
+// новую арену - только тогда ранее выданные key перестают быть валидны.
+template <typename T>
+class FlatHashMap
+{
+public:
+    struct Entry
+    {
+        std::string_view key;
+        uint64_t hash;
+        T value;
+    };
+
+private:
+    static const size_t GROUP = 16;
+    static const uint8_t EMPTY = 0x80;
+    static const uint8_t DELETED = 0xFE;
+
+    uint8_t *ctrl;
+    Entry *slots;
+    size_t capacity;
+    size_t count;
+    size_t deleted;
+    size_t dead_key_bytes;
+    ByteArena keys;
+
+    static uint8_t fingerprint(uint64_t h) { return h & 0x7F; }
+    static bool is_full(uint8_t c) { return c < 0x80; }
+
+    // Биты позиций группы, где управляющий байт равен b
+    static uint32_t match(const uint8_t *g, uint8_t b)
+    {
+#if defined(__SSE2__)
+        __m128i v = _mm_loadu_si128((const __m128i *)g);
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8((char)b)));
+#else
+        uint32_t res = 0;
+        for (size_t i = 0; i < GROUP; ++i)
+            if (g[i] == b)
+                res |= 1u << i;
+        return res;
+#endif
+    }
+
+    // Биты позиций группы со свободными слотами (EMPTY или DELETED)
+    static uint32_t match_free(const uint8_t *g)
+    {
+#if defined(__SSE2__)
+        return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)g));
+#else
+        uint32_t res = 0;
+        for (size_t i = 0; i < GROUP; ++i)
+            if (!is_full(g[i]))
+                res |= 1u << i;
+        return res;
+#endif
+    }
+
+    void set_ctrl(size_t i, uint8_t b)
+    {
+        ctrl[i] = b;
+        // Хвост дублирует начало, чтобы группу можно было читать с любого слота
+        if (i < GROUP - 1)
+            ctrl[capacity + i] = b;
+    }
+
+    size_t find_slot(std::string_view key, uint64_t h) const
+    {
+        if (capacity == 0)
+            return SIZE_MAX;
+        size_t mask = capacity - 1;
+        size_t pos = (h >> 7) & mask;
+        uint8_t fp = fingerprint(h);
+        for (size_t step = GROUP;; step += GROUP)
+        {
+            const uint8_t *g = ctrl + pos;
+            for (uint32_t m = match(g, fp); m; m &= m - 1)
+            {
+                size_t i = (pos + __builtin_ctz(m)) & mask;
+                if (slots[i].hash == h && slots[i].key == key)
+                    return i;
+            }
+            if (match(g, EMPTY))
+                return SIZE_MAX;
+            pos = (pos + step) & mask;
+        }
+    }
+
+    size_t free_slot(uint64_t h) const
+    {
+        size_t mask = capacity - 1;
+        size_t pos = (h >> 7) & mask;
+        for (size_t step = GROUP;; step += GROUP)
+        {
+            uint32_t m = match_free(ctrl + pos);
+            if (m)
+                return (pos + __builtin_ctz(m)) & mask;
+            pos = (pos + step) & mask;
+        }
+    }
+
+    void rehash(size_t new_capacity)
+    {
+        uint8_t *old_ctrl = ctrl;
+        Entry *old_slots = slots;
+        size_t old_capacity = capacity;
+
+        // Мёртвые ключи занимают больше половины арены: живые переезжают
+        ByteArena fresh;
+        bool compact = dead_key_bytes > 0 && dead_key_bytes * 2 > keys.bytes();
+
+        capacity = new_capacity;
+        ctrl = (uint8_t *)std::malloc(capacity + GROUP - 1);
+        slots = (Entry *)std::malloc(capacity * sizeof(Entry));
+        if (!ctrl || !slots)
+            throw std::bad_alloc();
+        std::memset(ctrl, EMPTY, capacity + GROUP - 1);
+
+        for (size_t i = 0; i < old_capacity; ++i)
+        {
+            if (!is_full(old_ctrl[i]))
+                continue;
+            size_t j = free_slot(old_slots[i].hash);
+            set_ctrl(j, fingerprint(old_slots[i].hash));
+            new (slots + j) Entry(std::move(old_slots[i]));
+            old_slots[i].~Entry();
+            if (compact)
+                slots[j].key = intern(fresh, slots[j].key);
+        }
+        std::free(old_ctrl);
+        std::free(old_slots);
+        deleted = 0;
+        if (compact)
+        {
+            keys.swap(fresh);
+            dead_key_bytes = 0;
+        }
+    }
+
+    static std::string_view intern(ByteArena &arena, std::string_view key)
+    {
+        uint8_t *copy = arena.alloc(key.size() == 0 ? 1 : key.size());
+        std::memcpy(copy, key.data(), key.size());
+        return std::string_view((const char *)copy, key.size());
+    }
+
+    // Заполнение не выше 7/8
+    void grow_for(size_t n)
+    {
+        size_t need = capacity == 0 ? GROUP : capacity;
+        while (n > need - need / 8)
+            need *= 2;
+        if (need != capacity)
+            rehash(need);
+        else if (n + deleted > capacity - capacity / 8)
+            rehash(capacity);
+    }
+
+    Entry &insert_new(std::string_view key, uint64_t h)
+    {
+        grow_for(count + 1);
+        size_t i = free_slot(h);
+        if (ctrl[i] == DELETED)
+            deleted--;
+        set_ctrl(i, fingerprint(h));
+        new (slots + i) Entry{intern(keys, key), h, T()};
+        count++;
+        return slots[i];
+    }
+
+public:
+    FlatHashMap() : ctrl(nullptr), slots(nullptr), capacity(0), count(0), deleted(0), dead_key_bytes(0) {}
+
+    FlatHashMap(const FlatHashMap &) = delete;
+    FlatHashMap &operator=(const FlatHashMap &) = delete;
+
+    ~FlatHashMap()
+    {
+        for (size_t i = 0; i < capacity; ++i)
+            if (is_full(ctrl[i]))
+                slots[i].~Entry();
+        std::free(ctrl);
+        std::free(slots);
+    }
+
+    void reserve(size_t n) { grow_for(n); }
+
+    size_t size() const { return count; }
+
+    T *get(std::string_view key)
+    {
+        size_t i = find_slot(key, FlatHash::hash(key));
+        return i == SIZE_MAX ? nullptr : &slots[i].value;
+    }
+
+    const T *get(std::string_view key) const
+    {
+        size_t i = find_slot(key, FlatHash::hash(key));
+        return i == SIZE_MAX ? nullptr : &slots[i].value;
+    }
+
+    T &operator[](std::string_view key)
+    {
+        uint64_t h = FlatHash::hash(key);
+        size_t i = find_slot(key, h);
+        if (i != SIZE_MAX)
+            return slots[i].value;
+        return insert_new(key, h).value;
+    }
+
+    void insert(std::string_view key, T &&value)
+    {
+        (*this)[key] = std::move(value);
+    }
+
+    void insert(std::string_view key, const T &value)
+    {
+        (*this)[key] = value;
+    }
+
+    bool erase(std::string_view key)
+    {
+        size_t i = find_slot(key, FlatHash::hash(key));
+        if (i == SIZE_MAX)
+            return false;
+        dead_key_bytes += key.size() == 0 ? 1 : key.size();
+        slots[i].~Entry();
+        set_ctrl(i, DELETED);
+        count--;
+        deleted++;
+        return true;
+    }
+
+    // Const - обход константной таблицы: записи только для чтения
+    template <bool Const>
+    class BasicIterator
+    {
+    public:
+        typedef typename std::conditional<Const, const FlatHashMap, FlatHashMap>::type Map;
+        typedef typename std::conditional<Const, const Entry, Entry>::type Value;
+
+        Map *map;
+        size_t i;
+        BasicIterator(Map *m, size_t start) : map(m), i(start)
+        {
+            while (i < map->capacity && !is_full(map->ctrl[i]))
+                i++;
+        }
+        bool operator!=(const BasicIterator &other) { return i != other.i; }
+        void operator++()
+        {
+            do
+            {
+                i++;
+            } while (i < map->capacity && !is_full(map->ctrl[i]));
+        }
+        Value &operator*() const { return map->slots[i]; }
+        Value *operator->() const { return map->slots + i; }
+    };
+
+    typedef BasicIterator<false> Iterator;
+    typedef BasicIterator<true> ConstIterator;
+
+    Iterator begin() { return Iterator(this, 0); }
+    Iterator end() { return Iterator(this, capacity); }
+    ConstIterator begin() const { return ConstIterator(this, 0); }
+    ConstIterator end() const { return ConstIterator(this, capacity); }
+};
+
 #endif
@@ -1,196 +1,2204 @@
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <fstream>
 #include <sstream>
 #include <algorithm>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <cstdlib>
+#include <cstdio>
+#include <cerrno>
+#include <filesystem>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "common.hpp"
 #include "hash_table.hpp"
 #include "tokenizer_lib.hpp"
 #include "compression.hpp"
+#include "arena.hpp"
+#include "mmap_file.hpp"
+#include "segments.hpp"
+#include "docstore.hpp"
+#include "shards.hpp"
 
+// Постинги терма копятся в арене потока одним varbyte-потоком: на документ
+// разность doc_id, первая позиция плюс один, разности следующих позиций
+// (всегда > 0) и 0 как конец документа. Ноль последнего документа
+// дописывает seal(), когда терм больше не пополняется.
 struct TermPostings
 {
-  struct DocEntry
-  {
-    int doc_id;
-    SimpleVector<int> positions;
-  };
+  ByteChain chain;
+  uint32_t doc_freq = 0;
+  int last_doc = -1;
+  int last_pos = 0;
 
-  SimpleVector<DocEntry> doc_entries;
-
-  void add_position(int doc_id, int pos)
+  void add_position(ByteArena &arena, int doc_id, int pos)
   {
-    if (doc_entries.size == 0 || doc_entries[doc_entries.size - 1].doc_id != doc_id)
+    if (doc_id != last_doc)
     {
-      DocEntry entry;
-      entry.doc_id = doc_id;
-      entry.positions.push_back(pos);
-      doc_entries.push_back(std::move(entry));
+      if (last_doc >= 0)
+        chain.push(arena, 0);
+      chain.push_varbyte(arena, doc_id - std::max(last_doc, 0));
+      chain.push_varbyte(arena, pos + 1);
+      last_doc = doc_id;
+      doc_freq++;
     }
     else
     {
-      doc_entries[doc_entries.size - 1].positions.push_back(pos);
+      chain.push_varbyte(arena, pos - last_pos);
+    }
+    last_pos = pos;
+  }
+
+  void seal(ByteArena &arena)
+  {
+    if (doc_freq > 0)
+      chain.push(arena, 0);
+  }
+};
+
+// Частичный индекс потока: терм -> номер, постинги лежат подряд по
+// номеру. Номер, запомненный в кеше стемм, ведёт прямо к постингам горячего
+// слова без поиска в хеш-таблице.
+struct PartialIndex
+{
+  FlatHashMap<uint32_t> ids;
+  SimpleVector<TermPostings> postings;
+
+  // Номер терма; новый терм получает следующий номер, added = true
+  uint32_t find_or_add(std::string_view term, bool &added)
+  {
+    uint32_t &id = ids[term];
+    added = ids.size() > postings.size;
+    if (added)
+    {
+      id = postings.size;
+      postings.push_back(TermPostings());
     }
+    return id;
   }
 };
 
-HashMap<TermPostings> index_map;
-SimpleVector<std::string> doc_urls;
-SimpleVector<std::string> doc_titles;
+SimpleVector<uint32_t> doc_lengths;
 
 const char MAGIC_DOCS[] = "DOCS";
 const char MAGIC_DICT[] = "DICT";
 const char MAGIC_POST[] = "POST";
-const uint16_t VERSION = 3;
+const char MAGIC_POSN[] = "POSN";
+const char MAGIC_LENS[] = "LENS";
+// index.docs (docstore.hpp): v3 без сжатия или v4 блоками с --docs-codec lz
+bool compress_docs = false;
+// Длины документов: число документов, сумма токенов, минимальная длина и по
+// байту на документ (Compression::encode_length_byte).
+const uint16_t LENS_VERSION = 1;
+// Словарь v4: термы отсортированы и сжаты front coding блоками по
+// DICT_BLOCK_SIZE, в конце файла лежит таблица смещений блоков.
+const uint16_t DICT_VERSION = 4;
+const uint16_t DICT_BLOCK_SIZE = 16;
 
-void write_index(const std::string &out_dir)
+struct TermRef
 {
-  std::cerr << "Writing index to " << out_dir << "..." << std::endl;
+  std::string_view term;
+  TermPostings *postings;
+};
 
-  std::string path_docs = out_dir + "/index.docs";
-  std::string path_dict = out_dir + "/index.dict";
-  std::string path_post = out_dir + "/index.postings";
+// Постинги v8: doc_id/freq пишутся в index.postings, позиции - отдельным
+// потоком в index.positions, чтобы булевы запросы их не читали. Запись
+// терма: doc_freq, смещение его позиций в index.positions (uint64),
+// таблица пропусков из четвёрок uint32 (последний doc_id блока, смещение
+// блока, смещение позиций блока, максимальный freq в блоке - верхняя
+// граница для block-max WAND) и блоки по POST_BLOCK_SIZE документов:
+// сначала разности doc_id, затем freq, оба массива сжаты кодеком из
+// заголовка файла. Разности doc_id идут сквозь границы блоков, разности
+// позиций (всегда varbyte) начинаются с нуля в каждом документе. doc_id
+// блока предваряет тег: разности кодеком или битовая карта диапазона
+// блока, если она короче (Compression::encode_doc_block), - так плотные
+// блоки частых термов занимают бит на номер, а редкие термы остаются
+// разностями.
+const uint16_t POST_VERSION = 8;
+const uint16_t POST_BLOCK_SIZE = 128;
+// Наибольший размер блока, который читает слияние сегментов (как в поиске)
+const uint16_t POST_BLOCK_SIZE_MAX = 1024;
+Compression::Codec post_codec = Compression::CODEC_VARBYTE;
 
-  std::ofstream f_docs(path_docs, std::ios::binary);
-  f_docs.write(MAGIC_DOCS, 4);
-  f_docs.write((char *)&VERSION, 2);
-  uint32_t doc_count = doc_urls.size;
-  f_docs.write((char *)&doc_count, 4);
+void append_u32(uint32_t value, SimpleVector<uint8_t> &out)
+{
+  for (int b = 0; b < 4; ++b)
+    out.push_back((value >> (8 * b)) & 0xFF);
+}
 
-  SimpleVector<uint64_t> offsets;
-  uint64_t current_offset = 4 + 2 + 4 + (doc_count * 8);
+void append_u64(uint64_t value, SimpleVector<uint8_t> &out)
+{
+  for (int b = 0; b < 8; ++b)
+    out.push_back((value >> (8 * b)) & 0xFF);
+}
 
-  for (size_t i = 0; i < doc_count; ++i)
+void write_varbyte(std::ofstream &out, uint32_t value)
+{
+  SimpleVector<uint8_t> buf;
+  Compression::encode_varbyte(value, buf);
+  out.write((char *)buf.data, buf.size);
+}
+
+// in.get() возвращает байт или отрицательное значение в конце потока
+template <typename In>
+bool read_varbyte(In &in, uint32_t &value)
+{
+  value = 0;
+  for (int shift = 0; shift < 35; shift += 7)
   {
-    offsets.push_back(current_offset);
-    uint16_t url_len = doc_urls[i].size();
-    uint16_t title_len = doc_titles[i].size();
-    current_offset += 2 + url_len + 2 + title_len;
+    int c = in.get();
+    if (c < 0)
+      return false;
+    value |= (uint32_t)(c & 0x7F) << shift;
+    if (!(c & 0x80))
+      return true;
   }
+  return false;
+}
 
-  for (size_t i = 0; i < doc_count; ++i)
+// Пишет словарь, постинги и позиции потоком: термы подаются в порядке
+// сортировки, документы терма - по возрастанию doc_id. В памяти держится
+// только сжатый doc_id/freq поток текущего терма, позиции сразу уходят
+// в index.positions. Число термов попадает в заголовок словаря при close().
+class PostingsWriter
+{
+  std::ofstream f_dict;
+  std::ofstream f_post;
+  std::ofstream f_pos;
+
+  uint32_t term_count = 0;
+  SimpleVector<uint64_t> block_offsets;
+  std::string prev_term;
+  uint64_t prev_offset = 0;
+
+  // Текущий терм
+  uint32_t doc_freq = 0;
+  uint32_t docs_added = 0;
+  uint64_t pos_base = 0;
+  uint64_t pos_written = 0;
+  int prev_doc_id = 0;
+  SimpleVector<uint8_t> data;
+  SimpleVector<uint8_t> pos_buf;
+  SimpleVector<uint32_t> skips;
+  uint32_t gaps[POST_BLOCK_SIZE];
+  uint32_t freqs[POST_BLOCK_SIZE];
+  size_t in_block = 0;
+  uint32_t block_pos = 0;
+
+  void flush_positions()
   {
-    f_docs.write((char *)&offsets[i], 8);
+    f_pos.write((char *)pos_buf.data, pos_buf.size);
+    pos_written += pos_buf.size;
+    pos_buf.reset();
   }
 
-  for (size_t i = 0; i < doc_count; ++i)
+  void flush_block()
+  {
+    if (in_block == 0)
+      return;
+    uint32_t max_freq = 0;
+    for (size_t i = 0; i < in_block; ++i)
+      max_freq = std::max(max_freq, freqs[i]);
+    skips.push_back(prev_doc_id);
+    skips.push_back(data.size);
+    skips.push_back(block_pos);
+    skips.push_back(max_freq);
+    Compression::encode_doc_block(post_codec, gaps, in_block, data);
+    Compression::encode_block(post_codec, freqs, in_block, data);
+    in_block = 0;
+  }
+
+public:
+  void open(const std::string &out_dir)
+  {
+    f_dict.open(out_dir + "/index.dict", std::ios::binary);
+    f_post.open(out_dir + "/index.postings", std::ios::binary);
+    f_pos.open(out_dir + "/index.positions", std::ios::binary);
+    if (!f_dict || !f_post || !f_pos)
+      throw std::runtime_error("Cannot create index files in " + out_dir);
+
+    uint32_t zero32 = 0;
+    uint64_t zero64 = 0;
+    f_dict.write(MAGIC_DICT, 4);
+    f_dict.write((char *)&DICT_VERSION, 2);
+    f_dict.write((char *)&zero32, 4);
+    f_dict.write((char *)&DICT_BLOCK_SIZE, 2);
+    f_dict.write((char *)&zero32, 4);
+    f_dict.write((char *)&zero64, 8);
+
+    f_post.write(MAGIC_POST, 4);
+    f_post.write((char *)&POST_VERSION, 2);
+    f_post.write((char *)&POST_BLOCK_SIZE, 2);
+    uint16_t codec = post_codec;
+    f_post.write((char *)&codec, 2);
+
+    f_pos.write(MAGIC_POSN, 4);
+    f_pos.write((char *)&POST_VERSION, 2);
+  }
+
+  void begin_term(std::string_view full_term, uint32_t df)
+  {
+    std::string_view term = full_term.substr(0, 255);
+    uint64_t post_offset = f_post.tellp();
+
+    if (term_count % DICT_BLOCK_SIZE == 0)
+    {
+      block_offsets.push_back(f_dict.tellp());
+      uint8_t term_len = term.size();
+      f_dict.write((char *)&term_len, 1);
+      f_dict.write(term.data(), term_len);
+      f_dict.write((char *)&post_offset, 8);
+    }
+    else
+    {
+      size_t prefix = 0;
+      while (prefix < prev_term.size() && prefix < term.size() && prev_term[prefix] == term[prefix])
+        prefix++;
+      uint8_t prefix_len = prefix;
+      uint8_t suffix_len = term.size() - prefix;
+      f_dict.write((char *)&prefix_len, 1);
+      f_dict.write((char *)&suffix_len, 1);
+      f_dict.write(term.data() + prefix, suffix_len);
+      write_varbyte(f_dict, post_offset - prev_offset);
+    }
+    write_varbyte(f_dict, df);
+    prev_term = term;
+    prev_offset = post_offset;
+    term_count++;
+
+    doc_freq = df;
+    docs_added = 0;
+    pos_base = f_pos.tellp();
+    pos_written = 0;
+    prev_doc_id = 0;
+    data.reset();
+    skips.reset();
+    in_block = 0;
+  }
+
+  void add_doc(int doc_id, const SimpleVector<int> &positions)
+  {
+    if (in_block == 0)
+      block_pos = pos_written + pos_buf.size;
+    gaps[in_block] = doc_id - prev_doc_id;
+    freqs[in_block] = positions.size;
+    in_block++;
+    prev_doc_id = doc_id;
+    docs_added++;
+
+    int prev_pos = 0;
+    for (size_t j = 0; j < positions.size; ++j)
+    {
+      Compression::encode_varbyte(positions.data[j] - prev_pos, pos_buf);
+      prev_pos = positions.data[j];
+    }
+    if (in_block == POST_BLOCK_SIZE)
+    {
+      flush_block();
+      if (pos_buf.size >= (1 << 16))
+        flush_positions();
+    }
+  }
+
+  void end_term()
+  {
+    flush_block();
+    flush_positions();
+    if (docs_added != doc_freq)
+      throw std::runtime_error("Term " + prev_term + " got a wrong number of documents");
+
+    SimpleVector<uint8_t> out;
+    Compression::encode_varbyte(doc_freq, out);
+    append_u64(pos_base, out);
+    for (size_t i = 0; i < skips.size; ++i)
+      append_u32(skips[i], out);
+    f_post.write((char *)out.data, out.size);
+    f_post.write((char *)data.data, data.size);
+  }
+
+  uint32_t close()
+  {
+    uint64_t index_offset = f_dict.tellp();
+    for (size_t i = 0; i < block_offsets.size; ++i)
+    {
+      f_dict.write((char *)&block_offsets[i], 8);
+    }
+    uint32_t block_count = block_offsets.size;
+    f_dict.seekp(6);
+    f_dict.write((char *)&term_count, 4);
+    f_dict.seekp(12);
+    f_dict.write((char *)&block_count, 4);
+    f_dict.write((char *)&index_offset, 8);
+
+    f_dict.close();
+    f_post.close();
+    f_pos.close();
+    return term_count;
+  }
+};
+
+// Отсортированный поток термов со списками документов: частичный индекс в
+// памяти или сброшенный на диск прогон.
+class TermSource
+{
+public:
+  virtual ~TermSource() {}
+  // Переходит к следующему терму; false, если термы кончились
+  virtual bool next_term() = 0;
+  virtual std::string_view term() const = 0;
+  virtual uint32_t doc_freq() const = 0;
+  // Следующий документ текущего терма; указатель на позиции живёт до
+  // следующего вызова
+  virtual bool next_doc(int &doc_id, const SimpleVector<int> *&positions) = 0;
+};
+
+typedef std::unique_ptr<TermSource> TermSourcePtr;
+
+// Документ из потока постингов (формат TermPostings); doc_id накапливается
+template <typename In>
+bool read_doc(In &in, int &doc_id, SimpleVector<int> &positions)
+{
+  uint32_t gap, v;
+  if (!read_varbyte(in, gap))
+    return false;
+  if (!read_varbyte(in, v) || v == 0)
+    throw std::runtime_error("Broken postings stream");
+  doc_id += gap;
+  positions.reset();
+  int pos = v - 1;
+  positions.push_back(pos);
+  while (true)
+  {
+    if (!read_varbyte(in, v))
+      throw std::runtime_error("Broken postings stream");
+    if (v == 0)
+      return true;
+    pos += v;
+    positions.push_back(pos);
+  }
+}
+
+void seal_postings(PartialIndex &index, ByteArena &arena)
+{
+  for (size_t i = 0; i < index.postings.size; ++i)
+    index.postings[i].seal(arena);
+}
+
+SimpleVector<TermRef> sorted_terms(PartialIndex &index)
+{
+  SimpleVector<TermRef> terms;
+  for (auto it = index.ids.begin(); it != index.ids.end(); ++it)
+  {
+    terms.push_back({it->key, &index.postings[it->value]});
+  }
+  std::sort(terms.begin(), terms.end(), [](const TermRef &a, const TermRef &b)
+            { return a.term < b.term; });
+  return terms;
+}
+
+// Частичный индекс в памяти; потоки термов должны быть запечатаны
+class MemorySource : public TermSource
+{
+  std::unique_ptr<PartialIndex> index;
+  std::unique_ptr<ByteArena> arena;
+  SimpleVector<TermRef> terms;
+  size_t t;
+  bool started;
+  ByteChainReader reader;
+  uint32_t left;
+  int prev_doc;
+  SimpleVector<int> positions_buf;
+
+public:
+  MemorySource(std::unique_ptr<PartialIndex> idx, std::unique_ptr<ByteArena> a)
+      : index(std::move(idx)), arena(std::move(a)), terms(sorted_terms(*index)), t(0), started(false),
+        left(0), prev_doc(0) {}
+
+  bool next_term() override
+  {
+    if (started)
+      t++;
+    started = true;
+    if (t >= terms.size)
+      return false;
+    reader = ByteChainReader(terms[t].postings->chain);
+    left = terms[t].postings->doc_freq;
+    prev_doc = 0;
+    return true;
+  }
+
+  std::string_view term() const override { return terms[t].term; }
+  uint32_t doc_freq() const override { return terms[t].postings->doc_freq; }
+
+  bool next_doc(int &doc_id, const SimpleVector<int> *&positions) override
+  {
+    if (left == 0 || !read_doc(reader, prev_doc, positions_buf))
+      return false;
+    left--;
+    doc_id = prev_doc;
+    positions = &positions_buf;
+    return true;
+  }
+};
+
+// Прогон SPIMI: термы по возрастанию, у каждого varbyte длины и байты
+// терма, varbyte числа документов и поток постингов в формате
+// TermPostings, скопированный из арены как есть.
+void write_run(const std::string &path, PartialIndex &index)
+{
+  std::ofstream f(path, std::ios::binary);
+  if (!f)
+    throw std::runtime_error("Cannot create " + path);
+  SimpleVector<TermRef> terms = sorted_terms(index);
+  SimpleVector<uint8_t> buf;
+  for (size_t t = 0; t < terms.size; ++t)
+  {
+    std::string_view term = terms[t].term;
+    TermPostings &postings = *terms[t].postings;
+    buf.reset();
+    Compression::encode_varbyte(term.size(), buf);
+    for (char c : term)
+      buf.push_back((uint8_t)c);
+    Compression::encode_varbyte(postings.doc_freq, buf);
+    ByteChainReader reader(postings.chain);
+    for (int c = reader.get(); c >= 0; c = reader.get())
+      buf.push_back((uint8_t)c);
+    f.write((char *)buf.data, buf.size);
+  }
+  if (!f)
+    throw std::runtime_error("Cannot write " + path);
+}
+
+class RunSource : public TermSource
+{
+  std::ifstream f;
+  std::string path;
+  std::string cur_term;
+  uint32_t df = 0;
+  uint32_t left = 0;
+  int prev_doc = 0;
+  SimpleVector<int> positions_buf;
+
+  void fail() { throw std::runtime_error("Truncated run " + path); }
+
+  void skip_docs()
+  {
+    const SimpleVector<int> *p;
+    int doc;
+    while (left > 0)
+      next_doc(doc, p);
+  }
+
+public:
+  explicit RunSource(const std::string &p) : f(p, std::ios::binary), path(p)
+  {
+    if (!f)
+      throw std::runtime_error("Cannot open " + path);
+  }
+
+  bool next_term() override
   {
-    uint16_t url_len = doc_urls[i].size();
-    f_docs.write((char *)&url_len, 2);
-    f_docs.write(doc_urls[i].c_str(), url_len);
+    skip_docs();
+    uint32_t len;
+    if (!read_varbyte(f, len))
+      return false;
+    cur_term.resize(len);
+    if (!f.read(&cur_term[0], len) || !read_varbyte(f, df))
+      fail();
+    left = df;
+    prev_doc = 0;
+    return true;
+  }
+
+  std::string_view term() const override { return cur_term; }
+  uint32_t doc_freq() const override { return df; }
 
-    uint16_t title_len = doc_titles[i].size();
-    f_docs.write((char *)&title_len, 2);
-    f_docs.write(doc_titles[i].c_str(), title_len);
+  bool next_doc(int &doc_id, const SimpleVector<int> *&positions) override
+  {
+    if (left == 0)
+      return false;
+    if (!read_doc(f, prev_doc, positions_buf))
+      fail();
+    doc_id = prev_doc;
+    positions = &positions_buf;
+    left--;
+    return true;
   }
-  f_docs.close();
+};
 
-  std::ofstream f_dict(path_dict, std::ios::binary);
-  std::ofstream f_post(path_post, std::ios::binary);
+// Термы готового сегмента (словарь v4, постинги v5-v8) для слияния
+// сегментов. docmap переводит номер документа сегмента в номер в новом
+// сегменте, -1 - удалённый документ; такие документы пропускаются вместе с
+// позициями, а термы, у которых не осталось документов, - целиком. Длины
+// оставшихся документов накапливаются в lengths по их freq.
+class SegmentSource : public TermSource
+{
+  std::string dir;
+  MappedFile dict;
+  MappedFile post;
+  MappedFile pos;
+  const SimpleVector<int> &docmap;
+  SimpleVector<uint32_t> &lengths;
+  bool has_deletions;
 
-  f_dict.write(MAGIC_DICT, 4);
-  f_dict.write((char *)&VERSION, 2);
+  // Курсор по словарю
+  const uint8_t *dp = nullptr;
+  const uint8_t *dict_end = nullptr;
   uint32_t term_count = 0;
-  long term_count_pos = f_dict.tellp();
-  f_dict.write((char *)&term_count, 4);
+  uint32_t term_no = 0;
+  uint16_t dict_block_size = 0;
+  std::string cur_term;
+  uint64_t post_offset = 0;
+
+  // Формат постингов
+  uint16_t version = 0;
+  uint16_t block_size = 0;
+  Compression::Codec codec = Compression::CODEC_VARBYTE;
+  size_t skip_entry_size = 12;
 
-  f_post.write(MAGIC_POST, 4);
-  f_post.write((char *)&VERSION, 2);
+  // Текущий терм
+  uint32_t df = 0;
+  uint32_t live_df = 0;
+  uint32_t block_count = 0;
+  const uint8_t *skips = nullptr;
+  const uint8_t *data = nullptr;
+  const uint8_t *positions_ptr = nullptr;
+  uint32_t left = 0;
+  uint32_t block = 0;
+  uint32_t in_block = 0;
+  uint32_t block_n = 0;
+  int prev_doc = 0;
+  uint32_t gaps[POST_BLOCK_SIZE_MAX];
+  uint32_t freqs[POST_BLOCK_SIZE_MAX];
+  SimpleVector<int> positions_buf;
 
-  for (auto it = index_map.begin(); it != index_map.end(); ++it)
+  void fail(const char *what) { throw std::runtime_error(std::string("Truncated ") + what + " in " + dir); }
+
+  uint32_t read_dict_varbyte()
   {
-    term_count++;
-    std::string term = it->key;
-    TermPostings &postings = it->value;
+    if (dp >= dict_end)
+      fail("dict");
+    auto v = Compression::decode_varbyte(dp, 0);
+    dp += v.second;
+    return v.first;
+  }
 
-    uint64_t post_offset = f_post.tellp();
-    uint32_t doc_freq = postings.doc_entries.size;
+  uint32_t block_docs(uint32_t b) const { return b + 1 < block_count ? block_size : df - b * block_size; }
+  const uint8_t *block_start(uint32_t b) const { return data + load_le<uint32_t>(skips + (size_t)b * skip_entry_size + 4); }
+
+  // Разности doc_id блока в gaps; возвращает число прочитанных байт
+  size_t decode_gaps(const uint8_t *p, uint32_t n)
+  {
+    if (version >= 8)
+      return Compression::decode_doc_block(codec, p, n, gaps);
+    return Compression::decode_block(codec, p, n, gaps);
+  }
+
+  void open_term()
+  {
+    if (post_offset >= post.size)
+      fail("postings");
+    const uint8_t *ptr = post.data + post_offset;
+    auto p = Compression::decode_varbyte(ptr, 0);
+    if (p.first != df)
+      throw std::runtime_error("Dict and postings disagree on " + cur_term + " in " + dir);
+    block_count = (df + block_size - 1) / block_size;
+    positions_ptr = pos.data + load_le<uint64_t>(ptr + p.second);
+    skips = ptr + p.second + 8;
+    data = skips + (size_t)block_count * skip_entry_size;
+
+    live_df = df;
+    if (has_deletions)
+    {
+      live_df = 0;
+      int doc = 0;
+      for (uint32_t b = 0; b < block_count; ++b)
+      {
+        uint32_t n = block_docs(b);
+        decode_gaps(block_start(b), n);
+        for (uint32_t i = 0; i < n; ++i)
+        {
+          doc += gaps[i];
+          if (docmap[doc] >= 0)
+            live_df++;
+        }
+      }
+    }
+    left = df;
+    block = 0;
+    in_block = block_n = 0;
+    prev_doc = 0;
+  }
+
+  bool read_term()
+  {
+    if (term_no >= term_count)
+      return false;
+    if (dp + 2 > dict_end)
+      fail("dict");
+    if (term_no % dict_block_size == 0)
+    {
+      size_t len = *dp++;
+      if (dp + len + 8 > dict_end)
+        fail("dict");
+      cur_term.assign((const char *)dp, len);
+      dp += len;
+      post_offset = load_le<uint64_t>(dp);
+      dp += 8;
+    }
+    else
+    {
+      size_t prefix = *dp++;
+      size_t suffix = *dp++;
+      if (prefix > cur_term.size() || dp + suffix > dict_end)
+        fail("dict");
+      cur_term.resize(prefix);
+      cur_term.append((const char *)dp, suffix);
+      dp += suffix;
+      post_offset += read_dict_varbyte();
+    }
+    df = read_dict_varbyte();
+    term_no++;
+    return true;
+  }
+
+public:
+  SegmentSource(const std::string &segment_dir, const SimpleVector<int> &map, SimpleVector<uint32_t> &lens)
+      : dir(segment_dir), docmap(map), lengths(lens), has_deletions(false)
+  {
+    dict.open(dir + "/index.dict");
+    post.open(dir + "/index.postings");
+    pos.open(dir + "/index.positions");
+    if (dict.size < 24 || std::memcmp(dict.data, MAGIC_DICT, 4) != 0 || load_le<uint16_t>(dict.data + 4) != 4)
+      throw std::runtime_error("Unsupported dict in " + dir);
+    term_count = load_le<uint32_t>(dict.data + 6);
+    dict_block_size = load_le<uint16_t>(dict.data + 10);
+    dict_end = dict.data + load_le<uint64_t>(dict.data + 16);
+    dp = dict.data + 24;
+    if (dict_block_size == 0 || dict_end > dict.data + dict.size)
+      fail("dict");
 
-    uint8_t term_len = std::min((size_t)255, term.size());
-    f_dict.write((char *)&term_len, 1);
-    f_dict.write(term.c_str(), term_len);
-    f_dict.write((char *)&post_offset, 8);
-    f_dict.write((char *)&doc_freq, 4);
+    version = post.size >= 6 ? load_le<uint16_t>(post.data + 4) : 0;
+    if (post.size < 10 || std::memcmp(post.data, MAGIC_POST, 4) != 0 || version < 5 || version > 8)
+      throw std::runtime_error("Unsupported postings in " + dir);
+    block_size = load_le<uint16_t>(post.data + 6);
+    if (block_size == 0 || block_size > POST_BLOCK_SIZE_MAX)
+      throw std::runtime_error("Bad postings block size in " + dir);
+    if (version >= 6)
+      codec = (Compression::Codec)load_le<uint16_t>(post.data + 8);
+    skip_entry_size = version >= 7 ? 16 : 12;
+    if (pos.size < 6 || std::memcmp(pos.data, MAGIC_POSN, 4) != 0)
+      throw std::runtime_error("Bad header in " + dir + "/index.positions");
 
-    SimpleVector<uint8_t> compressed;
-    Compression::encode_varbyte(doc_freq, compressed);
+    for (size_t i = 0; i < docmap.size; ++i)
+      if (docmap.data[i] < 0)
+        has_deletions = true;
+  }
 
-    int prev_doc_id = 0;
-    for (size_t i = 0; i < doc_freq; ++i)
+  bool next_term() override
+  {
+    while (read_term())
     {
-      TermPostings::DocEntry &entry = postings.doc_entries[i];
-      Compression::encode_varbyte(entry.doc_id - prev_doc_id, compressed);
-      prev_doc_id = entry.doc_id;
+      open_term();
+      if (live_df > 0)
+        return true;
+    }
+    return false;
+  }
+
+  std::string_view term() const override { return cur_term; }
+  uint32_t doc_freq() const override { return live_df; }
 
-      uint32_t freq = entry.positions.size;
-      Compression::encode_varbyte(freq, compressed);
+  bool next_doc(int &doc_id, const SimpleVector<int> *&positions) override
+  {
+    while (left > 0)
+    {
+      if (in_block == block_n)
+      {
+        block_n = block_docs(block);
+        const uint8_t *p = block_start(block);
+        p += decode_gaps(p, block_n);
+        Compression::decode_block(codec, p, block_n, freqs);
+        block++;
+        in_block = 0;
+      }
+      prev_doc += gaps[in_block];
+      uint32_t freq = freqs[in_block];
+      in_block++;
+      left--;
 
-      int prev_pos = 0;
-      for (size_t j = 0; j < freq; ++j)
+      int mapped = docmap[prev_doc];
+      if (mapped < 0)
       {
-        Compression::encode_varbyte(entry.positions[j] - prev_pos, compressed);
-        prev_pos = entry.positions[j];
+        positions_ptr += Compression::skip_varbyte(positions_ptr, freq);
+        continue;
       }
+      positions_buf.reset();
+      size_t offset = 0;
+      int curr_pos = 0;
+      for (uint32_t j = 0; j < freq; ++j)
+      {
+        auto p = Compression::decode_varbyte(positions_ptr, offset);
+        curr_pos += p.first;
+        offset = p.second;
+        positions_buf.push_back(curr_pos);
+      }
+      positions_ptr += offset;
+      lengths[mapped] += freq;
+      doc_id = mapped;
+      positions = &positions_buf;
+      return true;
+    }
+    return false;
+  }
+};
+
+// k-путевое слияние источников: термы сливаются по возрастанию, у
+// совпавшего терма документы - по возрастанию doc_id. Один документ
+// индексирует ровно один поток, а сливаемые сегменты перенумерованы в
+// разные диапазоны, поэтому doc_id в источниках не пересекаются.
+uint32_t merge_sources(SimpleVector<TermSourcePtr> &sources, PostingsWriter &writer)
+{
+  auto term_after = [](TermSource *a, TermSource *b)
+  { return a->term() > b->term(); };
+
+  SimpleVector<TermSource *> heap;
+  for (size_t i = 0; i < sources.size; ++i)
+  {
+    if (sources[i]->next_term())
+    {
+      heap.push_back(sources[i].get());
+      std::push_heap(heap.begin(), heap.end(), term_after);
     }
-    f_post.write((char *)compressed.data, compressed.size);
   }
 
-  f_dict.seekp(term_count_pos);
-  f_dict.write((char *)&term_count, 4);
+  struct Head
+  {
+    int doc_id;
+    const SimpleVector<int> *positions;
+    TermSource *source;
+  };
+  auto doc_after = [](const Head &a, const Head &b)
+  { return a.doc_id > b.doc_id; };
+
+  SimpleVector<TermSource *> group;
+  SimpleVector<Head> docs;
+  uint32_t terms = 0;
+  while (heap.size > 0)
+  {
+    group.reset();
+    // Копия: источники группы сдвинутся на следующий терм до конца записи
+    std::string term(heap[0]->term());
+    uint32_t df = 0;
+    while (heap.size > 0 && heap[0]->term() == term)
+    {
+      std::pop_heap(heap.begin(), heap.end(), term_after);
+      group.push_back(heap[heap.size - 1]);
+      df += heap[heap.size - 1]->doc_freq();
+      heap.pop_back();
+    }
 
-  f_dict.close();
-  f_post.close();
+    writer.begin_term(term, df);
+    docs.reset();
+    for (size_t g = 0; g < group.size; ++g)
+    {
+      Head h;
+      h.source = group[g];
+      if (h.source->next_doc(h.doc_id, h.positions))
+      {
+        docs.push_back(h);
+        std::push_heap(docs.begin(), docs.end(), doc_after);
+      }
+    }
+    while (docs.size > 0)
+    {
+      std::pop_heap(docs.begin(), docs.end(), doc_after);
+      Head &h = docs[docs.size - 1];
+      writer.add_doc(h.doc_id, *h.positions);
+      if (h.source->next_doc(h.doc_id, h.positions))
+        std::push_heap(docs.begin(), docs.end(), doc_after);
+      else
+        docs.pop_back();
+    }
+    writer.end_term();
+    terms++;
 
-  std::cerr << "Indexing complete. Terms: " << term_count << ", Docs: " << doc_count << std::endl;
+    for (size_t g = 0; g < group.size; ++g)
+    {
+      if (group[g]->next_term())
+      {
+        heap.push_back(group[g]);
+        std::push_heap(heap.begin(), heap.end(), term_after);
+      }
+    }
+  }
+  return terms;
 }
 
-int main(int argc, char *argv[])
+// Конвейер индексации: поток чтения раздаёт пакеты строк, каждый рабочий
+// поток токенизирует их и строит свой частичный индекс. Документам
+// присваивает doc_id поток чтения (по порядку входа), поэтому частичные
+// индексы сливаются без перенумерации.
+// С --memory-mb частичный индекс потока, превысивший свою долю бюджета,
+// сбрасывается на диск отсортированным прогоном, а url и заголовки
+// документов сразу уходят во временный файл потока.
+const size_t BATCH_LINES = 256;
+
+size_t memory_budget = 0;
+std::string temp_dir;
+
+struct Batch
+{
+  size_t seq = 0;
+  int first_doc = 0;
+  SimpleVector<std::string> lines;
+};
+
+// Документы одного пакета; при бюджете url и заголовки лежат в файле
+// потока начиная с spill_offset
+struct BatchSpan
+{
+  size_t seq;
+  int first_doc;
+  size_t worker;
+  uint64_t spill_offset;
+  SimpleVector<std::string> urls;
+  SimpleVector<std::string> titles;
+  SimpleVector<uint32_t> lengths;
+};
+
+struct Worker
+{
+  size_t id = 0;
+  std::unique_ptr<PartialIndex> index;
+  std::unique_ptr<ByteArena> arena;
+  size_t term_count = 0;
+  // Оценка памяти словаря частичного индекса (ключи, слоты FlatHashMap и
+  // записи постингов)
+  size_t term_bytes = 0;
+  SimpleVector<BatchSpan> spans;
+  SimpleVector<std::string> runs;
+  std::string spill_path;
+  std::unique_ptr<std::ofstream> spill;
+  // Кеш стемм хранит номера термов в index, пока его не сменит flush_run
+  std::unique_ptr<TokenizerLib::StemCache> stem_cache;
+  TokenizerLib::Tokenizer tokenizer;
+  // Ошибка потока; после неё пакеты только вычитываются из очереди
+  std::string error;
+
+  size_t memory() const { return arena->bytes() + term_bytes; }
+};
+
+std::string worker_file(size_t worker, const char *kind, size_t n)
+{
+  return temp_dir + "/" + kind + "-" + std::to_string(worker) + "-" + std::to_string(n) + ".tmp";
+}
+
+void flush_run(Worker &worker)
 {
-  if (argc < 2)
+  if (worker.term_count == 0)
+    return;
+  std::string path = worker_file(worker.id, "run", worker.runs.size);
+  seal_postings(*worker.index, *worker.arena);
+  write_run(path, *worker.index);
+  worker.runs.push_back(path);
+  worker.index.reset(new PartialIndex());
+  worker.stem_cache->invalidate_ids();
+  worker.arena->reset();
+  worker.term_count = 0;
+  worker.term_bytes = 0;
+}
+
+void spill_span(Worker &worker, BatchSpan &span)
+{
+  if (!worker.spill)
   {
-    std::cerr << "Usage: indexer <out_dir>" << std::endl;
-    return 1;
+    worker.spill_path = worker_file(worker.id, "docs", 0);
+    worker.spill.reset(new std::ofstream(worker.spill_path, std::ios::binary));
+    if (!*worker.spill)
+      throw std::runtime_error("Cannot create " + worker.spill_path);
   }
-  std::string out_dir = argv[1];
+  std::ofstream &f = *worker.spill;
+  span.spill_offset = f.tellp();
+  for (size_t d = 0; d < span.urls.size; ++d)
+  {
+    uint16_t url_len = span.urls[d].size();
+    f.write((char *)&url_len, 2);
+    f.write(span.urls[d].c_str(), url_len);
+    uint16_t title_len = span.titles[d].size();
+    f.write((char *)&title_len, 2);
+    f.write(span.titles[d].c_str(), title_len);
+  }
+  span.urls.clear();
+  span.titles.clear();
+}
 
-  std::string line;
-  int doc_id = 0;
-  SimpleVector<std::string> tokens;
+// Ограниченная очередь пакетов: чтение не убегает далеко вперёд рабочих
+class BatchQueue
+{
+  SimpleVector<Batch> slots;
+  size_t head = 0;
+  size_t count = 0;
+  bool closed = false;
+  std::mutex mutex;
+  std::condition_variable can_push;
+  std::condition_variable can_pop;
 
-  while (std::getline(std::cin, line))
+public:
+  explicit BatchQueue(size_t capacity)
   {
-    if (line.empty())
-      continue;
+    for (size_t i = 0; i < capacity; ++i)
+      slots.push_back(Batch());
+  }
 
-    size_t tab1 = line.find('\t');
-    if (tab1 == std::string::npos)
-      continue;
+  void push(Batch &&batch)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    can_push.wait(lock, [this]
+                  { return count < slots.size; });
+    slots[(head + count) % slots.size] = std::move(batch);
+    count++;
+    can_pop.notify_one();
+  }
 
-    size_t tab2 = line.find('\t', tab1 + 1);
-    if (tab2 == std::string::npos)
-      continue;
+  bool pop(Batch &out)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    can_pop.wait(lock, [this]
+                 { return count > 0 || closed; });
+    if (count == 0)
+      return false;
+    out = std::move(slots[head]);
+    head = (head + 1) % slots.size;
+    count--;
+    can_push.notify_one();
+    return true;
+  }
 
-    doc_urls.push_back(line.substr(0, tab1));
-    doc_titles.push_back(line.substr(tab1 + 1, tab2 - tab1 - 1));
+  void close()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+    can_pop.notify_all();
+  }
+};
 
-    std::string text = line.substr(tab2 + 1);
-    tokens.clear();
-    TokenizerLib::tokenize(text, tokens);
+// Строка документа: url<TAB>title<TAB>text
+bool is_doc_line(const std::string &line)
+{
+  size_t tab1 = line.find('\t');
+  return tab1 != std::string::npos && line.find('\t', tab1 + 1) != std::string::npos;
+}
 
-    for (size_t i = 0; i < tokens.size; ++i)
-    {
-      index_map[tokens[i]].add_position(doc_id, (int)i);
-    }
+void index_batch(Worker &worker, Batch &batch)
+{
+  BatchSpan span;
+  span.seq = batch.seq;
+  span.first_doc = batch.first_doc;
+  span.worker = worker.id;
+  span.spill_offset = 0;
 
-    doc_id++;
-    if (doc_id % 100 == 0)
+  PartialIndex &index = *worker.index;
+  ByteArena &arena = *worker.arena;
+  TokenizerLib::StemCache &cache = *worker.stem_cache;
+  int doc_id = 0;
+  uint32_t length = 0;
+  auto add_token = [&](std::string_view term, TokenizerLib::StemCache::Entry *entry)
+  {
+    uint32_t id = cache.id(entry);
+    if (id == TokenizerLib::StemCache::NO_ID)
     {
-      std::cerr << "Processed " << doc_id << " docs...\r";
+      bool added;
+      id = index.find_or_add(term, added);
+      cache.set_id(entry, id);
+      if (added)
+      {
+        worker.term_count++;
+        worker.term_bytes += 2 * (sizeof(FlatHashMap<uint32_t>::Entry) + sizeof(TermPostings) + 1) + term.size();
+      }
     }
+    index.postings[id].add_position(arena, doc_id, length++);
+  };
+  for (size_t l = 0; l < batch.lines.size; ++l)
+  {
+    const std::string &line = batch.lines[l];
+    size_t tab1 = line.find('\t');
+    size_t tab2 = line.find('\t', tab1 + 1);
+    doc_id = batch.first_doc + (int)l;
+
+    span.urls.push_back(line.substr(0, tab1));
+    span.titles.push_back(line.substr(tab1 + 1, tab2 - tab1 - 1));
+
+    length = 0;
+    worker.tokenizer.scan(std::string_view(line).substr(tab2 + 1), add_token);
+    span.lengths.push_back(length);
   }
-  std::cerr << std::endl;
 
-  write_index(out_dir);
+  if (memory_budget > 0)
+    spill_span(worker, span);
+  worker.spans.push_back(std::move(span));
+}
+
+void process_batch(Worker &worker, Batch &batch, size_t worker_budget)
+{
+  if (!worker.error.empty())
+    return;
+  try
+  {
+    index_batch(worker, batch);
+    if (worker_budget > 0 && worker.memory() >= worker_budget)
+      flush_run(worker);
+  }
+  catch (const std::exception &e)
+  {
+    worker.error = e.what();
+  }
+}
+
+void finish_worker(Worker &worker, size_t worker_budget)
+{
+  try
+  {
+    if (worker.error.empty() && worker_budget > 0)
+      flush_run(worker);
+  }
+  catch (const std::exception &e)
+  {
+    worker.error = e.what();
+  }
+  if (worker.spill)
+    worker.spill->close();
+}
+
+void run_worker(Worker &worker, BatchQueue &queue, size_t worker_budget)
+{
+  Batch batch;
+  while (queue.pop(batch))
+    process_batch(worker, batch, worker_budget);
+  finish_worker(worker, worker_budget);
+}
+
+// index.docs: заголовок с числом документов, таблица смещений и записи
+// (длина и байты url, длина и байты заголовка), в v4 - сжатыми блоками по
+// DocStore::BLOCK_DOCS записей. Число документов известно заранее,
+// таблица заполняется в close().
+class DocsWriter
+{
+  std::ofstream f;
+  std::string path;
+  uint32_t doc_count = 0;
+  uint32_t added = 0;
+  bool blocks = false;
+  SimpleVector<uint64_t> offsets;
+  uint64_t current_offset = 0;
+  // v4: записи текущего блока до сжатия
+  SimpleVector<uint8_t> block;
+  SimpleVector<uint8_t> packed;
+
+  void append_string(std::string_view s, SimpleVector<uint8_t> &out)
+  {
+    uint16_t len = s.size();
+    out.push_back(len & 0xFF);
+    out.push_back(len >> 8);
+    for (size_t i = 0; i < len; ++i)
+      out.push_back(s[i]);
+  }
+
+  void flush_block()
+  {
+    offsets.push_back(current_offset);
+    uint32_t raw = block.size;
+    packed.reset();
+    Compression::lz_compress(block.data, block.size, packed);
+    f.write((char *)&raw, 4);
+    f.write((char *)packed.data, packed.size);
+    current_offset += 4 + packed.size;
+    block.reset();
+  }
+
+public:
+  void open(const std::string &out_dir, uint32_t count)
+  {
+    path = out_dir + "/index.docs";
+    f.open(path, std::ios::binary);
+    if (!f)
+      throw std::runtime_error("Cannot create " + path);
+    doc_count = count;
+    blocks = compress_docs;
+    uint16_t version = blocks ? DocStore::BLOCK_VERSION : DocStore::RAW_VERSION;
+    f.write(MAGIC_DOCS, 4);
+    f.write((char *)&version, 2);
+    f.write((char *)&doc_count, 4);
+    current_offset = 4 + 2 + 4;
+    size_t table = doc_count;
+    if (blocks)
+    {
+      f.write((char *)&DocStore::BLOCK_DOCS, 2);
+      current_offset += 2;
+      table = (doc_count + DocStore::BLOCK_DOCS - 1) / DocStore::BLOCK_DOCS + 1;
+    }
+
+    uint64_t zero = 0;
+    for (size_t i = 0; i < table; ++i)
+      f.write((char *)&zero, 8);
+    current_offset += table * 8;
+  }
+
+  void add(std::string_view url, std::string_view title)
+  {
+    added++;
+    if (blocks)
+    {
+      append_string(url, block);
+      append_string(title, block);
+      if (added % DocStore::BLOCK_DOCS == 0)
+        flush_block();
+      return;
+    }
+    offsets.push_back(current_offset);
+    uint16_t url_len = url.size();
+    f.write((char *)&url_len, 2);
+    f.write(url.data(), url_len);
+
+    uint16_t title_len = title.size();
+    f.write((char *)&title_len, 2);
+    f.write(title.data(), title_len);
+    current_offset += 2 + url_len + 2 + title_len;
+  }
+
+  void close()
+  {
+    if (added != doc_count)
+      throw std::runtime_error("Wrong number of documents in " + path);
+    if (blocks)
+    {
+      if (block.size > 0)
+        flush_block();
+      offsets.push_back(current_offset);
+    }
+    f.seekp(blocks ? 12 : 10);
+    for (size_t i = 0; i < offsets.size; ++i)
+    {
+      f.write((char *)&offsets[i], 8);
+    }
+    f.close();
+    if (!f)
+      throw std::runtime_error("Cannot write " + path);
+  }
+};
+
+// index.docs готового сегмента: url и заголовок документа по номеру.
+// Представления действительны до следующего обращения к читателю.
+class DocsReader
+{
+  DocStore::Reader store;
+  mutable DocStore::BlockBuffer buf;
+
+public:
+  explicit DocsReader(const std::string &dir) { store.open(dir + "/index.docs"); }
+
+  uint32_t size() const { return store.size(); }
+
+  void get(uint32_t id, std::string_view &url, std::string_view &title) const { store.get(id, buf, url, title); }
+
+  std::string_view url(uint32_t id) const
+  {
+    std::string_view url, title;
+    get(id, url, title);
+    return url;
+  }
+};
+
+void write_docs(const std::string &out_dir, SimpleVector<Worker> &workers, SimpleVector<BatchSpan *> &spans)
+{
+  DocsWriter docs;
+  docs.open(out_dir, doc_lengths.size);
+
+  SimpleVector<std::unique_ptr<std::ifstream>> spills;
+  for (size_t w = 0; w < workers.size; ++w)
+  {
+    spills.push_back(std::unique_ptr<std::ifstream>());
+    if (!workers[w].spill_path.empty())
+      spills[w].reset(new std::ifstream(workers[w].spill_path, std::ios::binary));
+  }
+
+  std::string url, title;
+  for (size_t s = 0; s < spans.size; ++s)
+  {
+    BatchSpan &span = *spans[s];
+    std::ifstream *spill = spills[span.worker].get();
+    if (spill)
+      spill->seekg(span.spill_offset);
+    for (size_t d = 0; d < span.lengths.size; ++d)
+    {
+      if (spill)
+      {
+        uint16_t len = 0;
+        spill->read((char *)&len, 2);
+        url.resize(len);
+        spill->read(&url[0], len);
+        spill->read((char *)&len, 2);
+        title.resize(len);
+        spill->read(&title[0], len);
+        if (!*spill)
+          throw std::runtime_error("Truncated " + workers[span.worker].spill_path);
+      }
+      docs.add(spill ? url : span.urls[d], spill ? title : span.titles[d]);
+    }
+    span.urls.clear();
+    span.titles.clear();
+  }
+  docs.close();
+}
+
+void write_lengths(const std::string &out_dir)
+{
+  std::ofstream f_lens(out_dir + "/index.lengths", std::ios::binary);
+  uint32_t doc_count = doc_lengths.size;
+  uint64_t total_tokens = 0;
+  uint32_t min_length = 0;
+  SimpleVector<uint8_t> length_codes;
+  for (size_t i = 0; i < doc_count; ++i)
+  {
+    total_tokens += doc_lengths[i];
+    uint8_t code = Compression::encode_length_byte(doc_lengths[i]);
+    uint32_t len = Compression::decode_length_byte(code);
+    if (i == 0 || len < min_length)
+      min_length = len;
+    length_codes.push_back(code);
+  }
+  f_lens.write(MAGIC_LENS, 4);
+  f_lens.write((char *)&LENS_VERSION, 2);
+  f_lens.write((char *)&doc_count, 4);
+  f_lens.write((char *)&total_tokens, 8);
+  f_lens.write((char *)&min_length, 4);
+  f_lens.write((char *)length_codes.data, length_codes.size);
+  f_lens.close();
+}
+
+void write_index(const std::string &out_dir, SimpleVector<Worker> &workers)
+{
+  std::cerr << "Writing index to " << out_dir << "..." << std::endl;
+
+  SimpleVector<BatchSpan *> spans;
+  for (size_t w = 0; w < workers.size; ++w)
+    for (size_t s = 0; s < workers[w].spans.size; ++s)
+      spans.push_back(&workers[w].spans[s]);
+  std::sort(spans.begin(), spans.end(), [](const BatchSpan *a, const BatchSpan *b)
+            { return a->seq < b->seq; });
+  for (size_t s = 0; s < spans.size; ++s)
+    for (size_t d = 0; d < spans[s]->lengths.size; ++d)
+      doc_lengths.push_back(spans[s]->lengths[d]);
+
+  write_docs(out_dir, workers, spans);
+  write_lengths(out_dir);
+
+  SimpleVector<TermSourcePtr> sources;
+  for (size_t w = 0; w < workers.size; ++w)
+  {
+    for (size_t r = 0; r < workers[w].runs.size; ++r)
+      sources.push_back(TermSourcePtr(new RunSource(workers[w].runs[r])));
+    if (workers[w].term_count > 0)
+    {
+      seal_postings(*workers[w].index, *workers[w].arena);
+      sources.push_back(TermSourcePtr(new MemorySource(std::move(workers[w].index), std::move(workers[w].arena))));
+    }
+  }
+  if (memory_budget > 0)
+    std::cerr << "Merging " << sources.size << " runs..." << std::endl;
+
+  PostingsWriter writer;
+  writer.open(out_dir);
+  merge_sources(sources, writer);
+  uint32_t term_count = writer.close();
+
+  sources.clear();
+  for (size_t w = 0; w < workers.size; ++w)
+  {
+    for (size_t r = 0; r < workers[w].runs.size; ++r)
+      std::remove(workers[w].runs[r].c_str());
+    if (!workers[w].spill_path.empty())
+      std::remove(workers[w].spill_path.c_str());
+  }
+
+  std::cerr << "Indexing complete. Terms: " << term_count << ", Docs: " << doc_lengths.size << std::endl;
+}
+
+// Сегментированный индекс (segments.hpp). --append пишет новую пачку
+// документов отдельным сегментом и помечает удалёнными прежние версии
+// документов с теми же url и запускает фоновое слияние по ярусам, --merge
+// сливает сразу. Первый --append в каталог одиночного индекса делает этот
+// индекс сегментом 0 (adopt_single_index). Манифест
+// меняется под index.lock, и эта блокировка держится только на время
+// чтения и записи манифеста: запись сегмента и слияние идут без неё.
+// Слияние одновременно выполняет только один процесс (index.merge.lock).
+const size_t DEFAULT_MERGE_FACTOR = 10;
+
+// Блокировка flock на файле в каталоге индекса; снимается в деструкторе
+class DirLock
+{
+  int fd;
+  bool locked;
+
+public:
+  DirLock(const std::string &path, bool wait = true) : fd(::open(path.c_str(), O_RDWR | O_CREAT, 0644)), locked(false)
+  {
+    if (fd < 0)
+      throw std::runtime_error("Cannot open " + path);
+    locked = flock(fd, wait ? LOCK_EX : LOCK_EX | LOCK_NB) == 0;
+    if (!locked && wait)
+    {
+      ::close(fd);
+      throw std::runtime_error("Cannot lock " + path);
+    }
+  }
+
+  ~DirLock() { ::close(fd); }
+
+  DirLock(const DirLock &) = delete;
+  DirLock &operator=(const DirLock &) = delete;
+
+  bool held() const { return locked; }
+};
+
+std::string lock_path(const std::string &index_dir)
+{
+  return index_dir + "/index.lock";
+}
+
+// Файлы одиночного индекса, которые переезжают в его сегмент
+const char *const INDEX_FILES[] = {"index.docs", "index.dict", "index.postings", "index.positions", "index.lengths",
+                                   Shards::GLOBALS_FILE};
+
+// Версия формата из заголовка файла индекса; 0, если файла нет или он короче
+uint16_t file_version(const std::string &path)
+{
+  char header[6];
+  std::ifstream f(path, std::ios::binary);
+  if (!f.read(header, 6))
+    return 0;
+  return load_le<uint16_t>((const uint8_t *)header + 4);
+}
+
+// Первый --append в каталог одиночного индекса делает этот индекс
+// сегментом 0: файлы получают жёсткие ссылки в seg-000000, затем
+// публикуется манифест, и только потом убираются прежние имена, так что
+// читатель в любой момент видит целый индекс. Сливать сегменты умеет
+// только текущий формат (словарь v4, постинги v5+); старые индексы нужно
+// пересобрать. Вызывается под index.lock.
+void check_adoptable(const std::string &index_dir)
+{
+  if (Segments::is_segmented(index_dir) || !std::ifstream(index_dir + "/index.docs").good())
+    return;
+  if (file_version(index_dir + "/index.dict") != DICT_VERSION || file_version(index_dir + "/index.postings") < 5)
+    throw std::runtime_error(index_dir + " holds an index in an old format; rebuild it to append documents");
+}
+
+Segments::Manifest adopt_single_index(const std::string &index_dir)
+{
+  check_adoptable(index_dir);
+  Segments::Manifest m;
+  Segments::SegmentInfo seg;
+  seg.id = 0;
+  seg.doc_count = DocsReader(index_dir).size();
+  std::string dir = Segments::segment_dir(index_dir, seg.id);
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+  for (const char *name : INDEX_FILES)
+  {
+    std::string path = index_dir + "/" + name;
+    if (std::filesystem::exists(path))
+      std::filesystem::create_hard_link(path, dir + "/" + name);
+  }
+  m.segments.push_back(seg);
+  Segments::write_manifest(index_dir, m);
+  for (const char *name : INDEX_FILES)
+    std::remove((index_dir + "/" + name).c_str());
+  std::cerr << "Converted the index in " << index_dir << " into segment 0 with " << seg.doc_count << " docs." << std::endl;
+  return m;
+}
+
+Segments::Manifest read_manifest_or_empty(const std::string &index_dir)
+{
+  if (Segments::is_segmented(index_dir))
+    return Segments::read_manifest(index_dir);
+  if (std::ifstream(index_dir + "/index.docs").good())
+    return adopt_single_index(index_dir);
+  return Segments::Manifest();
+}
+
+// Заводит каталог нового сегмента; номер резервируется в манифесте сразу,
+// чтобы параллельные --append и --merge его не заняли
+std::string begin_segment(const std::string &index_dir, uint32_t &id)
+{
+  // Неподходящий индекс отвергается до того, как в каталоге появится index.lock
+  check_adoptable(index_dir);
+  std::filesystem::create_directories(index_dir);
+  DirLock lock(lock_path(index_dir));
+  Segments::Manifest m = read_manifest_or_empty(index_dir);
+  id = m.next_id++;
+  Segments::write_manifest(index_dir, m);
+  std::string dir = Segments::segment_dir(index_dir, id);
+  std::filesystem::create_directories(dir);
+  return dir;
+}
+
+// Помечает в bits документы сегмента, url которых есть в urls; число новых пометок
+uint32_t mark_replaced(const DocsReader &docs, const FlatHashMap<uint32_t> &urls, SimpleVector<uint8_t> &bits)
+{
+  uint32_t marked = 0;
+  for (uint32_t d = 0; d < docs.size(); ++d)
+  {
+    if (!Segments::is_deleted(bits.data, d) && urls.get(docs.url(d)))
+    {
+      Segments::mark_deleted(bits, d);
+      marked++;
+    }
+  }
+  return marked;
+}
+
+// Дописывает записанный сегмент в манифест. Документ, url которого уже
+// встречался, заменяет прежнюю версию: та помечается удалённой и в старых
+// сегментах, и раньше в этом же сегменте.
+void commit_segment(const std::string &index_dir, uint32_t id)
+{
+  std::string dir = Segments::segment_dir(index_dir, id);
+  DocsReader fresh(dir);
+  if (fresh.size() == 0)
+  {
+    std::filesystem::remove_all(dir);
+    std::cerr << "No documents to append." << std::endl;
+    return;
+  }
+
+  Segments::SegmentInfo seg;
+  seg.id = id;
+  seg.doc_count = fresh.size();
+  SimpleVector<uint8_t> own;
+  Segments::read_deletions(index_dir, seg, own);
+  FlatHashMap<uint32_t> latest;
+  for (uint32_t d = 0; d < fresh.size(); ++d)
+  {
+    size_t known = latest.size();
+    uint32_t &slot = latest[fresh.url(d)];
+    if (latest.size() == known)
+    {
+      Segments::mark_deleted(own, slot);
+      seg.del_count++;
+    }
+    slot = d;
+  }
+
+  DirLock lock(lock_path(index_dir));
+  Segments::Manifest m = read_manifest_or_empty(index_dir);
+  uint32_t replaced = seg.del_count;
+  SimpleVector<uint8_t> bits;
+  for (size_t i = 0; i < m.segments.size; ++i)
+  {
+    Segments::SegmentInfo &old = m.segments[i];
+    Segments::read_deletions(index_dir, old, bits);
+    uint32_t marked = mark_replaced(DocsReader(Segments::segment_dir(index_dir, old.id)), latest, bits);
+    if (marked == 0)
+      continue;
+    old.del_gen++;
+    old.del_count += marked;
+    Segments::write_deletions(index_dir, old, bits);
+    replaced += marked;
+  }
+  if (seg.del_count > 0)
+  {
+    seg.del_gen = 1;
+    Segments::write_deletions(index_dir, seg, own);
+  }
+  m.segments.push_back(seg);
+  Segments::write_manifest(index_dir, m);
+  std::cerr << "Appended segment " << id << " with " << seg.doc_count << " docs, replaced " << replaced << " older versions." << std::endl;
+}
+
+// Ярус сегмента по живым документам: при factor 10 до 9 документов -
+// ярус 0, до 99 - ярус 1 и т.д.
+int merge_tier(uint32_t docs, size_t factor)
+{
+  int tier = 0;
+  while (docs >= factor)
+  {
+    docs /= factor;
+    tier++;
+  }
+  return tier;
+}
+
+// Очередное слияние: сегмент, в котором удалено больше половины
+// документов, переписывается отдельно; иначе сливаются первые factor
+// подряд идущих сегментов одного яруса. Слияние соседних сохраняет
+// порядок документов. Результат попадает на ярус выше, так что число
+// сегментов растёт логарифмически от числа документов.
+bool pick_merge(const Segments::Manifest &m, size_t factor, size_t &first, size_t &count)
+{
+  for (size_t i = 0; i < m.segments.size; ++i)
+  {
+    if (m.segments[i].del_count * 2 > m.segments[i].doc_count)
+    {
+      first = i;
+      count = 1;
+      return true;
+    }
+  }
+  for (size_t i = 0; i < m.segments.size;)
+  {
+    int tier = merge_tier(m.segments[i].live_docs(), factor);
+    size_t j = i + 1;
+    while (j < m.segments.size && j - i < factor && merge_tier(m.segments[j].live_docs(), factor) == tier)
+      j++;
+    if (j - i == factor)
+    {
+      first = i;
+      count = factor;
+      return true;
+    }
+    i = j;
+  }
+  return false;
+}
+
+// Пишет сегмент id из живых документов inputs. docmaps получает для
+// каждого входа номер документа в новом сегменте (-1 - удалён).
+uint32_t write_merged_segment(const std::string &index_dir, uint32_t id, const SimpleVector<Segments::SegmentInfo> &inputs,
+                              SimpleVector<SimpleVector<int>> &docmaps)
+{
+  std::string dir = Segments::segment_dir(index_dir, id);
+  std::filesystem::create_directories(dir);
+
+  int next = 0;
+  SimpleVector<uint8_t> bits;
+  for (size_t k = 0; k < inputs.size; ++k)
+  {
+    Segments::read_deletions(index_dir, inputs[k], bits);
+    docmaps.push_back(SimpleVector<int>());
+    for (uint32_t d = 0; d < inputs[k].doc_count; ++d)
+      docmaps[k].push_back(Segments::is_deleted(bits.data, d) ? -1 : next++);
+  }
+
+  DocsWriter docs;
+  docs.open(dir, next);
+  for (size_t k = 0; k < inputs.size; ++k)
+  {
+    DocsReader reader(Segments::segment_dir(index_dir, inputs[k].id));
+    if (reader.size() != inputs[k].doc_count)
+      throw std::runtime_error("Segment " + std::to_string(inputs[k].id) + " does not match the manifest");
+    std::string_view url, title;
+    for (uint32_t d = 0; d < reader.size(); ++d)
+    {
+      if (docmaps[k][d] < 0)
+        continue;
+      reader.get(d, url, title);
+      docs.add(url, title);
+    }
+  }
+  docs.close();
+
+  // Сегменты шарда переносят общие номера живых документов (shards.hpp)
+  SimpleVector<uint32_t> globals, input_globals;
+  bool have_globals = true;
+  for (size_t k = 0; k < inputs.size && have_globals; ++k)
+  {
+    have_globals = Shards::read_globals(Segments::segment_dir(index_dir, inputs[k].id), input_globals);
+    if (have_globals && input_globals.size != inputs[k].doc_count)
+      throw std::runtime_error("Segment " + std::to_string(inputs[k].id) + " does not match its doc numbers");
+    for (size_t d = 0; d < input_globals.size; ++d)
+      if (docmaps[k][d] >= 0)
+        globals.push_back(input_globals[d]);
+  }
+  if (have_globals)
+    Shards::write_globals(dir, globals);
+
+  doc_lengths.clear();
+  for (int d = 0; d < next; ++d)
+    doc_lengths.push_back(0);
+  SimpleVector<TermSourcePtr> sources;
+  for (size_t k = 0; k < inputs.size; ++k)
+    sources.push_back(TermSourcePtr(new SegmentSource(Segments::segment_dir(index_dir, inputs[k].id), docmaps[k], doc_lengths)));
+  PostingsWriter writer;
+  writer.open(dir);
+  merge_sources(sources, writer);
+  writer.close();
+  write_lengths(dir);
+  return next;
+}
+
+// Сливает сегменты, пока pick_merge находит, что сливать. Каждое слияние
+// публикуется своим манифестом. Удаления, сделанные --append во время
+// слияния, переносятся на новый сегмент по docmaps.
+void merge_segments(const std::string &index_dir, size_t factor)
+{
+  if (!Segments::is_segmented(index_dir))
+    throw std::runtime_error(index_dir + " is not a segmented index");
+  DirLock merging(index_dir + "/index.merge.lock", false);
+  if (!merging.held())
+  {
+    std::cerr << "Another merge is running in " << index_dir << std::endl;
+    return;
+  }
+
+  while (true)
+  {
+    SimpleVector<Segments::SegmentInfo> inputs;
+    SimpleVector<uint32_t> dropped;
+    uint32_t id = 0;
+    {
+      DirLock lock(lock_path(index_dir));
+      Segments::Manifest m = Segments::read_manifest(index_dir);
+      // Сегменты без живых документов просто выходят из манифеста
+      Segments::Manifest kept;
+      kept.next_id = m.next_id;
+      for (size_t i = 0; i < m.segments.size; ++i)
+      {
+        if (m.segments[i].live_docs() == 0)
+          dropped.push_back(m.segments[i].id);
+        else
+          kept.segments.push_back(m.segments[i]);
+      }
+
+      size_t first, count;
+      bool found = pick_merge(kept, factor, first, count);
+      if (found)
+      {
+        for (size_t i = first; i < first + count; ++i)
+          inputs.push_back(kept.segments[i]);
+        id = kept.next_id++;
+      }
+      if (found || dropped.size > 0)
+        Segments::write_manifest(index_dir, kept);
+    }
+    for (size_t i = 0; i < dropped.size; ++i)
+      std::filesystem::remove_all(Segments::segment_dir(index_dir, dropped[i]));
+    if (inputs.size == 0)
+      return;
+
+    SimpleVector<SimpleVector<int>> docmaps;
+    Segments::SegmentInfo merged;
+    merged.id = id;
+    merged.doc_count = write_merged_segment(index_dir, id, inputs, docmaps);
+
+    {
+      DirLock lock(lock_path(index_dir));
+      Segments::Manifest m = Segments::read_manifest(index_dir);
+      size_t first = 0;
+      while (first < m.segments.size && m.segments[first].id != inputs[0].id)
+        first++;
+      if (first + inputs.size > m.segments.size)
+        throw std::runtime_error("Segments changed during merge");
+
+      SimpleVector<uint8_t> merged_bits;
+      Segments::read_deletions(index_dir, merged, merged_bits);
+      SimpleVector<uint8_t> bits;
+      for (size_t k = 0; k < inputs.size; ++k)
+      {
+        const Segments::SegmentInfo &now = m.segments[first + k];
+        if (now.id != inputs[k].id)
+          throw std::runtime_error("Segments changed during merge");
+        if (now.del_gen == inputs[k].del_gen)
+          continue;
+        Segments::read_deletions(index_dir, now, bits);
+        for (uint32_t d = 0; d < now.doc_count; ++d)
+        {
+          int mapped = docmaps[k][d];
+          if (mapped >= 0 && Segments::is_deleted(bits.data, d))
+          {
+            Segments::mark_deleted(merged_bits, mapped);
+            merged.del_count++;
+          }
+        }
+      }
+      if (merged.del_count > 0)
+      {
+        merged.del_gen = 1;
+        Segments::write_deletions(index_dir, merged, merged_bits);
+      }
+
+      Segments::Manifest next;
+      next.next_id = m.next_id;
+      for (size_t i = 0; i < m.segments.size; ++i)
+      {
+        if (i == first && merged.live_docs() > 0)
+          next.segments.push_back(merged);
+        if (i < first || i >= first + inputs.size)
+          next.segments.push_back(m.segments[i]);
+      }
+      Segments::write_manifest(index_dir, next);
+    }
+    if (merged.live_docs() == 0)
+      std::filesystem::remove_all(Segments::segment_dir(index_dir, id));
+    for (size_t k = 0; k < inputs.size; ++k)
+      std::filesystem::remove_all(Segments::segment_dir(index_dir, inputs[k].id));
+    std::cerr << "Merged " << inputs.size << " segments into segment " << id << " with " << merged.doc_count << " docs." << std::endl;
+  }
+}
+
+// Слияние после --append идёт в отдельном процессе: --append завершается,
+// как только сегмент опубликован. Промежуточный процесс сразу выходит,
+// поэтому слияние не остаётся зомби у индексатора и не держит его stdout
+// и stderr (а с ними и ожидающего их вызывающего); вывод слияния
+// дописывается в index.merge.log каталога индекса. Не удалось запустить
+// процесс - слияние идёт здесь же.
+void start_background_merge(const std::string &index_dir, size_t factor)
+{
+  std::string log_path = index_dir + "/index.merge.log";
+  std::cerr.flush();
+  pid_t child = fork();
+  if (child > 0)
+  {
+    waitpid(child, nullptr, 0);
+    std::cerr << "Merging segments in the background, log in " << log_path << std::endl;
+    return;
+  }
+  if (child < 0)
+  {
+    merge_segments(index_dir, factor);
+    return;
+  }
+
+  setsid();
+  if (fork() > 0)
+    _exit(0);
+  int null_fd = ::open("/dev/null", O_RDWR);
+  int log_fd = ::open(log_path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+  dup2(null_fd, 0);
+  dup2(null_fd, 1);
+  dup2(log_fd >= 0 ? log_fd : null_fd, 2);
+  int code = 0;
+  try
+  {
+    merge_segments(index_dir, factor);
+  }
+  catch (const std::exception &e)
+  {
+    std::cerr << "Error: " << e.what() << std::endl;
+    code = 1;
+  }
+  std::cerr.flush();
+  _exit(code);
+}
+
+// Параметры сборки индекса из документов входа
+struct BuildOptions
+{
+  size_t thread_count = 1;
+  bool append = false;
+  bool auto_merge = true;
+  // --wait-merge: слияние после --append в этом же процессе
+  bool background_merge = true;
+  size_t merge_factor = DEFAULT_MERGE_FACTOR;
+  // Каталог временных файлов; пустой - каталог создаваемого индекса
+  std::string temp_dir;
+  // Общие номера документов входа для index.globals шарда (shards.hpp)
+  const SimpleVector<uint32_t> *global_ids = nullptr;
+};
+
+// Строит индекс из документов in в index_dir, с append - новым сегментом
+// сегментированного индекса index_dir
+void build_index(std::istream &in, const std::string &index_dir, const BuildOptions &opt)
+{
+  std::string out_dir = index_dir;
+  uint32_t segment_id = 0;
+  if (opt.append)
+    out_dir = begin_segment(index_dir, segment_id);
+  temp_dir = opt.temp_dir.empty() ? out_dir : opt.temp_dir;
+  size_t thread_count = opt.thread_count;
+  bool committed = false;
+  doc_lengths.clear();
+
+  SimpleVector<Worker> workers;
+  for (size_t i = 0; i < thread_count; ++i)
+  {
+    workers.push_back(Worker());
+    workers[i].id = i;
+    workers[i].index.reset(new PartialIndex());
+    workers[i].stem_cache.reset(new TokenizerLib::StemCache());
+    workers[i].tokenizer = TokenizerLib::Tokenizer(workers[i].stem_cache.get());
+    workers[i].arena.reset(new ByteArena());
+  }
+
+  // С одним потоком пакеты обрабатываются прямо в потоке чтения: без
+  // второго потока malloc в glibc остаётся на быстром однопоточном пути.
+  BatchQueue queue(thread_count * 2);
+  size_t worker_budget = memory_budget / thread_count;
+  SimpleVector<std::thread> threads;
+  if (thread_count > 1)
+  {
+    for (size_t i = 0; i < thread_count; ++i)
+      threads.push_back(std::thread(run_worker, std::ref(workers[i]), std::ref(queue), worker_budget));
+  }
+  auto dispatch = [&](Batch &&b)
+  {
+    if (thread_count > 1)
+      queue.push(std::move(b));
+    else
+      process_batch(workers[0], b, worker_budget);
+  };
+
+  std::string line;
+  int doc_id = 0;
+  Batch batch;
+  while (std::getline(in, line))
+  {
+    if (line.empty() || !is_doc_line(line))
+      continue;
+    batch.lines.push_back(std::move(line));
+    if (batch.lines.size == BATCH_LINES)
+    {
+      doc_id += batch.lines.size;
+      size_t seq = batch.seq + 1;
+      dispatch(std::move(batch));
+      batch = Batch();
+      batch.seq = seq;
+      batch.first_doc = doc_id;
+      std::cerr << "Read " << doc_id << " docs...\r";
+    }
+  }
+  if (batch.lines.size > 0)
+    dispatch(std::move(batch));
+  queue.close();
+
+  if (thread_count > 1)
+  {
+    for (size_t i = 0; i < threads.size; ++i)
+      threads[i].join();
+  }
+  else
+    finish_worker(workers[0], worker_budget);
+  std::cerr << std::endl;
+
+  try
+  {
+    for (size_t i = 0; i < workers.size; ++i)
+      if (!workers[i].error.empty())
+        throw std::runtime_error(workers[i].error);
+    write_index(out_dir, workers);
+    if (opt.global_ids)
+      Shards::write_globals(out_dir, *opt.global_ids);
+    if (opt.append)
+    {
+      workers.clear();
+      commit_segment(index_dir, segment_id);
+      committed = true;
+      if (opt.auto_merge && opt.background_merge)
+        start_background_merge(index_dir, opt.merge_factor);
+      else if (opt.auto_merge)
+        merge_segments(index_dir, opt.merge_factor);
+    }
+  }
+  catch (...)
+  {
+    // Несостоявшийся сегмент в манифест не попал, его каталог не нужен
+    if (opt.append && !committed)
+      std::filesystem::remove_all(out_dir);
+    throw;
+  }
+}
+
+// Шардированный индекс (shards.hpp): вход раскладывается по временным
+// файлам шардов, затем каждый шард строится обычной сборкой. Деление
+// диапазонами знает размер диапазона только после чтения всего входа,
+// поэтому вход для него сначала целиком ложится в один файл. numbers
+// получает для каждого шарда порядковые номера его документов во входе;
+// возвращает пути файлов, total - число документов входа.
+SimpleVector<std::string> split_input(std::istream &in, const Shards::Layout &layout, const std::string &spool_dir,
+                                      SimpleVector<SimpleVector<uint32_t>> &numbers, uint32_t &total)
+{
+  SimpleVector<std::string> paths;
+  SimpleVector<std::unique_ptr<std::ofstream>> outs;
+  for (uint32_t k = 0; k < layout.count; ++k)
+  {
+    paths.push_back(spool_dir + "/shard-" + std::to_string(k) + ".input.tmp");
+    outs.push_back(std::unique_ptr<std::ofstream>(new std::ofstream(paths[k], std::ios::binary | std::ios::trunc)));
+    if (!*outs[k])
+      throw std::runtime_error("Cannot create " + paths[k]);
+    numbers.push_back(SimpleVector<uint32_t>());
+  }
+
+  std::string line;
+  total = 0;
+  if (layout.split == Shards::Split::HASH)
+  {
+    while (std::getline(in, line))
+    {
+      if (line.empty() || !is_doc_line(line))
+        continue;
+      std::string_view url(line.data(), line.find('\t'));
+      uint32_t k = Shards::shard_of_url(url, layout.count);
+      *outs[k] << line << '\n';
+      numbers[k].push_back(total++);
+    }
+  }
+  else
+  {
+    std::string all_path = spool_dir + "/shards.input.tmp";
+    {
+      std::ofstream all(all_path, std::ios::binary | std::ios::trunc);
+      while (std::getline(in, line))
+      {
+        if (line.empty() || !is_doc_line(line))
+          continue;
+        all << line << '\n';
+        total++;
+      }
+      all.flush();
+      if (!all)
+        throw std::runtime_error("Cannot write " + all_path);
+    }
+    size_t per_shard = std::max<size_t>(1, (total + layout.count - 1) / layout.count);
+    std::ifstream all(all_path, std::ios::binary);
+    for (uint32_t n = 0; std::getline(all, line); ++n)
+    {
+      *outs[n / per_shard] << line << '\n';
+      numbers[n / per_shard].push_back(n);
+    }
+    std::remove(all_path.c_str());
+  }
+
+  for (uint32_t k = 0; k < layout.count; ++k)
+  {
+    outs[k]->flush();
+    if (!*outs[k])
+      throw std::runtime_error("Cannot write " + paths[k]);
+  }
+  return paths;
+}
+
+// Сборка, --append или --merge шардированного индекса. Раскладка берётся
+// из index.shards, а для нового индекса - из shard_count и split.
+void run_sharded(const std::string &index_dir, uint32_t shard_count, Shards::Split split, bool split_given,
+                 bool merge_only, const BuildOptions &opt)
+{
+  Shards::Layout layout;
+  bool exists = Shards::is_sharded(index_dir);
+  if (exists)
+  {
+    layout = Shards::read_layout(index_dir);
+    if (shard_count > 0 && shard_count != layout.count)
+      throw std::runtime_error(index_dir + " has " + std::to_string(layout.count) + " shards");
+    if (split_given && split != layout.split)
+      throw std::runtime_error(index_dir + " is split differently");
+  }
+  else
+  {
+    if (merge_only)
+      throw std::runtime_error(index_dir + " is not a sharded index");
+    layout.count = shard_count;
+    layout.split = split;
+  }
+
+  if (merge_only)
+  {
+    // Шарды, в которые ещё ничего не дописывали, сливать незачем
+    for (uint32_t k = 0; k < layout.count; ++k)
+      if (Segments::is_segmented(Shards::shard_dir(index_dir, k)))
+        merge_segments(Shards::shard_dir(index_dir, k), opt.merge_factor);
+    return;
+  }
+  // Новые документы диапазона некуда отнести, а новая версия документа
+  // должна попасть в шард старой - это умеет только деление по хешу
+  if (opt.append && layout.split != Shards::Split::HASH)
+    throw std::runtime_error("--append needs shards split by url hash");
+
+  std::filesystem::create_directories(index_dir);
+  std::string spool_dir = opt.temp_dir.empty() ? index_dir : opt.temp_dir;
+  SimpleVector<SimpleVector<uint32_t>> numbers;
+  uint32_t total = 0;
+  SimpleVector<std::string> inputs = split_input(std::cin, layout, spool_dir, numbers, total);
+  // Общие номера новых документов резервируются в index.shards до сборки,
+  // чтобы параллельный --append продолжил нумерацию после них
+  uint32_t first_global = 0;
+  if (exists)
+  {
+    DirLock lock(lock_path(index_dir));
+    Shards::Layout now = Shards::read_layout(index_dir);
+    if ((uint64_t)now.next_global + total > (uint64_t)INT32_MAX)
+      throw std::runtime_error("Too many documents in " + index_dir);
+    first_global = now.next_global;
+    now.next_global += total;
+    Shards::write_layout(index_dir, now);
+  }
+  else
+    layout.next_global = total;
+  try
+  {
+    for (uint32_t k = 0; k < layout.count; ++k)
+    {
+      std::string dir = Shards::shard_dir(index_dir, k);
+      std::filesystem::create_directories(dir);
+      std::cerr << "Shard " << k << " of " << layout.count << std::endl;
+      std::ifstream in(inputs[k], std::ios::binary);
+      SimpleVector<uint32_t> &globals = numbers[k];
+      for (size_t i = 0; i < globals.size; ++i)
+        globals[i] += first_global;
+      BuildOptions shard_opt = opt;
+      shard_opt.global_ids = &globals;
+      build_index(in, dir, shard_opt);
+      std::remove(inputs[k].c_str());
+    }
+  }
+  catch (...)
+  {
+    for (size_t k = 0; k < inputs.size; ++k)
+      std::remove(inputs[k].c_str());
+    throw;
+  }
+  if (!exists)
+    Shards::write_layout(index_dir, layout);
+}
+
+// Потоков сборки не больше стольких на ядро
+const size_t MAX_THREADS_PER_CORE = 4;
+
+// Неотрицательное целое не больше max целиком, без знака и хвоста; иначе
+// сообщение и false
+bool parse_count(const std::string &flag, const char *text, size_t max, size_t &out)
+{
+  char *end = nullptr;
+  errno = 0;
+  unsigned long long value = std::strtoull(text, &end, 10);
+  if (end == text || *end != '\0' || *text == '-' || errno == ERANGE || value > max)
+  {
+    std::cerr << "Bad value for " << flag << ": " << text << std::endl;
+    return false;
+  }
+  out = value;
+  return true;
+}
+
+int main(int argc, char *argv[])
+{
+  std::string out_dir;
+  BuildOptions opt;
+  opt.thread_count = std::max(1u, std::thread::hardware_concurrency());
+  bool merge_only = false;
+  uint32_t shard_count = 0;
+  Shards::Split split = Shards::Split::HASH;
+  bool split_given = false;
+  for (int i = 1; i < argc; ++i)
+  {
+    std::string arg = argv[i];
+    if (arg == "--codec" && i + 1 < argc)
+    {
+      if (!Compression::parse_codec(argv[++i], post_codec))
+      {
+        std::cerr << "Unknown codec: " << argv[i] << std::endl;
+        return 1;
+      }
+    }
+    else if (arg == "--docs-codec" && i + 1 < argc)
+    {
+      std::string codec = argv[++i];
+      if (codec == "raw" || codec == "lz")
+        compress_docs = codec == "lz";
+      else
+      {
+        std::cerr << "Unknown docs codec: " << codec << std::endl;
+        return 1;
+      }
+    }
+    else if (arg == "--threads" && i + 1 < argc)
+    {
+      size_t max_threads = MAX_THREADS_PER_CORE * std::max(1u, std::thread::hardware_concurrency());
+      if (!parse_count(arg, argv[++i], max_threads, opt.thread_count))
+        return 1;
+      if (opt.thread_count == 0)
+      {
+        std::cerr << "Bad value for " << arg << ": " << argv[i] << std::endl;
+        return 1;
+      }
+    }
+    else if (arg == "--memory-mb" && i + 1 < argc)
+    {
+      // Бюджет в байтах должен поместиться в size_t
+      size_t mb;
+      if (!parse_count(arg, argv[++i], SIZE_MAX >> 20, mb))
+        return 1;
+      if (mb == 0)
+      {
+        std::cerr << "Bad value for " << arg << ": " << argv[i] << std::endl;
+        return 1;
+      }
+      memory_budget = mb << 20;
+    }
+    else if (arg == "--tmp-dir" && i + 1 < argc)
+      opt.temp_dir = argv[++i];
+    else if (arg == "--append")
+      opt.append = true;
+    else if (arg == "--merge")
+      merge_only = true;
+    else if (arg == "--no-merge")
+      opt.auto_merge = false;
+    else if (arg == "--wait-merge")
+      opt.background_merge = false;
+    else if (arg == "--merge-factor" && i + 1 < argc)
+    {
+      opt.merge_factor = std::atoi(argv[++i]);
+      if (opt.merge_factor < 2)
+      {
+        std::cerr << "Bad merge factor: " << argv[i] << std::endl;
+        return 1;
+      }
+    }
+    else if (arg == "--shards" && i + 1 < argc)
+    {
+      int n = std::atoi(argv[++i]);
+      if (n < 1 || (uint32_t)n > Shards::MAX_SHARDS)
+      {
+        std::cerr << "Bad shard count: " << argv[i] << std::endl;
+        return 1;
+      }
+      shard_count = n;
+    }
+    else if (arg == "--shard-by" && i + 1 < argc)
+    {
+      std::string by = argv[++i];
+      if (by == "hash")
+        split = Shards::Split::HASH;
+      else if (by == "range")
+        split = Shards::Split::RANGE;
+      else
+      {
+        std::cerr << "Unknown shard split: " << by << std::endl;
+        return 1;
+      }
+      split_given = true;
+    }
+    else
+      out_dir = arg;
+  }
+  if (out_dir.empty())
+  {
+    std::cerr << "Usage: indexer [--codec varbyte|streamvbyte] [--docs-codec raw|lz] [--threads N] [--memory-mb N]"
+              << " [--tmp-dir DIR] [--append [--no-merge | --wait-merge] | --merge] [--merge-factor N] [--shards N [--shard-by hash|range]] <out_dir>"
+              << std::endl;
+    return 1;
+  }
+
+  try
+  {
+    if (shard_count > 0 || Shards::is_sharded(out_dir))
+      run_sharded(out_dir, shard_count, split, split_given, merge_only, opt);
+    else if (merge_only)
+      merge_segments(out_dir, opt.merge_factor);
+    else
+      build_index(std::cin, out_dir, opt);
+  }
+  catch (const std::exception &e)
+  {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
   return 0;
 }
@@ -0,0 +1,180 @@
+#include <string>
+#include <string_view>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <algorithm>
+
+#include "common.hpp"
+#include "tokenizer_lib.hpp"
+#include "search_core.hpp"
+#include "libsearch.h"
+
+// Дескриптор хранит только настройки: состояние индекса глобальное
+struct search_index
+{
+    bool ranked;
+};
+
+namespace
+{
+    thread_local std::string last_error;
+    std::mutex open_mutex;
+    bool index_opened = false;
+
+    void set_error(const char *message)
+    {
+        last_error = message;
+    }
+
+    void copy_stats(const CacheStats &s, search_cache_stats *out)
+    {
+        if (!out)
+            return;
+        out->hits = s.hits;
+        out->misses = s.misses;
+        out->evictions = s.evictions;
+        out->entries = s.entries;
+        out->bytes = s.bytes;
+        out->limit = s.limit;
+    }
+}
+
+extern "C"
+{
+
+const char *search_last_error(void)
+{
+    return last_error.c_str();
+}
+
+search_index *search_open(const char *index_dir, int flags)
+{
+    std::lock_guard<std::mutex> lock(open_mutex);
+    if (index_opened)
+    {
+        set_error("An index is already open in this process");
+        return nullptr;
+    }
+    try
+    {
+        use_mmap = (flags & SEARCH_OPEN_MMAP) != 0;
+        use_ranking = (flags & SEARCH_OPEN_RANK) != 0;
+        open_index(index_dir);
+        index_opened = true;
+        return new search_index{use_ranking};
+    }
+    catch (const std::exception &e)
+    {
+        set_error(e.what());
+        return nullptr;
+    }
+}
+
+void search_close(search_index *index)
+{
+    delete index;
+}
+
+uint32_t search_doc_count(const search_index *index)
+{
+    return index ? index_doc_count() : 0;
+}
+
+int64_t search_query(search_index *index, const char *query, uint32_t limit,
+                     uint32_t *doc_ids, float *scores, uint32_t *count)
+{
+    if (!index || !query || !count || (limit > 0 && !doc_ids))
+    {
+        set_error("Invalid argument");
+        return -1;
+    }
+    try
+    {
+        size_t total;
+        *count = 0;
+        if (index->ranked)
+        {
+            SimpleVector<ScoredDoc> top;
+            total = evaluate_ranked(query, limit, top);
+            for (size_t i = 0; i < top.size; ++i)
+            {
+                doc_ids[i] = top[i].doc_id;
+                if (scores)
+                    scores[i] = (float)top[i].score;
+            }
+            *count = top.size;
+        }
+        else
+        {
+            SimpleVector<int> top;
+            total = evaluate(query, limit, top);
+            for (size_t i = 0; i < top.size; ++i)
+            {
+                doc_ids[i] = top[i];
+                if (scores)
+                    scores[i] = 0;
+            }
+            *count = top.size;
+        }
+        return (int64_t)total;
+    }
+    catch (const std::exception &e)
+    {
+        set_error(e.what());
+        return -1;
+    }
+}
+
+int search_get_doc(const search_index *index, uint32_t doc_id,
+                   const char **url, size_t *url_len,
+                   const char **title, size_t *title_len)
+{
+    if (!index || doc_id >= index_doc_count())
+    {
+        set_error("No such document");
+        return -1;
+    }
+    DocView d = get_doc(doc_id);
+    *url = d.url.data();
+    *url_len = d.url.size();
+    *title = d.title.data();
+    *title_len = d.title.size();
+    return 0;
+}
+
+void search_set_cache_limits(search_index *index, size_t result_bytes, size_t postings_bytes)
+{
+    if (index)
+        set_cache_limits(result_bytes, postings_bytes);
+}
+
+void search_get_cache_stats(const search_index *index, search_cache_stats *results, search_cache_stats *postings)
+{
+    if (!index)
+        return;
+    copy_stats(result_cache_stats(), results);
+    copy_stats(postings_cache_stats(), postings);
+}
+
+size_t search_tokenize(const char *text, size_t len, char *out, size_t out_cap)
+{
+    thread_local TokenizerLib::Tokenizer tokenizer(&TokenizerLib::thread_stem_cache());
+    size_t n = 0;
+    auto append = [&](std::string_view term, TokenizerLib::StemCache::Entry *)
+    {
+        if (n > 0)
+        {
+            if (n < out_cap)
+                out[n] = '\n';
+            n++;
+        }
+        if (n < out_cap)
+            std::memcpy(out + n, term.data(), std::min(term.size(), out_cap - n));
+        n += term.size();
+    };
+    tokenizer.scan(std::string_view(text, len), append);
+    return n;
+}
+
+}
@@ -0,0 +1,75 @@
+#ifndef LIBSEARCH_H
+#define LIBSEARCH_H
+
+// C ABI поискового ядра для встраивания в другие процессы (Python через
+// ctypes, см. search_engine/libsearch.py). Функции не бросают исключений:
+// при ошибке возвращают -1 или NULL, текст ошибки даёт search_last_error().
+// Запросы к открытому индексу можно выполнять из нескольких потоков.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SEARCH_API __attribute__((visibility("default")))
+
+#define SEARCH_OPEN_MMAP 1  // отобразить файлы индекса вместо чтения в память
+#define SEARCH_OPEN_RANK 2  // упорядочивать результаты по BM25
+
+typedef struct search_index search_index;
+
+// Текст последней ошибки в текущем потоке
+SEARCH_API const char* search_last_error(void);
+
+// Открывает индекс; в процессе может быть открыт только один индекс
+SEARCH_API search_index* search_open(const char* index_dir, int flags);
+
+// Закрывает дескриптор. Память индекса остаётся за процессом: повторно
+// открыть другой индекс в этой версии нельзя.
+SEARCH_API void search_close(search_index* index);
+
+SEARCH_API uint32_t search_doc_count(const search_index* index);
+
+// Вычисляет запрос и пишет до limit doc_id в doc_ids (и score в scores,
+// если он не NULL; без SEARCH_OPEN_RANK score = 0), их число - в *count.
+// Возвращает полное число найденных документов или -1.
+SEARCH_API int64_t search_query(search_index* index, const char* query, uint32_t limit,
+                                uint32_t* doc_ids, float* scores, uint32_t* count);
+
+// Адрес и заголовок документа без копирования: указатели смотрят в память
+// индекса и действительны, пока жив процесс; для индекса со сжатым
+// index.docs - до следующего search_get_doc в том же потоке. 0 - успех,
+// -1 - нет документа.
+SEARCH_API int search_get_doc(const search_index* index, uint32_t doc_id,
+                              const char** url, size_t* url_len,
+                              const char** title, size_t* title_len);
+
+// Кеш результатов и кеш распакованных списков частых термов (лимиты в
+// байтах, 0 выключает кеш). По умолчанию 16 и 64 МБ.
+SEARCH_API void search_set_cache_limits(search_index* index, size_t result_bytes, size_t postings_bytes);
+
+typedef struct search_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t entries;
+    uint64_t bytes;
+    uint64_t limit;
+} search_cache_stats;
+
+// Счётчики кешей; любой из указателей может быть NULL
+SEARCH_API void search_get_cache_stats(const search_index* index, search_cache_stats* results,
+                                       search_cache_stats* postings);
+
+// Токенизация и стемминг как в индексаторе: термы через '\n' в out.
+// Возвращает длину результата; out_cap >= len всегда достаточно, при
+// меньшем буфере результат обрезается.
+SEARCH_API size_t search_tokenize(const char* text, size_t len, char* out, size_t out_cap);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,144 @@
+#ifndef LRU_CACHE_HPP
+#define LRU_CACHE_HPP
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include "common.hpp"
+#include "hash_table.hpp"
+
+// Счётчики кеша. Попадания и промахи считает владелец кеша: только он
+// знает, чем для него считается попадание.
+struct CacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    size_t entries = 0;
+    size_t bytes = 0;
+    size_t limit = 0;
+};
+
+// LRU-кеш со строковыми ключами и ограничением по памяти. Записи лежат в
+// пуле и связаны двусвязным списком по давности обращения (голова - самая
+// свежая); при превышении лимита вытесняется хвост. Размер записи задаёт
+// вызывающий. Сам кеш не синхронизирован.
+template <typename V>
+class LruCache {
+public:
+    explicit LruCache(size_t limit_bytes = 0) : head(NIL), tail(NIL), free_list(NIL), used(0), limit(limit_bytes) {}
+
+    LruCache(const LruCache&) = delete;
+    LruCache& operator=(const LruCache&) = delete;
+
+    void set_limit(size_t bytes) {
+        limit = bytes;
+        shrink(limit);
+    }
+
+    size_t limit_bytes() const { return limit; }
+
+    // Значение по ключу или nullptr; найденная запись становится самой свежей.
+    // Указатель действителен до следующего put/set_limit/clear.
+    V* get(std::string_view key) {
+        uint32_t* id = index.get(key);
+        if (!id) return nullptr;
+        unlink(*id);
+        push_front(*id);
+        return &nodes[*id].value;
+    }
+
+    // Вставляет или заменяет запись. Запись больше лимита не кладётся.
+    void put(std::string_view key, V&& value, size_t bytes) {
+        bytes += key.size() + sizeof(Node);
+        uint32_t* found = index.get(key);
+        if (found) remove(*found);
+        if (bytes > limit) return;
+        shrink(limit - bytes);
+
+        uint32_t id;
+        if (free_list != NIL) {
+            id = free_list;
+            free_list = nodes[id].next;
+        } else {
+            id = nodes.size;
+            nodes.push_back(Node());
+        }
+        Node& n = nodes[id];
+        n.key.assign(key.data(), key.size());
+        n.value = std::move(value);
+        n.bytes = bytes;
+        index[key] = id;
+        push_front(id);
+        used += bytes;
+    }
+
+    void clear() {
+        while (tail != NIL) remove(tail);
+    }
+
+    // Число вытеснений, записей и занятая память
+    void fill_stats(CacheStats& s) const {
+        s.evictions = evictions;
+        s.entries = index.size();
+        s.bytes = used;
+        s.limit = limit;
+    }
+
+private:
+    static const uint32_t NIL = 0xFFFFFFFF;
+
+    struct Node {
+        std::string key;
+        V value{};
+        size_t bytes = 0;
+        uint32_t prev = NIL;
+        uint32_t next = NIL;
+    };
+
+    SimpleVector<Node> nodes;
+    FlatHashMap<uint32_t> index;
+    uint32_t head;
+    uint32_t tail;
+    uint32_t free_list;
+    size_t used;
+    size_t limit;
+    uint64_t evictions = 0;
+
+    void unlink(uint32_t id) {
+        Node& n = nodes[id];
+        if (n.prev != NIL) nodes[n.prev].next = n.next;
+        else head = n.next;
+        if (n.next != NIL) nodes[n.next].prev = n.prev;
+        else tail = n.prev;
+        n.prev = n.next = NIL;
+    }
+
+    void push_front(uint32_t id) {
+        Node& n = nodes[id];
+        n.next = head;
+        if (head != NIL) nodes[head].prev = id;
+        head = id;
+        if (tail == NIL) tail = id;
+    }
+
+    void remove(uint32_t id) {
+        Node& n = nodes[id];
+        unlink(id);
+        index.erase(n.key);
+        used -= n.bytes;
+        n.key = std::string();
+        n.value = V();
+        n.next = free_list;
+        free_list = id;
+    }
+
+    void shrink(size_t target) {
+        while (used > target && tail != NIL) {
+            remove(tail);
+            evictions++;
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef MMAP_FILE_HPP
+#define MMAP_FILE_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Отображение файла индекса только на чтение (MAP_SHARED): страницы берутся
+// из page cache, поэтому несколько процессов поиска делят одну копию.
+class MappedFile {
+public:
+    const uint8_t* data;
+    size_t size;
+
+    MappedFile() : data(nullptr), size(0) {}
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    MappedFile(MappedFile&& other) noexcept : data(other.data), size(other.size) {
+        other.data = nullptr;
+        other.size = 0;
+    }
+
+    MappedFile& operator=(MappedFile&& other) noexcept {
+        if (this != &other) {
+            close();
+            data = other.data;
+            size = other.size;
+            other.data = nullptr;
+            other.size = 0;
+        }
+        return *this;
+    }
+
+    ~MappedFile() {
+        close();
+    }
+
+    void open(const std::string& path) {
+        close();
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) throw std::runtime_error("Cannot open " + path);
+
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            ::close(fd);
+            throw std::runtime_error("Cannot stat " + path);
+        }
+        size = (size_t)st.st_size;
+        if (size == 0) {
+            ::close(fd);
+            return;
+        }
+
+        void* p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) {
+            size = 0;
+            throw std::runtime_error("Cannot mmap " + path);
+        }
+        data = (const uint8_t*)p;
+    }
+
+    void close() {
+        if (data) {
+            munmap((void*)data, size);
+            data = nullptr;
+        }
+        size = 0;
+    }
+
+    bool is_open() const { return data != nullptr; }
+};
+
+// Чтение невыровненного little-endian поля из отображённого буфера.
+template <typename T>
+T load_le(const uint8_t* p) {
+    T value;
+    std::memcpy(&value, p, sizeof(T));
+    return value;
+}
+
+#endif
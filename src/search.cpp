@@ -1,523 +1,1159 @@
 #include <iostream>
+#include <iomanip>
 #include <string>
-#include <fstream>
+#include <string_view>
+#include <cstring>
+#include <cstdlib>
 #include <algorithm>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "common.hpp"
-#include "hash_table.hpp"
-#include "compression.hpp"
-#include "tokenizer_lib.hpp"
-
-struct TermEntry
+#include "mmap_file.hpp"
+#include "search_core.hpp"
+#include "shards.hpp"
+
+typedef std::chrono::steady_clock Clock;
+
+// --stats: при завершении в stderr пишутся задержки запросов (p50, p99,
+// максимум - от начала вычисления до готового ответа, без ожидания в
+// очереди), среднее время этапов на запрос и объём распакованных
+// постингов. Разбор, распаковку и операции над множествами считает ядро
+// (QueryStats), вывод - форматирование ответа с чтением заголовков
+// документов. Учитываются текстовые запросы и кадры FRAME_QUERY. У
+// координатора шардов этапы ядра нулевые: их печатает каждый шард.
+bool print_stats = false;
+
+struct StatsTotals
 {
-    uint64_t offset;
-    uint32_t doc_count;
+    std::mutex lock;
+    SimpleVector<uint64_t> latencies_ns;
+    QueryStats core;
+    uint64_t output_ns = 0;
 };
 
-struct DocInfo
+StatsTotals stats;
+
+// Конец вычисления текущего запроса потока: с него считается вывод
+thread_local Clock::time_point evaluated_at;
+
+void mark_evaluated()
 {
-    std::string url;
-    std::string title;
-};
+    if (print_stats)
+        evaluated_at = Clock::now();
+}
 
-HashMap<TermEntry> term_dict;
-SimpleVector<DocInfo> docs;
-std::string postings_data;
+uint64_t elapsed_ns(Clock::time_point from, Clock::time_point to)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(to - from).count();
+}
 
-SimpleVector<int> set_union(const SimpleVector<int> &a, const SimpleVector<int> &b)
+void record_query(Clock::time_point start)
 {
-    SimpleVector<int> res;
-    size_t i = 0, j = 0;
-    while (i < a.size && j < b.size)
-    {
-        if (a[i] < b[j])
-        {
-            res.push_back(a[i]);
-            i++;
-        }
-        else if (b[j] < a[i])
-        {
-            res.push_back(b[j]);
-            j++;
-        }
-        else
-        {
-            res.push_back(a[i]);
-            i++;
-            j++;
-        }
-    }
-    while (i < a.size)
-        res.push_back(a[i++]);
-    while (j < b.size)
-        res.push_back(b[j++]);
-    return res;
+    Clock::time_point end = Clock::now();
+    QueryStats q = take_query_stats();
+    std::lock_guard<std::mutex> guard(stats.lock);
+    stats.latencies_ns.push_back(elapsed_ns(start, end));
+    stats.output_ns += elapsed_ns(std::max(start, evaluated_at), end);
+    stats.core.parse_ns += q.parse_ns;
+    stats.core.decode_ns += q.decode_ns;
+    stats.core.eval_ns += q.eval_ns;
+    stats.core.bytes_decoded += q.bytes_decoded;
+    stats.core.blocks_decoded += q.blocks_decoded;
 }
 
-SimpleVector<int> set_intersect(const SimpleVector<int> &a, const SimpleVector<int> &b)
+void report_stats()
 {
-    SimpleVector<int> res;
-    size_t i = 0, j = 0;
-    while (i < a.size && j < b.size)
+    if (!print_stats)
+        return;
+    std::lock_guard<std::mutex> guard(stats.lock);
+    size_t n = stats.latencies_ns.size;
+    std::cerr << "Stats: " << n << " queries";
+    if (n == 0)
     {
-        if (a[i] < b[j])
-            i++;
-        else if (b[j] < a[i])
-            j++;
-        else
-        {
-            res.push_back(a[i]);
-            i++;
-            j++;
-        }
+        std::cerr << std::endl;
+        return;
     }
-    return res;
+    std::sort(stats.latencies_ns.begin(), stats.latencies_ns.end());
+    auto percentile = [&](size_t p)
+    { return stats.latencies_ns[(n - 1) * p / 100] / 1000.0; };
+    auto per_query = [&](uint64_t ns)
+    { return ns / 1000.0 / n; };
+    const QueryStats &c = stats.core;
+    std::cerr << std::fixed << std::setprecision(1);
+    std::cerr << ", latency p50 " << percentile(50) << " us, p99 " << percentile(99) << " us, max "
+              << percentile(100) << " us" << std::endl;
+    std::cerr << "Stages per query: parse " << per_query(c.parse_ns) << " us, decode " << per_query(c.decode_ns)
+              << " us, set ops " << per_query(c.eval_ns - std::min(c.eval_ns, c.decode_ns)) << " us, output "
+              << per_query(stats.output_ns) << " us" << std::endl;
+    std::cerr << "Decoded " << c.bytes_decoded << " bytes in " << c.blocks_decoded << " blocks, "
+              << c.bytes_decoded / n << " bytes per query" << std::endl;
 }
 
-SimpleVector<int> set_diff(const SimpleVector<int> &a, const SimpleVector<int> &b)
+// Ответ на запрос целиком: "Found N docs.", до 50 строк "title (url)" и
+// "__END_QUERY__", каждая строка с префиксом prefix.
+void answer_query(const std::string &query, const std::string &prefix, std::string &out)
 {
-    SimpleVector<int> res;
-    size_t i = 0, j = 0;
-    while (i < a.size && j < b.size)
+    IndexPin pin;
+    SimpleVector<int> results;
+    size_t total;
+    if (use_ranking)
     {
-        if (a[i] < b[j])
-        {
-            res.push_back(a[i]);
-            i++;
-        }
-        else if (b[j] < a[i])
-            j++;
-        else
+        SimpleVector<ScoredDoc> ranked;
+        total = evaluate_ranked(query, 50, ranked);
+        for (size_t i = 0; i < ranked.size; ++i)
+            results.push_back(ranked[i].doc_id);
+    }
+    else
+        total = evaluate(query, 50, results);
+    mark_evaluated();
+
+    out += prefix;
+    out += "Found " + std::to_string(total) + " docs.\n";
+    for (size_t i = 0; i < results.size; ++i)
+    {
+        int id = results[i];
+        if (id < (int)index_doc_count())
         {
-            i++;
-            j++;
+            DocView d = get_doc(id);
+            out += prefix;
+            out.append(d.title.data(), d.title.size());
+            out += " (";
+            out.append(d.url.data(), d.url.size());
+            out += ")\n";
         }
     }
-    while (i < a.size)
-        res.push_back(a[i++]);
-    return res;
+    out += prefix;
+    out += "__END_QUERY__\n";
 }
 
-void load_index(const std::string &index_dir)
+// Двоичный режим (--binary): после строки "Ready" запросы и ответы идут
+// кадрами [u8 тип][u32 id][u32 длина данных][данные], числа little-endian.
+// Запросы:
+//   FRAME_QUERY - u32 limit (0 - 50 документов), затем текст запроса;
+//   FRAME_DOCS  - u32 n, затем n doc_id по u32;
+//   FRAME_EXIT  - без данных, завершает работу;
+//   FRAME_RELOAD - каталог индекса (пусто - прежний), см. start_reload.
+// Ответ несёт id запроса и тип запроса | 0x80:
+//   на FRAME_QUERY - u64 всего найдено, u32 n, n пар (u32 doc_id, f32 score),
+//                    score = 0 без --rank;
+//   на FRAME_DOCS  - n пар (u16 длина, url), (u16 длина, title) в порядке
+//                    запроса, для несуществующего doc_id обе строки пустые;
+//   на FRAME_RELOAD - u64 число документов нового индекса, когда он
+//                    загружен и подменил прежний;
+//   FRAME_ERROR    - текст ошибки.
+// У шарда doc_id - общие номера из index.globals (global_doc_id), и
+// FRAME_DOCS принимает их же.
+// doc_id относятся к индексу, по которому вычислен запрос: если между
+// FRAME_QUERY и FRAME_DOCS индекс перезагрузили, страницу нужно запросить
+// заново.
+// Клиент получает номера и оценки без форматирования текста и запрашивает
+// заголовки и адреса пачкой только для тех документов, что покажет.
+bool use_binary = false;
+
+const uint8_t FRAME_QUERY = 1;
+const uint8_t FRAME_DOCS = 2;
+const uint8_t FRAME_EXIT = 3;
+const uint8_t FRAME_RELOAD = 4;
+const uint8_t FRAME_REPLY = 0x80;
+const uint8_t FRAME_ERROR = 0xFF;
+const size_t FRAME_HEADER_SIZE = 9;
+const uint32_t MAX_FRAME_SIZE = 64 << 20;
+
+template <typename T>
+void append_le(std::string &out, T value)
 {
-    std::string path_docs = index_dir + "/index.docs";
-    std::string path_dict = index_dir + "/index.dict";
-    std::string path_post = index_dir + "/index.postings";
+    out.append((const char *)&value, sizeof(T));
+}
 
-    std::ifstream f_docs(path_docs, std::ios::binary);
-    if (!f_docs)
-        throw std::runtime_error("Cannot open docs");
+// Заголовок кадра; длина данных дописывается в end_frame
+size_t begin_frame(std::string &out, uint8_t type, uint32_t id)
+{
+    append_le<uint8_t>(out, type);
+    append_le<uint32_t>(out, id);
+    append_le<uint32_t>(out, 0);
+    return out.size();
+}
 
-    char magic[4];
-    uint16_t ver;
-    uint32_t count;
-    f_docs.read(magic, 4);
-    f_docs.read((char *)&ver, 2);
-    f_docs.read((char *)&count, 4);
+void end_frame(std::string &out, size_t start)
+{
+    uint32_t len = out.size() - start;
+    std::memcpy(&out[start - 4], &len, 4);
+}
 
-    f_docs.seekg(count * 8, std::ios::cur);
+void append_string16(std::string &out, std::string_view s)
+{
+    std::string_view clipped = s.substr(0, 0xFFFF);
+    append_le<uint16_t>(out, clipped.size());
+    out.append(clipped.data(), clipped.size());
+}
 
-    for (size_t i = 0; i < count; ++i)
+// Координатор шардированного индекса (shards.hpp). На каждый шард
+// запускается свой процесс поиска в двоичном режиме; запрос рассылается
+// всем шардам сразу, и шарды считают его параллельно. Шарды отвечают
+// общими номерами документов (index.globals), а это номера одиночного
+// индекса из того же входа: списки шардов возрастают, булевы ответы
+// сливаются set_union в порядке одиночного индекса, а из ранжированных
+// отбираются лучшие по ranks_before. Заголовки запрашиваются у всех
+// шардов сразу, каждый отвечает за свои документы. Поэтому --shard CMD
+// должны обслуживать шарды одного индекса, собранного indexer --shards.
+// Все шарды ждут до общего срока --shard-timeout-ms от
+// рассылки; шард, не успевший к сроку, пропускается, ответ собирается из
+// остальных, а опоздание пишется в stderr. Оценки BM25 каждый шард
+// считает по своей статистике; при делении по хешу url она близка к
+// общей. Команды шардов задаются --shard CMD (выполняется /bin/sh, так
+// шард можно поднять на другой машине, например через ssh, с теми же
+// --rank и --mmap); без них для каталога с index.shards на каждый
+// shard-K запускается этот же bin/search с ключами координатора.
+const int DEFAULT_SHARD_TIMEOUT_MS = 2000;
+int shard_timeout_ms = DEFAULT_SHARD_TIMEOUT_MS;
+// Больше документов в ответе шарда не помещается в кадр
+const size_t MAX_SHARD_LIMIT = (MAX_FRAME_SIZE - 12) / 8;
+
+bool read_full(int fd, void *buf, size_t n)
+{
+    char *p = (char *)buf;
+    while (n > 0)
     {
-        uint16_t len;
-        DocInfo d;
-
-        f_docs.read((char *)&len, 2);
-        d.url.resize(len);
-        f_docs.read(&d.url[0], len);
-
-        f_docs.read((char *)&len, 2);
-        d.title.resize(len);
-        f_docs.read(&d.title[0], len);
-
-        docs.push_back(d);
+        ssize_t r = ::read(fd, p, n);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return false;
+        p += r;
+        n -= r;
     }
-    f_docs.close();
-
-    std::ifstream f_dict(path_dict, std::ios::binary);
-    if (!f_dict)
-        throw std::runtime_error("Cannot open dict");
-
-    f_dict.read(magic, 4);
-    f_dict.read((char *)&ver, 2);
-    f_dict.read((char *)&count, 4);
-
-    term_dict.reserve(count);
+    return true;
+}
 
-    for (size_t i = 0; i < count; ++i)
+bool write_full(int fd, const void *buf, size_t n)
+{
+    const char *p = (const char *)buf;
+    while (n > 0)
     {
-        uint8_t len;
-        f_dict.read((char *)&len, 1);
-        std::string term;
-        term.resize(len);
-        f_dict.read(&term[0], len);
-
-        TermEntry e;
-        f_dict.read((char *)&e.offset, 8);
-        f_dict.read((char *)&e.doc_count, 4);
-
-        term_dict.insert(std::move(term), std::move(e));
-        if (i % 500000 == 0)
-        {
-            std::cerr << "Loaded " << i << " terms...\r";
-        }
+        ssize_t r = ::write(fd, p, n);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return false;
+        p += r;
+        n -= r;
     }
-    std::cerr << "Loaded " << count << " terms." << std::endl;
-    f_dict.close();
-
-    std::ifstream f_post(path_post, std::ios::binary | std::ios::ate);
-    if (!f_post)
-        throw std::runtime_error("Cannot open postings");
-    std::streamsize size = f_post.tellg();
-    f_post.seekg(0, std::ios::beg);
-
-    postings_data.resize(size);
-    f_post.read(&postings_data[0], size);
-    f_post.close();
-
-    std::cerr << "Loaded " << docs.size << " docs and " << count << " terms." << std::endl;
+    return true;
 }
 
-struct DocPositions
+// Процесс шарда: кадры уходят в его stdin, ответы из stdout читает
+// отдельный поток и отдаёт ожидающему по id кадра. Ответ, которого уже
+// никто не ждёт (срок вышел), отбрасывается.
+class ShardClient
 {
-    int doc_id;
-    SimpleVector<int> positions;
-};
+public:
+    // Ожидание ответа на один кадр; живёт у ожидающего от send до wait
+    struct Pending
+    {
+        uint32_t id = 0;
+        bool sent = false;
+        bool done = false;
+        uint8_t type = 0;
+        std::string payload;
+    };
 
-SimpleVector<int> get_postings(const std::string &term)
-{
-    SimpleVector<int> res;
-    TermEntry *e = term_dict.get(term);
-    if (!e)
-        return res;
+    ShardClient(uint32_t number, SimpleVector<std::string> args) : number(number), args(std::move(args)) {}
 
-    const uint8_t *ptr = (const uint8_t *)postings_data.data() + e->offset;
-    size_t offset = 0;
+    ~ShardClient() { stop(); }
 
-    auto p1 = Compression::decode_varbyte(ptr, offset);
-    uint32_t doc_freq = p1.first;
-    offset = p1.second;
+    ShardClient(const ShardClient &) = delete;
+    ShardClient &operator=(const ShardClient &) = delete;
 
-    int curr_doc = 0;
-    for (size_t i = 0; i < doc_freq; ++i)
+    // Запускает процесс; готовность ждёт wait_ready, чтобы шарды
+    // загружали индексы одновременно
+    void spawn()
     {
-        auto p2 = Compression::decode_varbyte(ptr, offset);
-        curr_doc += p2.first;
-        offset = p2.second;
-
-        res.push_back(curr_doc);
-
-        auto p3 = Compression::decode_varbyte(ptr, offset);
-        uint32_t freq = p3.first;
-        offset = p3.second;
+        int to_child[2], from_child[2];
+        if (pipe2(to_child, O_CLOEXEC) != 0)
+            throw std::runtime_error("Cannot create pipe for shard " + std::to_string(number));
+        if (pipe2(from_child, O_CLOEXEC) != 0)
+        {
+            ::close(to_child[0]);
+            ::close(to_child[1]);
+            throw std::runtime_error("Cannot create pipe for shard " + std::to_string(number));
+        }
+        SimpleVector<char *> argv;
+        for (size_t i = 0; i < args.size; ++i)
+            argv.push_back(&args[i][0]);
+        argv.push_back(nullptr);
 
-        for (size_t j = 0; j < freq; ++j)
+        pid = fork();
+        if (pid == 0)
         {
-            auto p4 = Compression::decode_varbyte(ptr, offset);
-            offset = p4.second;
+            // dup2 снимает O_CLOEXEC с копий; каналы других шардов закроет exec
+            dup2(to_child[0], 0);
+            dup2(from_child[1], 1);
+            signal(SIGPIPE, SIG_DFL);
+            sigset_t none;
+            sigemptyset(&none);
+            sigprocmask(SIG_SETMASK, &none, nullptr);
+            execvp(argv.data[0], argv.data);
+            _exit(127);
         }
+        ::close(to_child[0]);
+        ::close(from_child[1]);
+        if (pid < 0)
+        {
+            ::close(to_child[1]);
+            ::close(from_child[0]);
+            throw std::runtime_error("Cannot start shard " + std::to_string(number));
+        }
+        to_fd = to_child[1];
+        from_fd = from_child[0];
     }
-    return res;
-}
 
-SimpleVector<DocPositions> get_full_postings(const std::string &term)
-{
-    SimpleVector<DocPositions> res;
-    TermEntry *e = term_dict.get(term);
-    if (!e)
-        return res;
-
-    const uint8_t *ptr = (const uint8_t *)postings_data.data() + e->offset;
-    size_t offset = 0;
-
-    auto p1 = Compression::decode_varbyte(ptr, offset);
-    uint32_t doc_freq = p1.first;
-    offset = p1.second;
-
-    int curr_doc = 0;
-    for (size_t i = 0; i < doc_freq; ++i)
+    // Ждёт строку "Ready" и запускает поток чтения ответов
+    void wait_ready()
     {
-        auto p2 = Compression::decode_varbyte(ptr, offset);
-        curr_doc += p2.first;
-        offset = p2.second;
-
-        DocPositions dp;
-        dp.doc_id = curr_doc;
-
-        auto p3 = Compression::decode_varbyte(ptr, offset);
-        uint32_t freq = p3.first;
-        offset = p3.second;
+        std::string line;
+        char c;
+        while (line != "Ready")
+        {
+            line.clear();
+            while (read_full(from_fd, &c, 1) && c != '\n')
+                line += c;
+            if (c != '\n')
+                throw std::runtime_error("Shard " + std::to_string(number) + " failed to start");
+        }
+        alive = true;
+        reader = std::thread(&ShardClient::read_replies, this);
+    }
 
-        int curr_pos = 0;
-        for (size_t j = 0; j < freq; ++j)
+    // Отправляет кадр; без ответа (шард недоступен) p.sent остаётся false
+    void send(uint8_t type, const std::string &payload, Pending &p)
+    {
+        std::string frame;
+        std::lock_guard<std::mutex> write_lock(write_mutex);
         {
-            auto p4 = Compression::decode_varbyte(ptr, offset);
-            curr_pos += p4.first;
-            offset = p4.second;
-            dp.positions.push_back(curr_pos);
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!alive)
+                return;
+            p.id = ++next_id;
+            pending.push_back(&p);
         }
-        res.push_back(dp);
+        size_t start = begin_frame(frame, type, p.id);
+        frame += payload;
+        end_frame(frame, start);
+        p.sent = write_full(to_fd, frame.data(), frame.size());
+        if (!p.sent)
+            forget(p);
     }
-    return res;
-}
 
-bool find_path(SimpleVector<int> *pos_lists, int count, int idx, int prev_pos, int first_pos, int max_dist, bool exact)
-{
-    if (idx == count)
+    // Ждёт ответ до deadline (nullptr - без срока); false - срок вышел или
+    // шард завершился
+    bool wait(Pending &p, const Clock::time_point *deadline)
+    {
+        if (!p.sent)
+            return false;
+        std::unique_lock<std::mutex> lock(mutex);
+        auto ready = [&]
+        { return p.done || !alive; };
+        if (deadline)
+            cv.wait_until(lock, *deadline, ready);
+        else
+            cv.wait(lock, ready);
+        if (!p.done)
+        {
+            lock.unlock();
+            forget(p);
+            std::lock_guard<std::mutex> relock(mutex);
+            if (p.done || !alive)
+                return p.done;
+            std::cerr << "Shard " << number << " timed out" << std::endl;
+            return false;
+        }
         return true;
+    }
 
-    SimpleVector<int> &candidates = pos_lists[idx];
-    for (size_t i = 0; i < candidates.size; ++i)
+    void stop()
     {
-        int pos = candidates[i];
-        if (idx == 0)
+        if (to_fd >= 0)
         {
-            if (find_path(pos_lists, count, idx + 1, pos, pos, max_dist, exact))
-                return true;
+            std::string frame;
+            end_frame(frame, begin_frame(frame, FRAME_EXIT, 0));
+            std::lock_guard<std::mutex> write_lock(write_mutex);
+            write_full(to_fd, frame.data(), frame.size());
+            ::close(to_fd);
+            to_fd = -1;
         }
-        else
+        if (reader.joinable())
+            reader.join();
+        if (from_fd >= 0)
+        {
+            ::close(from_fd);
+            from_fd = -1;
+        }
+        if (pid > 0)
         {
-            if (pos > prev_pos)
+            waitpid(pid, nullptr, 0);
+            pid = -1;
+        }
+    }
+
+private:
+    uint32_t number;
+    SimpleVector<std::string> args;
+    pid_t pid = -1;
+    int to_fd = -1;
+    int from_fd = -1;
+    std::thread reader;
+    std::mutex write_mutex;
+    std::mutex mutex;
+    std::condition_variable cv;
+    SimpleVector<Pending *> pending;
+    uint32_t next_id = 0;
+    bool alive = false;
+
+    void forget(Pending &p)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t i = 0; i < pending.size; ++i)
+        {
+            if (pending.data[i] == &p)
             {
-                if (exact && pos != prev_pos + 1)
-                    continue;
-                if ((pos - first_pos) > max_dist)
+                pending.data[i] = pending.data[pending.size - 1];
+                pending.pop_back();
+                break;
+            }
+        }
+    }
+
+    void read_replies()
+    {
+        uint8_t header[FRAME_HEADER_SIZE];
+        std::string payload;
+        while (read_full(from_fd, header, FRAME_HEADER_SIZE))
+        {
+            uint32_t id = load_le<uint32_t>(header + 1);
+            uint32_t len = load_le<uint32_t>(header + 5);
+            if (len > MAX_FRAME_SIZE)
+                break;
+            payload.resize(len);
+            if (len > 0 && !read_full(from_fd, &payload[0], len))
+                break;
+            std::lock_guard<std::mutex> lock(mutex);
+            for (size_t i = 0; i < pending.size; ++i)
+            {
+                Pending &p = *pending.data[i];
+                if (p.id != id)
                     continue;
-                if (find_path(pos_lists, count, idx + 1, pos, first_pos, max_dist, exact))
-                    return true;
+                p.type = header[0];
+                p.payload.swap(payload);
+                p.done = true;
+                pending.data[i] = pending.data[pending.size - 1];
+                pending.pop_back();
+                cv.notify_all();
+                break;
             }
         }
+        std::lock_guard<std::mutex> lock(mutex);
+        alive = false;
+        cv.notify_all();
+        std::cerr << "Shard " << number << " exited" << std::endl;
     }
-    return false;
+};
+
+SimpleVector<std::unique_ptr<ShardClient>> shards;
+
+void start_shards(const SimpleVector<SimpleVector<std::string>> &commands)
+{
+    // Упавший шард не должен ронять координатор сигналом при записи
+    signal(SIGPIPE, SIG_IGN);
+    for (size_t k = 0; k < commands.size; ++k)
+    {
+        shards.push_back(std::unique_ptr<ShardClient>(new ShardClient(k, commands[k])));
+        shards.data[k]->spawn();
+    }
+    for (size_t k = 0; k < shards.size; ++k)
+        shards.data[k]->wait_ready();
+    std::cerr << "Started " << shards.size << " shards." << std::endl;
+}
+
+void stop_shards()
+{
+    for (size_t k = 0; k < shards.size; ++k)
+        shards.data[k]->stop();
+}
+
+// Ждёт ответы на разосланные кадры до общего срока от конца рассылки
+void wait_replies(ShardClient::Pending *replies, bool use_timeout)
+{
+    Clock::time_point deadline = Clock::now() + std::chrono::milliseconds(shard_timeout_ms);
+    bool limited = use_timeout && shard_timeout_ms > 0;
+    for (size_t k = 0; k < shards.size; ++k)
+        shards.data[k]->wait(replies[k], limited ? &deadline : nullptr);
+}
+
+// Ошибка шарда становится ошибкой запроса
+void check_reply(const ShardClient::Pending &r, uint8_t type)
+{
+    if (r.type == FRAME_ERROR)
+        throw std::runtime_error(r.payload);
+    if (r.type != (type | FRAME_REPLY))
+        throw std::runtime_error("Unexpected reply from shard");
 }
 
-SimpleVector<int> sequence_search(SimpleVector<std::string> &terms, int max_dist)
+// Запрос по всем шардам: limit лучших (или первых) документов в top с
+// номерами координатора; возвращает сумму найденного ответившими шардами
+size_t scatter_query(const std::string &query, size_t limit, SimpleVector<ScoredDoc> &top)
 {
-    if (terms.size == 0)
-        return SimpleVector<int>();
+    size_t n = shards.size;
+    std::string payload;
+    append_le<uint32_t>(payload, limit);
+    payload += query;
+    std::unique_ptr<ShardClient::Pending[]> replies(new ShardClient::Pending[n]);
+    for (size_t k = 0; k < n; ++k)
+        shards.data[k]->send(FRAME_QUERY, payload, replies[k]);
+    wait_replies(replies.get(), true);
+
+    uint64_t total = 0;
+    SimpleVector<int> merged;
+    SimpleVector<ScoredDoc> scored;
+    for (size_t k = 0; k < n; ++k)
+    {
+        const ShardClient::Pending &r = replies[k];
+        if (!r.done)
+            continue;
+        check_reply(r, FRAME_QUERY);
+        const uint8_t *p = (const uint8_t *)r.payload.data();
+        if (r.payload.size() < 12 || r.payload.size() < 12 + 8 * (size_t)load_le<uint32_t>(p + 8))
+            throw std::runtime_error("Short reply from shard " + std::to_string(k));
+        total += load_le<uint64_t>(p);
+        uint32_t count = load_le<uint32_t>(p + 8);
+        SimpleVector<int> ids;
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            uint32_t global = load_le<uint32_t>(p + 12 + 8 * i);
+            if (global > (uint32_t)INT32_MAX)
+                throw std::runtime_error("Shard " + std::to_string(k) + " has too many docs");
+            if (use_ranking)
+                scored.push_back({(int)global, load_le<float>(p + 16 + 8 * i)});
+            else
+                ids.push_back((int)global);
+        }
+        if (!use_ranking)
+            merged = set_union(merged, ids);
+    }
 
-    SimpleVector<int> docs_intersection = get_postings(terms[0]);
-    for (size_t i = 1; i < terms.size; ++i)
+    if (use_ranking)
+    {
+        std::sort(scored.begin(), scored.end(), ranks_before);
+        for (size_t i = 0; i < scored.size && i < limit; ++i)
+            top.push_back(scored[i]);
+    }
+    else
     {
-        docs_intersection = set_intersect(docs_intersection, get_postings(terms[i]));
+        for (size_t i = 0; i < merged.size && i < limit; ++i)
+            top.push_back({merged[i], 0.0});
     }
+    return total;
+}
 
-    if (docs_intersection.size == 0)
-        return docs_intersection;
+struct ShardDoc
+{
+    bool found = false;
+    std::string url;
+    std::string title;
+};
 
-    SimpleVector<int> result;
+bool read_string16(const std::string &payload, size_t &pos, std::string &s)
+{
+    if (pos + 2 > payload.size())
+        return false;
+    size_t len = load_le<uint16_t>((const uint8_t *)payload.data() + pos);
+    if (pos + 2 + len > payload.size())
+        return false;
+    s.assign(payload, pos + 2, len);
+    pos += 2 + len;
+    return true;
+}
 
-    SimpleVector<SimpleVector<DocPositions>> all_term_postings;
-    for (size_t i = 0; i < terms.size; ++i)
+// Адреса и заголовки документов по общим номерам. Номер не говорит, в
+// каком шарде документ, поэтому список уходит всем шардам, и каждый
+// заполняет только свои документы; документы шарда, который не ответил,
+// остаются с found = false
+void gather_docs(const SimpleVector<int> &ids, SimpleVector<ShardDoc> &docs)
+{
+    size_t n = shards.size;
+    for (size_t i = 0; i < ids.size; ++i)
+        docs.push_back(ShardDoc());
+    if (ids.size == 0)
+        return;
+    std::string payload;
+    append_le<uint32_t>(payload, ids.size);
+    for (size_t i = 0; i < ids.size; ++i)
+        append_le<uint32_t>(payload, (uint32_t)ids[i]);
+    std::unique_ptr<ShardClient::Pending[]> replies(new ShardClient::Pending[n]);
+    for (size_t k = 0; k < n; ++k)
+        shards.data[k]->send(FRAME_DOCS, payload, replies[k]);
+    wait_replies(replies.get(), true);
+
+    std::string url, title;
+    for (size_t k = 0; k < n; ++k)
     {
-        all_term_postings.push_back(get_full_postings(terms[i]));
+        const ShardClient::Pending &r = replies[k];
+        if (!r.done)
+            continue;
+        check_reply(r, FRAME_DOCS);
+        size_t pos = 0;
+        for (size_t i = 0; i < ids.size; ++i)
+        {
+            if (!read_string16(r.payload, pos, url) || !read_string16(r.payload, pos, title))
+                throw std::runtime_error("Short reply from shard " + std::to_string(k));
+            ShardDoc &d = docs[i];
+            if (d.found || url.empty())
+                continue;
+            d.found = true;
+            d.url.swap(url);
+            d.title.swap(title);
+        }
     }
+}
 
-    for (size_t k = 0; k < docs_intersection.size; ++k)
+// Перезагрузка всех шардов из их прежних каталогов (пустой FRAME_RELOAD);
+// срок не действует, загрузка индекса бывает долгой. Возвращает общее
+// число документов; ошибка любого шарда - ошибка перезагрузки.
+size_t reload_shards()
+{
+    size_t n = shards.size;
+    std::unique_ptr<ShardClient::Pending[]> replies(new ShardClient::Pending[n]);
+    for (size_t k = 0; k < n; ++k)
+        shards.data[k]->send(FRAME_RELOAD, std::string(), replies[k]);
+    wait_replies(replies.get(), false);
+
+    size_t docs = 0;
+    std::string errors;
+    for (size_t k = 0; k < n; ++k)
     {
-        int doc_id = docs_intersection[k];
+        const ShardClient::Pending &r = replies[k];
+        std::string error;
+        if (!r.done)
+            error = "no reply";
+        else if (r.type == (FRAME_RELOAD | FRAME_REPLY) && r.payload.size() >= 8)
+            docs += load_le<uint64_t>((const uint8_t *)r.payload.data());
+        else
+            error = r.type == FRAME_ERROR ? r.payload : "unexpected reply";
+        if (!error.empty())
+            errors += (errors.empty() ? "shard " : "; shard ") + std::to_string(k) + ": " + error;
+    }
+    if (!errors.empty())
+        throw std::runtime_error(errors);
+    return docs;
+}
 
-        SimpleVector<int> *pos_lists = new SimpleVector<int>[terms.size];
-        bool found_all = true;
+// Текстовый ответ координатора в формате answer_query
+void answer_sharded_query(const std::string &query, const std::string &prefix, std::string &out)
+{
+    SimpleVector<ScoredDoc> top;
+    size_t total = scatter_query(query, 50, top);
+    mark_evaluated();
+    SimpleVector<int> ids;
+    for (size_t i = 0; i < top.size; ++i)
+        ids.push_back(top[i].doc_id);
+    SimpleVector<ShardDoc> docs;
+    gather_docs(ids, docs);
+
+    out += prefix;
+    out += "Found " + std::to_string(total) + " docs.\n";
+    for (size_t i = 0; i < docs.size; ++i)
+    {
+        if (!docs[i].found)
+            continue;
+        out += prefix;
+        out += docs[i].title;
+        out += " (";
+        out += docs[i].url;
+        out += ")\n";
+    }
+    out += prefix;
+    out += "__END_QUERY__\n";
+}
 
-        for (size_t t = 0; t < terms.size; ++t)
+void answer_frame(uint8_t type, uint32_t id, const std::string &payload, std::string &out)
+{
+    const uint8_t *p = (const uint8_t *)payload.data();
+    if (type == FRAME_QUERY)
+    {
+        if (payload.size() < 4)
+            throw std::runtime_error("Short query frame");
+        size_t limit = load_le<uint32_t>(p);
+        if (limit == 0)
+            limit = 50;
+        std::string query = payload.substr(4);
+
+        SimpleVector<ScoredDoc> ranked;
+        size_t total;
+        if (shards.size > 0)
+            total = scatter_query(query, std::min(limit, MAX_SHARD_LIMIT), ranked);
+        else
         {
-            bool found_term_doc = false;
-            for (size_t p = 0; p < all_term_postings[t].size; ++p)
+            IndexPin pin;
+            limit = std::min(limit, std::max<size_t>(index_doc_count(), 1));
+            if (use_ranking)
+                total = evaluate_ranked(query, limit, ranked);
+            else
             {
-                if (all_term_postings[t][p].doc_id == doc_id)
-                {
-                    pos_lists[t] = all_term_postings[t][p].positions;
-                    found_term_doc = true;
-                    break;
-                }
-            }
-            if (!found_term_doc)
-            {
-                found_all = false;
-                break;
+                SimpleVector<int> results;
+                total = evaluate(query, limit, results);
+                for (size_t i = 0; i < results.size; ++i)
+                    ranked.push_back({results[i], 0.0});
             }
+            // Шард отвечает общими номерами, обычный индекс - своими
+            for (size_t i = 0; i < ranked.size; ++i)
+                ranked[i].doc_id = global_doc_id(ranked[i].doc_id);
         }
+        mark_evaluated();
 
-        if (found_all)
+        size_t start = begin_frame(out, FRAME_QUERY | FRAME_REPLY, id);
+        append_le<uint64_t>(out, total);
+        append_le<uint32_t>(out, ranked.size);
+        for (size_t i = 0; i < ranked.size; ++i)
+        {
+            append_le<uint32_t>(out, ranked[i].doc_id);
+            append_le<float>(out, (float)ranked[i].score);
+        }
+        end_frame(out, start);
+    }
+    else if (type == FRAME_DOCS)
+    {
+        if (payload.size() < 4 || payload.size() < 4 + 4 * (size_t)load_le<uint32_t>(p))
+            throw std::runtime_error("Short docs frame");
+        uint32_t n = load_le<uint32_t>(p);
+        if (shards.size > 0)
         {
-            bool exact = (max_dist == (int)terms.size);
-            if (find_path(pos_lists, terms.size, 0, -1, -1, max_dist, exact))
+            SimpleVector<int> ids;
+            for (uint32_t i = 0; i < n; ++i)
+                ids.push_back((int)load_le<uint32_t>(p + 4 + 4 * i));
+            SimpleVector<ShardDoc> docs;
+            gather_docs(ids, docs);
+            size_t start = begin_frame(out, FRAME_DOCS | FRAME_REPLY, id);
+            for (size_t i = 0; i < docs.size; ++i)
             {
-                result.push_back(doc_id);
+                append_string16(out, docs[i].url);
+                append_string16(out, docs[i].title);
             }
+            end_frame(out, start);
+            return;
         }
-
-        delete[] pos_lists;
+        IndexPin pin;
+        size_t start = begin_frame(out, FRAME_DOCS | FRAME_REPLY, id);
+        for (uint32_t i = 0; i < n; ++i)
+        {
+            long long doc = local_doc_id(load_le<uint32_t>(p + 4 + 4 * i));
+            DocView d = doc >= 0 ? get_doc(doc) : DocView();
+            append_string16(out, d.url);
+            append_string16(out, d.title);
+        }
+        end_frame(out, start);
     }
-
-    return result;
+    else
+        throw std::runtime_error("Unknown frame type " + std::to_string(type));
 }
 
-// Токены для парсера
-enum TokenType
+// Параллельный режим (--threads N): пул потоков отвечает по общему индексу
+// только для чтения. Текстовые запросы приходят строками "<id>\t<query>",
+// каждая строка ответа начинается с "<id>\t"; в двоичном режиме id несёт
+// кадр. Блок ответа пишется целиком под мьютексом вывода, поэтому запросы
+// можно слать не дожидаясь ответов, а ответы приходят в порядке готовности.
+size_t serve_threads = 0;
+
+struct Request
 {
-    TOK_TERM,
-    TOK_AND,
-    TOK_OR,
-    TOK_NOT,
-    TOK_LPAREN,
-    TOK_RPAREN,
-    TOK_END
+    // Текстовый режим: префикс строк ответа и текст запроса
+    std::string prefix;
+    std::string query;
+    // Двоичный режим: кадр запроса, данные лежат в query
+    uint8_t frame = 0;
+    uint32_t frame_id = 0;
 };
 
-struct Token
+std::mutex output_mutex;
+
+void write_output(const std::string &out)
 {
-    TokenType type;
-    std::string value;
-};
+    std::lock_guard<std::mutex> lock(output_mutex);
+    std::cout << out << std::flush;
+}
 
-SimpleVector<Token> tokenize_query(const std::string &query)
+// Следующий запрос со stdin; false - конец ввода или команда выхода
+bool read_request(Request &r)
 {
-    SimpleVector<Token> tokens;
-    size_t i = 0;
-    while (i < query.size())
+    if (use_binary)
     {
-        while (i < query.size() && query[i] == ' ')
-            i++;
-        if (i >= query.size())
-            break;
+        uint8_t header[FRAME_HEADER_SIZE];
+        if (!std::cin.read((char *)header, FRAME_HEADER_SIZE))
+            return false;
+        r.frame = header[0];
+        r.frame_id = load_le<uint32_t>(header + 1);
+        uint32_t len = load_le<uint32_t>(header + 5);
+        if (r.frame == FRAME_EXIT)
+            return false;
+        if (len > MAX_FRAME_SIZE)
+            throw std::runtime_error("Frame too large");
+        r.query.resize(len);
+        return len == 0 || (bool)std::cin.read(&r.query[0], len);
+    }
 
-        if (query[i] == '(')
+    std::string line;
+    while (std::getline(std::cin, line))
+    {
+        if (line == "exit")
+            return false;
+        if (line.empty())
+            continue;
+        if (serve_threads == 0)
         {
-            tokens.push_back({TOK_LPAREN, "("});
-            i++;
+            r.prefix.clear();
+            r.query = std::move(line);
+            return true;
         }
-        else if (query[i] == ')')
+        size_t tab = line.find('\t');
+        if (tab == std::string::npos)
         {
-            tokens.push_back({TOK_RPAREN, ")"});
-            i++;
+            write_output("Error: expected <id>\\t<query>\n");
+            continue;
         }
-        else if (query[i] == '!' && (i + 1 >= query.size() || query[i + 1] != '='))
+        if (tab + 1 == line.size())
+            continue;
+        r.prefix = line.substr(0, tab + 1);
+        r.query = line.substr(tab + 1);
+        return true;
+    }
+    return false;
+}
+
+// Горячая перезагрузка: новый индекс грузится в фоновом потоке рядом с
+// текущим и подменяет его атомарно (open_index), запросы тем временем
+// обслуживаются по-прежнему. Запускается сигналом SIGHUP (тот же каталог,
+// удобно, если это символическая ссылка на последнюю сборку), текстовой
+// строкой "__RELOAD__" или "__RELOAD__ <dir>" (при --threads -
+// "<id>\t__RELOAD__") и кадром FRAME_RELOAD. Подчёркивания не входят в
+// токены, поэтому никакой запрос с командой не совпадает. Одновременно идёт
+// одна перезагрузка; SIGHUP, пришедший во время неё, запоминается и
+// запускает ещё одну сразу по её окончании, чтобы не потерять изменения,
+// сделанные после начала загрузки. Итог пишется в stderr; на кадр ответ приходит по
+// окончании загрузки, на текстовую команду сразу - блок "Reload started."
+// или "Error: ..." с __END_QUERY__, как у запроса, чтобы клиенты не теряли
+// соответствие запросов и ответов.
+std::string index_dir;
+std::mutex reload_mutex;
+bool reload_running = false;
+bool reload_pending = false;
+std::thread reload_thread;
+
+void load_index_again(const std::string &dir, bool reply, uint32_t frame_id)
+{
+    std::string out;
+    try
+    {
+        size_t docs;
+        if (shards.size > 0)
         {
-            tokens.push_back({TOK_NOT, "!"});
-            i++;
+            if (dir != index_dir)
+                throw std::runtime_error("Shards reload from their own directories");
+            docs = reload_shards();
         }
-        else if (i + 1 < query.size() && query[i] == '&' && query[i + 1] == '&')
+        else
         {
-            tokens.push_back({TOK_AND, "&&"});
-            i += 2;
+            open_index(dir);
+            docs = index_doc_count();
         }
-        else if (i + 1 < query.size() && query[i] == '|' && query[i + 1] == '|')
+        std::cerr << "Index reloaded from " << dir << ": " << docs << " docs." << std::endl;
+        if (reply)
         {
-            tokens.push_back({TOK_OR, "||"});
-            i += 2;
+            size_t start = begin_frame(out, FRAME_RELOAD | FRAME_REPLY, frame_id);
+            append_le<uint64_t>(out, docs);
+            end_frame(out, start);
         }
-        else if (std::isalnum((unsigned char)query[i]))
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Reload from " << dir << " failed: " << e.what() << std::endl;
+        if (reply)
         {
-            std::string term;
-            while (i < query.size() && std::isalnum((unsigned char)query[i]))
-            {
-                term += std::tolower((unsigned char)query[i]);
-                i++;
-            }
-            term = TokenizerLib::stem(term);
-            tokens.push_back({TOK_TERM, term});
+            size_t start = begin_frame(out, FRAME_ERROR, frame_id);
+            out += e.what();
+            end_frame(out, start);
         }
-        else
+    }
+    if (!out.empty())
+        write_output(out);
+}
+
+void run_reload(std::string dir, bool reply, uint32_t frame_id)
+{
+    load_index_again(dir, reply, frame_id);
+    std::unique_lock<std::mutex> lock(reload_mutex);
+    // SIGHUP во время загрузки: каталог мог смениться уже после её начала
+    while (reload_pending)
+    {
+        reload_pending = false;
+        lock.unlock();
+        load_index_again(index_dir, false, 0);
+        lock.lock();
+    }
+    reload_running = false;
+}
+
+// Под reload_mutex, перезагрузка не идёт
+void launch_reload(const std::string &dir, bool reply, uint32_t frame_id)
+{
+    // Предыдущая перезагрузка уже сняла флаг и завершается
+    if (reload_thread.joinable())
+        reload_thread.join();
+    reload_running = true;
+    reload_thread = std::thread(run_reload, dir.empty() ? index_dir : dir, reply, frame_id);
+}
+
+// Пустой dir - каталог, с которым запущен поиск. false - уже идёт другая
+// перезагрузка, на кадр тогда сразу уходит FRAME_ERROR
+bool start_reload(const std::string &dir, bool reply, uint32_t frame_id)
+{
+    std::lock_guard<std::mutex> lock(reload_mutex);
+    if (reload_running)
+    {
+        std::cerr << "Reload is already in progress" << std::endl;
+        if (reply)
         {
-            i++;
+            std::string out;
+            size_t start = begin_frame(out, FRAME_ERROR, frame_id);
+            out += "Reload is already in progress";
+            end_frame(out, start);
+            write_output(out);
         }
+        return false;
     }
-    tokens.push_back({TOK_END, ""});
-    return tokens;
+    launch_reload(dir, reply, frame_id);
+    return true;
 }
 
-// Рекурсивный спуск парсер
-class BoolParser
+// По SIGHUP: идущая перезагрузка повторится по окончании
+void signal_reload()
 {
-    SimpleVector<Token> tokens;
-    size_t pos;
+    std::lock_guard<std::mutex> lock(reload_mutex);
+    if (reload_running)
+        reload_pending = true;
+    else
+        launch_reload(std::string(), false, 0);
+}
 
-    Token &current() { return tokens[pos]; }
-    void advance()
+void finish_reload()
+{
+    std::thread t;
     {
-        if (pos < tokens.size - 1)
-            pos++;
+        std::lock_guard<std::mutex> lock(reload_mutex);
+        t = std::move(reload_thread);
     }
+    if (t.joinable())
+        t.join();
+}
 
-    SimpleVector<int> all_docs()
+const std::string RELOAD_COMMAND = "__RELOAD__";
+
+// "__RELOAD__" или "__RELOAD__ <dir>"
+bool parse_reload(const std::string &line, std::string &dir)
+{
+    size_t n = RELOAD_COMMAND.size();
+    if (line.compare(0, n, RELOAD_COMMAND) != 0 || (line.size() > n && line[n] != ' '))
+        return false;
+    size_t start = line.find_first_not_of(' ', n);
+    dir = start == std::string::npos ? std::string() : line.substr(start);
+    return true;
+}
+
+// SIGHUP заблокирован во всех потоках и принимается здесь через sigwait
+void watch_signals(sigset_t set)
+{
+    int sig;
+    while (sigwait(&set, &sig) == 0)
+        if (sig == SIGHUP)
+            signal_reload();
+}
+
+void answer_request(const Request &r, std::string &out)
+{
+    out.clear();
+    std::string dir;
+    if (use_binary && r.frame == FRAME_RELOAD)
     {
-        SimpleVector<int> res;
-        for (size_t i = 0; i < docs.size; i++)
-            res.push_back(i);
-        return res;
+        start_reload(r.query, true, r.frame_id);
+        return;
     }
-
-    // factor = TERM | NOT factor | LPAREN expr RPAREN
-    SimpleVector<int> parse_factor()
+    if (!use_binary && parse_reload(r.query, dir))
     {
-        if (current().type == TOK_NOT)
-        {
-            advance();
-            SimpleVector<int> operand = parse_factor();
-            return set_diff(all_docs(), operand);
-        }
-        if (current().type == TOK_LPAREN)
-        {
-            advance();
-            SimpleVector<int> res = parse_or();
-            if (current().type == TOK_RPAREN)
-                advance();
-            return res;
-        }
-        if (current().type == TOK_TERM)
+        out += r.prefix;
+        out += start_reload(dir, false, 0) ? "Reload started.\n" : "Error: Reload is already in progress\n";
+        out += r.prefix;
+        out += "__END_QUERY__\n";
+        return;
+    }
+    bool timed = print_stats && (use_binary ? r.frame == FRAME_QUERY : true);
+    Clock::time_point start;
+    if (timed)
+    {
+        // Работа ядра вне запросов (загрузка индекса) в счётчики не входит
+        take_query_stats();
+        start = Clock::now();
+    }
+    try
+    {
+        if (use_binary)
+            answer_frame(r.frame, r.frame_id, r.query, out);
+        else if (shards.size > 0)
+            answer_sharded_query(r.query, r.prefix, out);
+        else
+            answer_query(r.query, r.prefix, out);
+    }
+    catch (const std::exception &e)
+    {
+        out.clear();
+        if (use_binary)
         {
-            std::string term = current().value;
-            advance();
-            return get_postings(term);
+            size_t start = begin_frame(out, FRAME_ERROR, r.frame_id);
+            out += e.what();
+            end_frame(out, start);
         }
-        return SimpleVector<int>();
+        else
+            out = r.prefix + "Error: " + e.what() + "\n" + r.prefix + "__END_QUERY__\n";
     }
+    if (timed)
+        record_query(start);
+}
 
-    // term = factor ((AND | implicit) factor)*
-    SimpleVector<int> parse_and()
+// Очередь запросов ограниченного размера: поток чтения ждёт, если
+// обработчики не успевают
+class RequestQueue
+{
+    SimpleVector<Request> ring;
+    size_t head = 0;
+    size_t count = 0;
+    bool closed = false;
+    std::mutex mutex;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+
+public:
+    explicit RequestQueue(size_t capacity)
     {
-        SimpleVector<int> left = parse_factor();
-        while (current().type == TOK_AND || current().type == TOK_TERM ||
-               current().type == TOK_NOT || current().type == TOK_LPAREN)
-        {
-            if (current().type == TOK_AND)
-                advance();
-            SimpleVector<int> right = parse_factor();
-            left = set_intersect(left, right);
-        }
-        return left;
+        for (size_t i = 0; i < capacity; ++i)
+            ring.push_back(Request());
     }
 
-    // expr = term (OR term)*
-    SimpleVector<int> parse_or()
+    void push(Request &&r)
     {
-        SimpleVector<int> left = parse_and();
-        while (current().type == TOK_OR)
-        {
-            advance();
-            SimpleVector<int> right = parse_and();
-            left = set_union(left, right);
-        }
-        return left;
+        std::unique_lock<std::mutex> lock(mutex);
+        not_full.wait(lock, [this]
+                      { return count < ring.size; });
+        ring[(head + count) % ring.size] = std::move(r);
+        count++;
+        not_empty.notify_one();
     }
 
-public:
-    SimpleVector<int> parse(const std::string &query)
+    bool pop(Request &r)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [this]
+                       { return count > 0 || closed; });
+        if (count == 0)
+            return false;
+        r = std::move(ring[head]);
+        head = (head + 1) % ring.size;
+        count--;
+        not_full.notify_one();
+        return true;
+    }
+
+    void close()
     {
-        tokens = tokenize_query(query);
-        pos = 0;
-        if (tokens.size <= 1)
-            return SimpleVector<int>();
-        return parse_or();
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        not_empty.notify_all();
     }
 };
 
-SimpleVector<int> evaluate(const std::string &query)
+void serve_worker(RequestQueue &queue)
+{
+    Request r;
+    std::string out;
+    while (queue.pop(r))
+    {
+        answer_request(r, out);
+        if (!out.empty())
+            write_output(out);
+    }
+}
+
+void serve_concurrent()
+{
+    RequestQueue queue(serve_threads * 4);
+    SimpleVector<std::thread> threads;
+    for (size_t i = 0; i < serve_threads; ++i)
+        threads.push_back(std::thread(serve_worker, std::ref(queue)));
+
+    Request r;
+    try
+    {
+        while (read_request(r))
+            queue.push(std::move(r));
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Error reading requests: " << e.what() << std::endl;
+    }
+    queue.close();
+    for (size_t i = 0; i < threads.size; ++i)
+        threads[i].join();
+}
+
+// --cache-stats: счётчики кешей в stderr при завершении
+bool print_cache_stats = false;
+
+void report_cache(const char *name, const CacheStats &s)
 {
-    BoolParser parser;
-    return parser.parse(query);
+    std::cerr << name << " cache: " << s.hits << " hits, " << s.misses << " misses, " << s.evictions
+              << " evictions, " << s.entries << " entries, " << s.bytes << " of " << s.limit << " bytes" << std::endl;
+}
+
+// Координатор своих кешей не ведёт, счётчики печатают процессы шардов
+void report_caches()
+{
+    if (!print_cache_stats || shards.size > 0)
+        return;
+    report_cache("Result", result_cache_stats());
+    report_cache("Postings", postings_cache_stats());
+}
+
+const size_t MAX_SERVE_THREADS = 1024;
+const size_t MAX_CACHE_MB = 1 << 20;
+
+// Числовое значение ключа от 0 до max; иначе сообщение в stderr и false
+bool parse_count(const std::string &flag, const char *text, size_t max, size_t &out)
+{
+    char *end = nullptr;
+    errno = 0;
+    unsigned long long value = std::strtoull(text, &end, 10);
+    if (end == text || *end != '\0' || *text == '-' || errno == ERANGE || value > max)
+    {
+        std::cerr << "Bad value for " << flag << ": " << text << std::endl;
+        return false;
+    }
+    out = value;
+    return true;
 }
 
 int main(int argc, char *argv[])
@@ -526,49 +1162,157 @@ int main(int argc, char *argv[])
     std::ios::sync_with_stdio(false);
     std::cin.tie(nullptr);
 
-    if (argc < 2)
+    size_t result_cache_mb = DEFAULT_RESULT_CACHE_BYTES >> 20;
+    size_t postings_cache_mb = DEFAULT_POSTINGS_CACHE_BYTES >> 20;
+    // Ключи, с которыми запускаются процессы шардов каталога с index.shards
+    SimpleVector<std::string> shard_args;
+    SimpleVector<SimpleVector<std::string>> shard_commands;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--mmap")
+            use_mmap = true;
+        else if (arg == "--rank")
+            use_ranking = true;
+        else if (arg == "--binary")
+            use_binary = true;
+        else if (arg == "--threads" && has_value)
+        {
+            if (!parse_count(arg, argv[i + 1], MAX_SERVE_THREADS, serve_threads))
+                return 1;
+        }
+        else if (arg == "--result-cache-mb" && has_value)
+        {
+            if (!parse_count(arg, argv[i + 1], MAX_CACHE_MB, result_cache_mb))
+                return 1;
+        }
+        else if (arg == "--postings-cache-mb" && has_value)
+        {
+            if (!parse_count(arg, argv[i + 1], MAX_CACHE_MB, postings_cache_mb))
+                return 1;
+        }
+        else if (arg == "--cache-stats")
+            print_cache_stats = true;
+        else if (arg == "--stats")
+            print_stats = true;
+        else if (arg == "--shard" && has_value)
+        {
+            SimpleVector<std::string> command;
+            command.push_back("/bin/sh");
+            command.push_back("-c");
+            command.push_back(argv[++i]);
+            shard_commands.push_back(std::move(command));
+            continue;
+        }
+        else if (arg == "--shard-timeout-ms" && has_value)
+        {
+            size_t ms;
+            if (!parse_count(arg, argv[++i], INT32_MAX, ms))
+                return 1;
+            shard_timeout_ms = ms;
+            continue;
+        }
+        else
+        {
+            index_dir = arg;
+            continue;
+        }
+        if (arg != "--binary")
+            shard_args.push_back(arg);
+        if (arg == "--threads" || arg == "--result-cache-mb" || arg == "--postings-cache-mb")
+            shard_args.push_back(argv[++i]);
+    }
+    if (index_dir.empty() && shard_commands.size == 0)
     {
-        std::cerr << "Usage: search <index_dir>" << std::endl;
+        std::cerr << "Usage: search [--mmap] [--rank] [--threads N] [--binary] [--result-cache-mb N]"
+                     " [--postings-cache-mb N] [--cache-stats] [--stats] [--shard-timeout-ms N]"
+                     " <index_dir> | --shard CMD..." << std::endl;
         return 1;
     }
-    std::string index_dir = argv[1];
+    if (shard_commands.size == 0 && Shards::is_sharded(index_dir))
+    {
+        try
+        {
+            Shards::Layout layout = Shards::read_layout(index_dir);
+            for (uint32_t k = 0; k < layout.count; ++k)
+            {
+                SimpleVector<std::string> command;
+                command.push_back(argv[0]);
+                command.push_back("--binary");
+                for (size_t i = 0; i < shard_args.size; ++i)
+                    command.push_back(shard_args[i]);
+                command.push_back(Shards::shard_dir(index_dir, k));
+                shard_commands.push_back(std::move(command));
+            }
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << "Error loading index: " << e.what() << std::endl;
+            return 1;
+        }
+    }
 
     std::cerr << "Starting Search Engine..." << std::endl;
+    collect_stats = print_stats;
+    set_cache_limits(result_cache_mb << 20, postings_cache_mb << 20);
+
+    // Маска наследуется всеми потоками, созданными дальше
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    std::thread(watch_signals, signals).detach();
 
     try
     {
-        load_index(index_dir);
+        if (shard_commands.size > 0)
+            start_shards(shard_commands);
+        else
+            open_index(index_dir);
     }
     catch (const std::exception &e)
     {
         std::cerr << "Error loading index: " << e.what() << std::endl;
+        stop_shards();
         return 1;
     }
 
     std::cout << "Ready" << std::endl;
     std::cerr << "Index loaded. Ready for queries." << std::endl;
 
-    std::string line;
-    while (std::getline(std::cin, line))
+    if (serve_threads > 0)
     {
-        if (line == "exit")
-            break;
-        if (line.empty())
-            continue;
-
-        SimpleVector<int> results = evaluate(line);
+        serve_concurrent();
+        finish_reload();
+        stop_shards();
+        report_caches();
+        report_stats();
+        return 0;
+    }
 
-        std::cout << "Found " << results.size << " docs." << std::endl;
-        for (size_t i = 0; i < results.size && i < 50; ++i)
+    try
+    {
+        Request r;
+        std::string out;
+        while (read_request(r))
         {
-            int id = results[i];
-            if (id < (int)docs.size)
-            {
-                std::cout << docs[id].title << " (" << docs[id].url << ")" << std::endl;
-            }
+            answer_request(r, out);
+            if (!out.empty())
+                write_output(out);
         }
-        std::cout << "__END_QUERY__" << std::endl;
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Error reading requests: " << e.what() << std::endl;
+        finish_reload();
+        stop_shards();
+        return 1;
     }
 
+    finish_reload();
+    stop_shards();
+    report_caches();
+    report_stats();
     return 0;
 }
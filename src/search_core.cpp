@@ -0,0 +1,3047 @@
+#include <iostream>
+#include <string>
+#include <fstream>
+#include <algorithm>
+#include <memory>
+#include <string_view>
+#include <cmath>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+
+#include "common.hpp"
+#include "hash_table.hpp"
+#include "compression.hpp"
+#include "tokenizer_lib.hpp"
+#include "mmap_file.hpp"
+#include "lru_cache.hpp"
+#include "docstore.hpp"
+#include "bitset.hpp"
+#include "segments.hpp"
+#include "shards.hpp"
+#include "search_core.hpp"
+
+struct TermEntry
+{
+    uint64_t offset;
+    uint32_t doc_count;
+};
+
+// mmap-режим: файлы индекса отображаются целиком, постинги читаются прямо
+// из отображения без копирования. index.docs отображается в обоих режимах
+// (docstore.hpp).
+bool use_mmap = false;
+
+// Один неизменяемый индекс: каталог индекса целиком или сегмент
+// сегментированного индекса (segments.hpp). Номера документов внутри -
+// локальные, в общей нумерации к ним прибавляется doc_base.
+struct Segment
+{
+    size_t ordinal = 0;
+    int doc_base = 0;
+    size_t doc_count = 0;
+
+    FlatHashMap<TermEntry> term_dict;
+    DocStore::Reader docs;
+    std::string postings_data;
+    MappedFile dict_file;
+    MappedFile post_file;
+    MappedFile pos_file;
+    const uint8_t *postings_base = nullptr;
+    size_t postings_size = 0;
+
+    // Словарь v3 - плоский поток записей, который приходится целиком
+    // вставлять в term_dict. Словарь v4 отсортирован и сжат front coding
+    // блоками; поиск идёт бинарным поиском по таблице смещений блоков прямо
+    // в байтах файла, без построения хеш-таблицы.
+    std::string dict_data;
+    uint16_t dict_version = 0;
+    const uint8_t *dict_base = nullptr;
+    size_t dict_size = 0;
+    uint32_t dict_term_count = 0;
+    uint16_t dict_block_size = 0;
+    uint32_t dict_block_count = 0;
+    const uint8_t *dict_block_index = nullptr;
+
+    uint16_t post_version = 0;
+    uint16_t post_block_size = 0;
+    Compression::Codec post_codec = Compression::CODEC_VARBYTE;
+    size_t skip_entry_size = 12;
+    std::string positions_data;
+    const uint8_t *positions_base = nullptr;
+
+    std::string lengths_data;
+    MappedFile lens_file;
+    const uint8_t *length_codes = nullptr;
+    uint32_t length_table[256];
+    SimpleVector<uint32_t> doc_lengths;
+    uint32_t min_doc_length = 0;
+    uint64_t total_tokens = 0;
+
+    // Карта удалённых документов; nullptr, если удалений нет
+    SimpleVector<uint8_t> deleted;
+    const uint8_t *deleted_bits = nullptr;
+
+    bool is_deleted(int id) const { return Segments::is_deleted(deleted_bits, id); }
+
+    // Общие номера документов шарда (index.globals); пусто, если файла нет
+    SimpleVector<uint32_t> globals;
+};
+
+// Всё, что прочитано из каталога индекса. Снимок собирается целиком при
+// загрузке и дальше только читается. Опубликованный снимок лежит в
+// live_index; запрос закрепляет его (IndexPin) и работает через ix, так
+// что подмена индекса посреди запроса его не задевает, а старый снимок
+// освобождается последним отпустившим его запросом. Запрос выполняется по
+// сегментам по очереди, текущий сегмент - seg. Статистика BM25 общая для
+// всех сегментов и, как и doc_count, учитывает удалённые документы, пока
+// слияние их не вычистит.
+struct IndexSnapshot
+{
+    uint64_t generation = 0;
+    SimpleVector<std::unique_ptr<Segment>> segments;
+    size_t doc_count = 0;
+    uint32_t min_doc_length = 0;
+    double avg_doc_length = 0;
+    // У всех сегментов есть index.globals
+    bool has_globals = false;
+};
+
+typedef std::shared_ptr<const IndexSnapshot> IndexSnapshotPtr;
+
+// live_index меняется только через std::atomic_load/atomic_store
+IndexSnapshotPtr live_index;
+std::atomic<uint64_t> last_generation(0);
+std::mutex publish_mutex;
+
+// Снимок, закреплённый за текущим потоком, и сегмент, по которому сейчас
+// идёт запрос
+thread_local const IndexSnapshot *ix = nullptr;
+thread_local const Segment *seg = nullptr;
+
+// Снимок, который поток последним читал без IndexPin: держит его, пока
+// поток снова не обратится к индексу
+thread_local IndexSnapshotPtr unpinned;
+
+struct SegmentScope
+{
+    const Segment *prev;
+
+    explicit SegmentScope(const Segment &s) : prev(seg) { seg = &s; }
+    ~SegmentScope() { seg = prev; }
+};
+
+IndexPin::IndexPin() : held(std::atomic_load(&live_index)), prev(ix)
+{
+    if (!held)
+        throw std::runtime_error("Index is not loaded");
+    ix = held.get();
+}
+
+IndexPin::~IndexPin()
+{
+    ix = prev;
+}
+
+// Закреплённый снимок или, вне запроса, опубликованный, удержанный в unpinned
+const IndexSnapshot &current_index()
+{
+    if (ix)
+        return *ix;
+    unpinned = std::atomic_load(&live_index);
+    if (!unpinned)
+        throw std::runtime_error("Index is not loaded");
+    return *unpinned;
+}
+
+size_t index_doc_count()
+{
+    if (ix)
+        return ix->doc_count;
+    IndexSnapshotPtr s = std::atomic_load(&live_index);
+    return s ? s->doc_count : 0;
+}
+
+// Сегмент с наибольшим doc_base, не превосходящим id
+const Segment &segment_of(const IndexSnapshot &snap, size_t id)
+{
+    size_t lo = 0, hi = snap.segments.size;
+    while (hi - lo > 1)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if ((size_t)snap.segments.data[mid]->doc_base <= id)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return *snap.segments.data[lo];
+}
+
+uint32_t global_doc_id(size_t id)
+{
+    const IndexSnapshot &snap = current_index();
+    if (!snap.has_globals)
+        return id;
+    if (id >= snap.doc_count)
+        throw std::out_of_range("Document id out of range");
+    const Segment &s = segment_of(snap, id);
+    return s.globals.data[id - s.doc_base];
+}
+
+long long local_doc_id(uint32_t global)
+{
+    const IndexSnapshot &snap = current_index();
+    if (!snap.has_globals)
+        return global < snap.doc_count ? (long long)global : -1;
+    // Общие номера растут по сегментам, как и локальные
+    for (size_t i = 0; i < snap.segments.size; ++i)
+    {
+        const Segment &s = *snap.segments.data[i];
+        if (s.doc_count == 0 || s.globals.data[s.doc_count - 1] < global)
+            continue;
+        const uint32_t *p = std::lower_bound(s.globals.data, s.globals.data + s.doc_count, global);
+        return *p == global ? s.doc_base + (long long)(p - s.globals.data) : -1;
+    }
+    return -1;
+}
+
+DocView get_doc(size_t id)
+{
+    const IndexSnapshot &snap = current_index();
+    if (id >= snap.doc_count)
+        throw std::out_of_range("Document id out of range");
+    const Segment &s = segment_of(snap, id);
+    thread_local DocStore::BlockBuffer buf;
+    DocView d;
+    s.docs.get(id - s.doc_base, buf, d.url, d.title);
+    return d;
+}
+
+bool collect_stats = false;
+thread_local QueryStats query_stats;
+
+QueryStats take_query_stats()
+{
+    QueryStats res = query_stats;
+    query_stats = QueryStats();
+    return res;
+}
+
+// Прибавляет к счётчику время своей жизни, если сбор статистики включён
+class StageTimer
+{
+    uint64_t *acc;
+    std::chrono::steady_clock::time_point start;
+
+public:
+    explicit StageTimer(uint64_t &ns) : acc(collect_stats ? &ns : nullptr)
+    {
+        if (acc)
+            start = std::chrono::steady_clock::now();
+    }
+
+    ~StageTimer()
+    {
+        if (acc)
+            *acc += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+};
+
+void count_decoded(size_t bytes)
+{
+    if (!collect_stats)
+        return;
+    query_stats.bytes_decoded += bytes;
+    query_stats.blocks_decoded++;
+}
+
+SimpleVector<int> set_union(const SimpleVector<int> &a, const SimpleVector<int> &b)
+{
+    SimpleVector<int> res;
+    size_t i = 0, j = 0;
+    while (i < a.size && j < b.size)
+    {
+        if (a[i] < b[j])
+        {
+            res.push_back(a[i]);
+            i++;
+        }
+        else if (b[j] < a[i])
+        {
+            res.push_back(b[j]);
+            j++;
+        }
+        else
+        {
+            res.push_back(a[i]);
+            i++;
+            j++;
+        }
+    }
+    while (i < a.size)
+        res.push_back(a[i++]);
+    while (j < b.size)
+        res.push_back(b[j++]);
+    return res;
+}
+
+// Пересечение короткого списка с длинным: для каждого элемента короткого
+// галопом ищем позицию в длинном вместо линейного слияния.
+SimpleVector<int> gallop_intersect(const SimpleVector<int> &small, const SimpleVector<int> &large)
+{
+    SimpleVector<int> res;
+    size_t lo = 0;
+    for (size_t i = 0; i < small.size && lo < large.size; ++i)
+    {
+        int target = small[i];
+        if (large.data[lo] < target)
+        {
+            size_t step = 1;
+            while (lo + step < large.size && large.data[lo + step] < target)
+            {
+                lo += step;
+                step *= 2;
+            }
+            size_t hi = std::min(lo + step, large.size);
+            lo++;
+            while (lo < hi)
+            {
+                size_t mid = lo + (hi - lo) / 2;
+                if (large.data[mid] < target)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+        }
+        if (lo < large.size && large.data[lo] == target)
+            res.push_back(target);
+    }
+    return res;
+}
+
+SimpleVector<int> set_intersect(const SimpleVector<int> &a, const SimpleVector<int> &b)
+{
+    if (a.size * 16 < b.size)
+        return gallop_intersect(a, b);
+    if (b.size * 16 < a.size)
+        return gallop_intersect(b, a);
+
+    SimpleVector<int> res;
+    size_t i = 0, j = 0;
+    while (i < a.size && j < b.size)
+    {
+        if (a[i] < b[j])
+            i++;
+        else if (b[j] < a[i])
+            j++;
+        else
+        {
+            res.push_back(a[i]);
+            i++;
+            j++;
+        }
+    }
+    return res;
+}
+
+SimpleVector<int> set_diff(const SimpleVector<int> &a, const SimpleVector<int> &b)
+{
+    SimpleVector<int> res;
+    size_t i = 0, j = 0;
+    while (i < a.size && j < b.size)
+    {
+        if (a[i] < b[j])
+        {
+            res.push_back(a[i]);
+            i++;
+        }
+        else if (b[j] < a[i])
+            j++;
+        else
+        {
+            i++;
+            j++;
+        }
+    }
+    while (i < a.size)
+        res.push_back(a[i++]);
+    return res;
+}
+
+// Словарь v3 целиком переносится в term_dict; для v4 читается только
+// заголовок, поиск идёт по блокам в байтах файла.
+void load_flat_dict(Segment &s)
+{
+    s.term_dict.reserve(s.dict_term_count);
+
+    const uint8_t *p = s.dict_base + 10;
+    const uint8_t *end = s.dict_base + s.dict_size;
+    for (size_t i = 0; i < s.dict_term_count; ++i)
+    {
+        if (p + 1 > end || p + 1 + *p + 12 > end)
+            throw std::runtime_error("Truncated dict");
+        uint8_t len = *p++;
+        std::string_view term((const char *)p, len);
+        p += len;
+
+        TermEntry e;
+        e.offset = load_le<uint64_t>(p);
+        e.doc_count = load_le<uint32_t>(p + 8);
+        p += 12;
+
+        s.term_dict.insert(term, std::move(e));
+        if (i % 500000 == 0)
+        {
+            std::cerr << "Loaded " << i << " terms...\r";
+        }
+    }
+    std::cerr << "Loaded " << s.dict_term_count << " terms." << std::endl;
+}
+
+void open_dict(Segment &s, const uint8_t *base, size_t size, const std::string &path)
+{
+    if (size < 10 || std::memcmp(base, "DICT", 4) != 0)
+        throw std::runtime_error("Bad header in " + path);
+    s.dict_base = base;
+    s.dict_size = size;
+    s.dict_version = load_le<uint16_t>(base + 4);
+    s.dict_term_count = load_le<uint32_t>(base + 6);
+
+    if (s.dict_version < 4)
+    {
+        load_flat_dict(s);
+        return;
+    }
+
+    if (size < 24)
+        throw std::runtime_error("Truncated dict");
+    s.dict_block_size = load_le<uint16_t>(base + 10);
+    s.dict_block_count = load_le<uint32_t>(base + 12);
+    uint64_t index_offset = load_le<uint64_t>(base + 16);
+    if (s.dict_block_size == 0 || index_offset < 24 || index_offset > size ||
+        (uint64_t)s.dict_block_count * 8 > size - index_offset)
+        throw std::runtime_error("Truncated dict block index");
+    // Блоки полные, кроме последнего: иначе число термов блока ниже уходит
+    // в переполнение
+    if (s.dict_block_count != ((uint64_t)s.dict_term_count + s.dict_block_size - 1) / s.dict_block_size)
+        throw std::runtime_error("Corrupt dict in " + path);
+    s.dict_block_index = base + index_offset;
+    // Первый терм и смещение каждого блока целиком в файле: по ним идёт
+    // двоичный поиск
+    for (uint32_t b = 0; b < s.dict_block_count; ++b)
+    {
+        uint64_t off = load_le<uint64_t>(s.dict_block_index + (size_t)b * 8);
+        if (off < 24 || off >= size || size - off < 1 + (uint64_t)base[off] + 8)
+            throw std::runtime_error("Corrupt dict in " + path);
+    }
+    std::cerr << "Opened sorted dict: " << s.dict_term_count << " terms in " << s.dict_block_count << " blocks." << std::endl;
+}
+
+const uint8_t *dict_block(uint32_t b)
+{
+    return seg->dict_base + load_le<uint64_t>(seg->dict_block_index + (size_t)b * 8);
+}
+
+// Термы блока b словаря v4 по порядку. Каждое чтение проверяется по концу
+// файла и длине терма, испорченный блок - std::runtime_error, а не выход
+// за буфер или отображение.
+class DictBlockCursor
+{
+public:
+    char term[255];
+    size_t len = 0;
+    uint64_t offset = 0;
+    uint32_t doc_count = 0;
+
+    explicit DictBlockCursor(uint32_t b)
+        : p(dict_block(b)), end(seg->dict_base + seg->dict_size),
+          left(std::min<uint32_t>(seg->dict_block_size, seg->dict_term_count - b * seg->dict_block_size)) {}
+
+    // Следующий терм или false в конце блока
+    bool next()
+    {
+        if (left == 0)
+            return false;
+        if (first)
+        {
+            // Первый терм проверен при открытии (open_dict)
+            len = *p++;
+            std::memcpy(term, p, len);
+            p += len;
+            offset = load_le<uint64_t>(p);
+            p += 8;
+            first = false;
+        }
+        else
+        {
+            if (end - p < 2)
+                throw std::runtime_error("Corrupt dict");
+            size_t prefix = p[0];
+            size_t suffix = p[1];
+            p += 2;
+            if (prefix > len || prefix + suffix > sizeof(term) || (size_t)(end - p) < suffix)
+                throw std::runtime_error("Corrupt dict");
+            std::memcpy(term + prefix, p, suffix);
+            p += suffix;
+            len = prefix + suffix;
+            offset += read_varbyte();
+        }
+        doc_count = read_varbyte();
+        left--;
+        return true;
+    }
+
+    std::string_view view() const { return std::string_view(term, len); }
+
+private:
+    const uint8_t *p;
+    const uint8_t *end;
+    uint32_t left;
+    bool first = true;
+
+    uint32_t read_varbyte()
+    {
+        uint32_t value = 0;
+        for (int shift = 0;; shift += 7)
+        {
+            if (p == end || shift > 28)
+                throw std::runtime_error("Corrupt dict");
+            uint8_t byte = *p++;
+            value |= (uint32_t)(byte & 0x7F) << shift;
+            if (!(byte & 0x80))
+                return value;
+        }
+    }
+};
+
+bool find_sorted_term(std::string_view term, TermEntry &out)
+{
+    if (seg->dict_block_count == 0)
+        return false;
+
+    // Последний блок, первый терм которого <= term
+    uint32_t lo = 0, hi = seg->dict_block_count;
+    while (hi - lo > 1)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        const uint8_t *p = dict_block(mid);
+        if (std::string_view((const char *)p + 1, *p) <= term)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    DictBlockCursor c(lo);
+    while (c.next())
+    {
+        int cmp = c.view().compare(term);
+        if (cmp == 0)
+        {
+            // Смещение за концом index.postings - тоже порча словаря
+            if (c.offset >= seg->postings_size)
+                throw std::runtime_error("Corrupt dict");
+            out.offset = c.offset;
+            out.doc_count = c.doc_count;
+            return true;
+        }
+        if (cmp > 0)
+            return false;
+    }
+    return false;
+}
+
+bool find_term(std::string_view term, TermEntry &out)
+{
+    if (seg->dict_version >= 4)
+        return find_sorted_term(term, out);
+
+    const TermEntry *e = seg->term_dict.get(term);
+    if (!e)
+        return false;
+    out = *e;
+    return true;
+}
+
+// Обходит все термы словаря (без самих строк) в порядке хранения
+template <typename F>
+void for_each_term_entry(F f)
+{
+    if (seg->dict_version < 4)
+    {
+        for (auto it = seg->term_dict.begin(); it != seg->term_dict.end(); ++it)
+            f(it->value);
+        return;
+    }
+
+    for (uint32_t b = 0; b < seg->dict_block_count; ++b)
+    {
+        DictBlockCursor c(b);
+        while (c.next())
+        {
+            TermEntry e;
+            e.offset = c.offset;
+            e.doc_count = c.doc_count;
+            f(e);
+        }
+    }
+}
+
+// Постинги v5-v8: index.postings хранит только doc_id и freq, позиции
+// лежат отдельным потоком в index.positions. Запись терма: doc_freq,
+// смещение позиций терма (uint64), таблица пропусков из троек uint32
+// (последний doc_id блока, смещение блока, смещение позиций блока), затем
+// блоки по post_block_size документов: разности doc_id, за ними freq.
+// В v6 заголовок содержит кодек блоков, v5 всегда varbyte. В v7 запись
+// пропуска дополнена максимальным freq блока. В v8 doc_id блока
+// записаны разностями или битовой картой, смотря что короче
+// (Compression::encode_doc_block).
+const uint16_t MAX_POST_BLOCK_SIZE = 1024;
+const uint32_t UNKNOWN_MAX_FREQ = 0xFFFFFFFF;
+
+void open_postings(Segment &s, const uint8_t *base, size_t size, const std::string &path)
+{
+    if (size < 6 || std::memcmp(base, "POST", 4) != 0)
+        throw std::runtime_error("Bad header in " + path);
+    s.postings_size = size;
+    s.post_version = load_le<uint16_t>(base + 4);
+    if (s.post_version != 3 && (s.post_version < 5 || s.post_version > 8))
+        throw std::runtime_error("Unsupported postings version in " + path);
+    if (s.post_version >= 5)
+    {
+        if (size < 8)
+            throw std::runtime_error("Truncated postings");
+        s.post_block_size = load_le<uint16_t>(base + 6);
+        if (s.post_block_size == 0 || s.post_block_size > MAX_POST_BLOCK_SIZE)
+            throw std::runtime_error("Bad postings block size");
+    }
+    s.post_codec = Compression::CODEC_VARBYTE;
+    if (s.post_version >= 6)
+    {
+        if (size < 10)
+            throw std::runtime_error("Truncated postings");
+        uint16_t codec = load_le<uint16_t>(base + 8);
+        if (codec != Compression::CODEC_VARBYTE && codec != Compression::CODEC_STREAMVBYTE)
+            throw std::runtime_error("Unknown postings codec in " + path);
+        s.post_codec = (Compression::Codec)codec;
+    }
+    s.skip_entry_size = s.post_version >= 7 ? 16 : 12;
+}
+
+void open_positions(Segment &s, const uint8_t *base, size_t size, const std::string &path)
+{
+    if (size < 6 || std::memcmp(base, "POSN", 4) != 0 || load_le<uint16_t>(base + 4) != s.post_version)
+        throw std::runtime_error("Bad header in " + path);
+    s.positions_base = base;
+}
+
+struct PostingList
+{
+    uint32_t doc_freq;
+    uint32_t block_count;
+    const uint8_t *skips;
+    const uint8_t *data;
+    const uint8_t *positions;
+
+    // Параметры формата из заголовка index.postings
+    uint16_t version;
+    uint16_t block_size;
+    Compression::Codec codec;
+    size_t skip_entry_size;
+
+    const uint8_t *skip(uint32_t b) const { return skips + (size_t)b * skip_entry_size; }
+    uint32_t block_last(uint32_t b) const { return load_le<uint32_t>(skip(b)); }
+    const uint8_t *block_start(uint32_t b) const { return data + load_le<uint32_t>(skip(b) + 4); }
+    const uint8_t *block_positions(uint32_t b) const { return positions + load_le<uint32_t>(skip(b) + 8); }
+    int block_base(uint32_t b) const { return b == 0 ? 0 : (int)block_last(b - 1); }
+    uint32_t block_max_freq(uint32_t b) const
+    {
+        return version >= 7 ? load_le<uint32_t>(skip(b) + 12) : UNKNOWN_MAX_FREQ;
+    }
+    uint32_t block_docs(uint32_t b) const
+    {
+        return b + 1 < block_count ? block_size : doc_freq - b * block_size;
+    }
+};
+
+PostingList open_posting_list(const TermEntry &e)
+{
+    PostingList pl;
+    pl.version = seg->post_version;
+    pl.block_size = seg->post_block_size;
+    pl.codec = seg->post_codec;
+    pl.skip_entry_size = seg->skip_entry_size;
+    const uint8_t *ptr = seg->postings_base + e.offset;
+    auto p = Compression::decode_varbyte(ptr, 0);
+    pl.doc_freq = p.first;
+    pl.block_count = (pl.doc_freq + seg->post_block_size - 1) / seg->post_block_size;
+    pl.positions = seg->positions_base + load_le<uint64_t>(ptr + p.second);
+    pl.skips = ptr + p.second + 8;
+    pl.data = pl.skips + (size_t)pl.block_count * seg->skip_entry_size;
+    return pl;
+}
+
+// Дописывает doc_id блока в out; возвращает смещение в блоке, с которого идут freq
+size_t decode_block(const PostingList &pl, uint32_t b, SimpleVector<int> &out)
+{
+    StageTimer timer(query_stats.decode_ns);
+    uint32_t gaps[MAX_POST_BLOCK_SIZE];
+    uint32_t n = pl.block_docs(b);
+    size_t offset = pl.version >= 8 ? Compression::decode_doc_block(pl.codec, pl.block_start(b), n, gaps)
+                                    : Compression::decode_block(pl.codec, pl.block_start(b), n, gaps);
+    count_decoded(offset);
+
+    int curr_doc = pl.block_base(b);
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        curr_doc += gaps[i];
+        out.push_back(curr_doc);
+    }
+    return offset;
+}
+
+// freq n документов блока b, идущие со смещения offset от начала блока
+void decode_freqs(const PostingList &pl, uint32_t b, size_t offset, uint32_t n, uint32_t *out)
+{
+    StageTimer timer(query_stats.decode_ns);
+    size_t bytes = Compression::decode_block(pl.codec, pl.block_start(b) + offset, n, out);
+    if (collect_stats)
+        query_stats.bytes_decoded += bytes;
+}
+
+// Первый блок, начиная с b, последний doc_id которого >= target
+uint32_t skip_to_block(const PostingList &pl, uint32_t b, uint32_t target)
+{
+    if (b >= pl.block_count || pl.block_last(b) >= target)
+        return b;
+    uint32_t lo = b, step = 1;
+    while (lo + step < pl.block_count && pl.block_last(lo + step) < target)
+    {
+        lo += step;
+        step *= 2;
+    }
+    uint32_t hi = std::min(lo + step, pl.block_count);
+    while (hi - lo > 1)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (pl.block_last(mid) < target)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return hi;
+}
+
+// Длины документов (index.lengths): заголовок с числом документов, суммой
+// токенов и минимальной длиной, затем по байту-коду длины на документ.
+// Файл необязателен, без него длины считаются по постингам.
+void open_lengths(Segment &s, const uint8_t *base, size_t size, const std::string &path)
+{
+    if (size < 22 || std::memcmp(base, "LENS", 4) != 0 || load_le<uint16_t>(base + 4) != 1)
+        throw std::runtime_error("Bad header in " + path);
+    uint32_t count = load_le<uint32_t>(base + 6);
+    if (count != s.doc_count || size < 22 + (size_t)count)
+        throw std::runtime_error("Length table does not match docs in " + path);
+    s.total_tokens = load_le<uint64_t>(base + 10);
+    s.min_doc_length = load_le<uint32_t>(base + 18);
+    for (int c = 0; c < 256; ++c)
+        s.length_table[c] = Compression::decode_length_byte((uint8_t)c);
+    s.length_codes = base + 22;
+}
+
+uint32_t doc_length(int id)
+{
+    return seg->length_codes ? seg->length_table[seg->length_codes[id]] : seg->doc_lengths.data[id];
+}
+
+bool file_exists(const std::string &path)
+{
+    return std::ifstream(path).good();
+}
+
+void read_file(const std::string &path, std::string &out)
+{
+    std::ifstream f(path, std::ios::binary | std::ios::ate);
+    if (!f)
+        throw std::runtime_error("Cannot open " + path);
+    std::streamsize size = f.tellg();
+    f.seekg(0, std::ios::beg);
+
+    out.resize(size);
+    f.read(&out[0], size);
+}
+
+void load_index(Segment &s, const std::string &index_dir)
+{
+    std::string path_docs = index_dir + "/index.docs";
+    std::string path_dict = index_dir + "/index.dict";
+    std::string path_post = index_dir + "/index.postings";
+    std::string path_pos = index_dir + "/index.positions";
+    std::string path_lens = index_dir + "/index.lengths";
+
+    s.docs.open(path_docs);
+
+    read_file(path_dict, s.dict_data);
+    open_dict(s, (const uint8_t *)s.dict_data.data(), s.dict_data.size(), path_dict);
+
+    read_file(path_post, s.postings_data);
+    s.postings_base = (const uint8_t *)s.postings_data.data();
+    open_postings(s, s.postings_base, s.postings_data.size(), path_post);
+
+    if (s.post_version >= 5)
+    {
+        read_file(path_pos, s.positions_data);
+        open_positions(s, (const uint8_t *)s.positions_data.data(), s.positions_data.size(), path_pos);
+    }
+    s.doc_count = s.docs.size();
+
+    if (file_exists(path_lens))
+    {
+        read_file(path_lens, s.lengths_data);
+        open_lengths(s, (const uint8_t *)s.lengths_data.data(), s.lengths_data.size(), path_lens);
+    }
+
+    std::cerr << "Loaded " << s.doc_count << " docs and " << s.dict_term_count << " terms." << std::endl;
+}
+
+uint16_t check_header(const MappedFile &f, const char *magic, const std::string &path)
+{
+    if (f.size < 6 || std::memcmp(f.data, magic, 4) != 0)
+        throw std::runtime_error("Bad header in " + path);
+    return load_le<uint16_t>(f.data + 4);
+}
+
+void load_index_mmap(Segment &s, const std::string &index_dir)
+{
+    std::string path_docs = index_dir + "/index.docs";
+    std::string path_dict = index_dir + "/index.dict";
+    std::string path_post = index_dir + "/index.postings";
+    std::string path_pos = index_dir + "/index.positions";
+    std::string path_lens = index_dir + "/index.lengths";
+
+    s.docs.open(path_docs);
+    s.doc_count = s.docs.size();
+
+    s.dict_file.open(path_dict);
+    open_dict(s, s.dict_file.data, s.dict_file.size, path_dict);
+
+    s.post_file.open(path_post);
+    s.postings_base = s.post_file.data;
+    open_postings(s, s.post_file.data, s.post_file.size, path_post);
+
+    if (s.post_version >= 5)
+    {
+        s.pos_file.open(path_pos);
+        open_positions(s, s.pos_file.data, s.pos_file.size, path_pos);
+    }
+
+    if (file_exists(path_lens))
+    {
+        s.lens_file.open(path_lens);
+        open_lengths(s, s.lens_file.data, s.lens_file.size, path_lens);
+    }
+
+    std::cerr << "Mapped " << s.doc_count << " docs and " << s.post_file.size << " bytes of postings." << std::endl;
+}
+
+struct DocPositions
+{
+    int doc_id;
+    SimpleVector<int> positions;
+};
+
+// Постинги v3: doc_id, freq и позиции идут вперемешку одним потоком
+SimpleVector<int> get_postings_v3(const TermEntry &e)
+{
+    StageTimer timer(query_stats.decode_ns);
+    SimpleVector<int> res;
+    const uint8_t *ptr = seg->postings_base + e.offset;
+    size_t offset = 0;
+
+    auto p1 = Compression::decode_varbyte(ptr, offset);
+    uint32_t doc_freq = p1.first;
+    offset = p1.second;
+
+    int curr_doc = 0;
+    for (size_t i = 0; i < doc_freq; ++i)
+    {
+        auto p2 = Compression::decode_varbyte(ptr, offset);
+        curr_doc += p2.first;
+        offset = p2.second;
+
+        res.push_back(curr_doc);
+
+        auto p3 = Compression::decode_varbyte(ptr, offset);
+        uint32_t freq = p3.first;
+        offset = p3.second;
+
+        for (size_t j = 0; j < freq; ++j)
+        {
+            auto p4 = Compression::decode_varbyte(ptr, offset);
+            offset = p4.second;
+        }
+    }
+    count_decoded(offset);
+    return res;
+}
+
+SimpleVector<DocPositions> get_full_postings_v3(const TermEntry &e)
+{
+    StageTimer timer(query_stats.decode_ns);
+    SimpleVector<DocPositions> res;
+    const uint8_t *ptr = seg->postings_base + e.offset;
+    size_t offset = 0;
+
+    auto p1 = Compression::decode_varbyte(ptr, offset);
+    uint32_t doc_freq = p1.first;
+    offset = p1.second;
+
+    int curr_doc = 0;
+    for (size_t i = 0; i < doc_freq; ++i)
+    {
+        auto p2 = Compression::decode_varbyte(ptr, offset);
+        curr_doc += p2.first;
+        offset = p2.second;
+
+        DocPositions dp;
+        dp.doc_id = curr_doc;
+
+        auto p3 = Compression::decode_varbyte(ptr, offset);
+        uint32_t freq = p3.first;
+        offset = p3.second;
+
+        int curr_pos = 0;
+        for (size_t j = 0; j < freq; ++j)
+        {
+            auto p4 = Compression::decode_varbyte(ptr, offset);
+            curr_pos += p4.first;
+            offset = p4.second;
+            dp.positions.push_back(curr_pos);
+        }
+        res.push_back(dp);
+    }
+    count_decoded(offset);
+    return res;
+}
+
+SimpleVector<int> get_postings(const std::string &term)
+{
+    SimpleVector<int> res;
+    TermEntry e;
+    if (!find_term(term, e))
+        return res;
+    if (seg->post_version < 5)
+        return get_postings_v3(e);
+
+    PostingList pl = open_posting_list(e);
+    for (uint32_t b = 0; b < pl.block_count; ++b)
+        decode_block(pl, b, res);
+    return res;
+}
+
+SimpleVector<DocPositions> get_full_postings(const std::string &term)
+{
+    SimpleVector<DocPositions> res;
+    TermEntry e;
+    if (!find_term(term, e))
+        return res;
+    if (seg->post_version < 5)
+        return get_full_postings_v3(e);
+
+    PostingList pl = open_posting_list(e);
+    SimpleVector<int> block;
+    for (uint32_t b = 0; b < pl.block_count; ++b)
+    {
+        block.reset();
+        size_t offset = decode_block(pl, b, block);
+        uint32_t freqs[MAX_POST_BLOCK_SIZE];
+        decode_freqs(pl, b, offset, block.size, freqs);
+        const uint8_t *pos = pl.block_positions(b);
+        size_t pos_offset = 0;
+
+        for (size_t k = 0; k < block.size; ++k)
+        {
+            DocPositions dp;
+            dp.doc_id = block.data[k];
+
+            int curr_pos = 0;
+            for (uint32_t j = 0; j < freqs[k]; ++j)
+            {
+                auto pp = Compression::decode_varbyte(pos, pos_offset);
+                curr_pos += pp.first;
+                pos_offset = pp.second;
+                dp.positions.push_back(curr_pos);
+            }
+            res.push_back(std::move(dp));
+        }
+    }
+    return res;
+}
+
+// Пересечение кандидатов со списком терма: блоки, в которые не попадает
+// ни один кандидат, перепрыгиваются по таблице пропусков без распаковки.
+SimpleVector<int> intersect_term(const SimpleVector<int> &candidates, const std::string &term)
+{
+    SimpleVector<int> res;
+    if (candidates.size == 0)
+        return res;
+    TermEntry e;
+    if (!find_term(term, e))
+        return res;
+    if (seg->post_version < 5)
+        return set_intersect(candidates, get_postings(term));
+
+    PostingList pl = open_posting_list(e);
+    SimpleVector<int> block;
+    uint32_t b = 0;
+    uint32_t loaded = pl.block_count;
+    size_t k = 0;
+    for (size_t i = 0; i < candidates.size; ++i)
+    {
+        int target = candidates.data[i];
+        b = skip_to_block(pl, b, target);
+        if (b >= pl.block_count)
+            break;
+        if (b != loaded)
+        {
+            block.reset();
+            decode_block(pl, b, block);
+            loaded = b;
+            k = 0;
+        }
+        while (k < block.size && block.data[k] < target)
+            k++;
+        if (k < block.size && block.data[k] == target)
+            res.push_back(target);
+    }
+    return res;
+}
+
+// Курсоры по возрастающим doc_id. До первого next()/advance() doc() == -1,
+// после исчерпания - END_DOC. advance(target) переходит к первому doc_id
+// >= target и ничего не делает, если текущий уже >= target. cost() - верхняя
+// оценка числа документов, по ней AND выбирает ведущий курсор.
+const int END_DOC = 0x7FFFFFFF;
+
+class DocIterator
+{
+public:
+    virtual ~DocIterator() {}
+    virtual int doc() const = 0;
+    virtual int next() = 0;
+    virtual int advance(int target) = 0;
+    virtual size_t cost() const = 0;
+};
+
+typedef std::unique_ptr<DocIterator> DocIteratorPtr;
+
+class VectorIterator : public DocIterator
+{
+    SimpleVector<int> docs;
+    size_t pos;
+    int cur;
+
+public:
+    explicit VectorIterator(SimpleVector<int> &&d) : docs(std::move(d)), pos(0), cur(-1) {}
+
+    int doc() const override { return cur; }
+
+    int next() override
+    {
+        if (cur != -1)
+            pos++;
+        return cur = pos < docs.size ? docs.data[pos] : END_DOC;
+    }
+
+    int advance(int target) override
+    {
+        if (cur >= target)
+            return cur;
+        while (pos < docs.size && docs.data[pos] < target)
+            pos++;
+        return cur = pos < docs.size ? docs.data[pos] : END_DOC;
+    }
+
+    size_t cost() const override { return docs.size; }
+};
+
+// Курсор с доступом к freq и позициям текущего документа
+class PostingIterator : public DocIterator
+{
+public:
+    virtual uint32_t freq() = 0;
+    virtual void positions(SimpleVector<int> &out) = 0;
+
+    // Верхняя граница freq по всему списку; UNKNOWN_MAX_FREQ, если индекс
+    // её не хранит.
+    virtual uint32_t max_freq() = 0;
+    // Граница freq для документов от target до last включительно (last -
+    // конец блока, содержащего target). Позиция курсора не меняется.
+    virtual uint32_t max_freq_at(int target, int &last) = 0;
+};
+
+typedef std::unique_ptr<PostingIterator> PostingIteratorPtr;
+
+// Курсор по сжатому списку v5/v6: в памяти держится только текущий
+// распакованный блок, advance() перепрыгивает блоки по таблице пропусков.
+// freq блока и позиции документов распаковываются, только когда их
+// запрашивают, поэтому булевы запросы index.positions не читают.
+class TermIterator : public PostingIterator
+{
+    PostingList pl;
+    uint32_t block;
+    SimpleVector<int> docs;
+    size_t pos;
+    int cur;
+
+    size_t freq_offset;
+    bool freqs_loaded;
+    uint32_t freqs[MAX_POST_BLOCK_SIZE];
+    size_t pos_doc;
+    size_t pos_offset;
+
+    bool load(uint32_t b)
+    {
+        if (b >= pl.block_count)
+        {
+            cur = END_DOC;
+            return false;
+        }
+        block = b;
+        docs.reset();
+        freq_offset = decode_block(pl, b, docs);
+        freqs_loaded = false;
+        pos = 0;
+        return true;
+    }
+
+    void load_freqs()
+    {
+        if (freqs_loaded)
+            return;
+        decode_freqs(pl, block, freq_offset, docs.size, freqs);
+        freqs_loaded = true;
+        pos_doc = 0;
+        pos_offset = 0;
+    }
+
+public:
+    explicit TermIterator(const TermEntry &e)
+        : pl(open_posting_list(e)), block(0), pos(0), cur(-1), freq_offset(0), freqs_loaded(false), pos_doc(0), pos_offset(0) {}
+
+    int doc() const override { return cur; }
+
+    int next() override
+    {
+        if (cur == END_DOC)
+            return cur;
+        if (cur == -1)
+        {
+            if (!load(0))
+                return cur;
+        }
+        else if (++pos >= docs.size && !load(block + 1))
+            return cur;
+        return cur = docs.data[pos];
+    }
+
+    int advance(int target) override
+    {
+        if (cur >= target)
+            return cur;
+        uint32_t b = skip_to_block(pl, cur == -1 ? 0 : block, target);
+        if (cur == -1 || b != block)
+        {
+            if (!load(b))
+                return cur;
+        }
+        while (docs.data[pos] < target)
+            pos++;
+        return cur = docs.data[pos];
+    }
+
+    size_t cost() const override { return pl.doc_freq; }
+
+    uint32_t freq() override
+    {
+        load_freqs();
+        return freqs[pos];
+    }
+
+    uint32_t max_freq() override
+    {
+        if (pl.version < 7)
+            return UNKNOWN_MAX_FREQ;
+        uint32_t res = 0;
+        for (uint32_t b = 0; b < pl.block_count; ++b)
+            res = std::max(res, pl.block_max_freq(b));
+        return res;
+    }
+
+    uint32_t max_freq_at(int target, int &last) override
+    {
+        uint32_t b = skip_to_block(pl, cur == -1 ? 0 : block, target);
+        if (b >= pl.block_count)
+        {
+            last = END_DOC - 1;
+            return 0;
+        }
+        last = pl.block_last(b);
+        return pl.block_max_freq(b);
+    }
+
+    void positions(SimpleVector<int> &out) override
+    {
+        load_freqs();
+        const uint8_t *ptr = pl.block_positions(block);
+        while (pos_doc < pos)
+        {
+            pos_offset += Compression::skip_varbyte(ptr + pos_offset, freqs[pos_doc]);
+            pos_doc++;
+        }
+
+        out.reset();
+        size_t offset = pos_offset;
+        int curr_pos = 0;
+        for (uint32_t j = 0; j < freqs[pos]; ++j)
+        {
+            auto p = Compression::decode_varbyte(ptr, offset);
+            curr_pos += p.first;
+            offset = p.second;
+            out.push_back(curr_pos);
+        }
+    }
+};
+
+// Позиционный курсор для индексов v3, где позиции не отделены от doc_id:
+// список распаковывается целиком.
+class FullPostingsIterator : public PostingIterator
+{
+    SimpleVector<DocPositions> list;
+    size_t pos;
+    int cur;
+    uint32_t max_tf;
+
+public:
+    explicit FullPostingsIterator(SimpleVector<DocPositions> &&l) : list(std::move(l)), pos(0), cur(-1), max_tf(0)
+    {
+        for (size_t i = 0; i < list.size; ++i)
+            max_tf = std::max<uint32_t>(max_tf, list.data[i].positions.size);
+    }
+
+    int doc() const override { return cur; }
+
+    int next() override
+    {
+        if (cur != -1)
+            pos++;
+        return cur = pos < list.size ? list.data[pos].doc_id : END_DOC;
+    }
+
+    int advance(int target) override
+    {
+        if (cur >= target)
+            return cur;
+        while (pos < list.size && list.data[pos].doc_id < target)
+            pos++;
+        return cur = pos < list.size ? list.data[pos].doc_id : END_DOC;
+    }
+
+    size_t cost() const override { return list.size; }
+
+    uint32_t freq() override { return list.data[pos].positions.size; }
+
+    void positions(SimpleVector<int> &out) override { out = list.data[pos].positions; }
+
+    uint32_t max_freq() override { return max_tf; }
+
+    // Блоков нет: граница одна на весь список
+    uint32_t max_freq_at(int, int &last) override
+    {
+        last = END_DOC - 1;
+        return max_tf;
+    }
+};
+
+// Кеши запросов. Каждая загрузка индекса получает новое поколение
+// (IndexSnapshot::generation); записи кешей помечены поколением, на
+// котором вычислены, и кеш, увидевший более новое поколение, очищается
+// целиком. Результаты, досчитанные по старому индексу, в кеш уже не
+// попадают.
+
+template <typename V>
+struct SharedCache
+{
+    std::mutex lock;
+    LruCache<V> cache;
+    uint64_t generation = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+
+    explicit SharedCache(size_t limit) : cache(limit) {}
+
+    // Под lock: false, если gen устарело и кешем пользоваться нельзя
+    bool sync(uint64_t gen)
+    {
+        if (gen < generation)
+            return false;
+        if (gen > generation)
+        {
+            cache.clear();
+            generation = gen;
+        }
+        return cache.limit_bytes() > 0;
+    }
+
+    CacheStats stats()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        CacheStats s;
+        cache.fill_stats(s);
+        s.hits = hits;
+        s.misses = misses;
+        return s;
+    }
+};
+
+// Кеш распакованных списков частых термов: doc_id и freq целиком, позиции
+// по-прежнему читаются из индекса. Первое обращение к терму только
+// запоминает его, список распаковывается со второго, так что разовые
+// запросы не вытесняют горячие термы. Короткие списки не кешируются:
+// распаковать их дешевле, чем держать в памяти.
+const uint32_t POSTINGS_CACHE_MIN_DOCS = 1024;
+
+struct DecodedPostings
+{
+    PostingList pl;
+    SimpleVector<int> docs;
+    SimpleVector<uint32_t> freqs;
+};
+
+typedef std::shared_ptr<const DecodedPostings> DecodedPostingsPtr;
+
+SharedCache<DecodedPostingsPtr> postings_cache(DEFAULT_POSTINGS_CACHE_BYTES);
+
+DecodedPostingsPtr decode_postings(const TermEntry &e)
+{
+    std::shared_ptr<DecodedPostings> d(new DecodedPostings);
+    d->pl = open_posting_list(e);
+    uint32_t freqs[MAX_POST_BLOCK_SIZE];
+    for (uint32_t b = 0; b < d->pl.block_count; ++b)
+    {
+        size_t first = d->docs.size;
+        size_t offset = decode_block(d->pl, b, d->docs);
+        uint32_t n = d->docs.size - first;
+        decode_freqs(d->pl, b, offset, n, freqs);
+        for (uint32_t i = 0; i < n; ++i)
+            d->freqs.push_back(freqs[i]);
+    }
+    return d;
+}
+
+// Распакованный список терма из кеша или nullptr, если терм пока не горячий
+DecodedPostingsPtr cached_postings(const TermEntry &e)
+{
+    // Ключ - сегмент и смещение списка в его index.postings
+    char key_buf[sizeof(uint32_t) + sizeof(uint64_t)];
+    uint32_t ordinal = seg->ordinal;
+    std::memcpy(key_buf, &ordinal, sizeof(ordinal));
+    std::memcpy(key_buf + sizeof(ordinal), &e.offset, sizeof(e.offset));
+    std::string_view key(key_buf, sizeof(key_buf));
+    uint64_t gen = ix->generation;
+    {
+        std::lock_guard<std::mutex> guard(postings_cache.lock);
+        if (!postings_cache.sync(gen))
+            return nullptr;
+        DecodedPostingsPtr *found = postings_cache.cache.get(key);
+        if (found && *found)
+        {
+            postings_cache.hits++;
+            return *found;
+        }
+        postings_cache.misses++;
+        if (!found)
+        {
+            postings_cache.cache.put(key, DecodedPostingsPtr(), 0);
+            return nullptr;
+        }
+    }
+
+    // Распаковка идёт без блокировки; два потока могут распаковать один
+    // список одновременно, в кеше останется последний.
+    DecodedPostingsPtr d = decode_postings(e);
+    size_t bytes = sizeof(DecodedPostings) + d->docs.size * (sizeof(int) + sizeof(uint32_t));
+    std::lock_guard<std::mutex> guard(postings_cache.lock);
+    if (postings_cache.sync(gen))
+        postings_cache.cache.put(key, DecodedPostingsPtr(d), bytes);
+    return d;
+}
+
+// Курсор по распакованному списку из кеша. Границы freq и позиции берутся
+// из блоков индекса, как в TermIterator, поэтому результаты совпадают.
+class CachedTermIterator : public PostingIterator
+{
+    DecodedPostingsPtr list;
+    size_t pos;
+    int cur;
+    size_t pos_doc;
+    size_t pos_offset;
+
+    uint32_t block() const { return pos / list->pl.block_size; }
+
+public:
+    explicit CachedTermIterator(DecodedPostingsPtr l) : list(std::move(l)), pos(0), cur(-1), pos_doc(0), pos_offset(0) {}
+
+    int doc() const override { return cur; }
+
+    int next() override
+    {
+        if (cur != -1)
+            pos++;
+        return cur = pos < list->docs.size ? list->docs.data[pos] : END_DOC;
+    }
+
+    int advance(int target) override
+    {
+        if (cur >= target)
+            return cur;
+        uint32_t b = skip_to_block(list->pl, block(), target);
+        if (b >= list->pl.block_count)
+        {
+            pos = list->docs.size;
+            return cur = END_DOC;
+        }
+        pos = std::max<size_t>(pos, (size_t)b * list->pl.block_size);
+        while (list->docs.data[pos] < target)
+            pos++;
+        return cur = list->docs.data[pos];
+    }
+
+    size_t cost() const override { return list->docs.size; }
+
+    uint32_t freq() override { return list->freqs.data[pos]; }
+
+    uint32_t max_freq() override
+    {
+        if (list->pl.version < 7)
+            return UNKNOWN_MAX_FREQ;
+        uint32_t res = 0;
+        for (uint32_t b = 0; b < list->pl.block_count; ++b)
+            res = std::max(res, list->pl.block_max_freq(b));
+        return res;
+    }
+
+    uint32_t max_freq_at(int target, int &last) override
+    {
+        uint32_t b = skip_to_block(list->pl, block(), target);
+        if (b >= list->pl.block_count)
+        {
+            last = END_DOC - 1;
+            return 0;
+        }
+        last = list->pl.block_last(b);
+        return list->pl.block_max_freq(b);
+    }
+
+    void positions(SimpleVector<int> &out) override
+    {
+        // Позиции блока идут подряд; смещение до документа накапливается
+        // от начала блока
+        size_t first = (size_t)block() * list->pl.block_size;
+        if (pos_doc < first)
+        {
+            pos_doc = first;
+            pos_offset = 0;
+        }
+        const uint8_t *ptr = list->pl.block_positions(block());
+        while (pos_doc < pos)
+        {
+            pos_offset += Compression::skip_varbyte(ptr + pos_offset, list->freqs.data[pos_doc]);
+            pos_doc++;
+        }
+
+        out.reset();
+        size_t offset = pos_offset;
+        int curr_pos = 0;
+        for (uint32_t j = 0; j < list->freqs.data[pos]; ++j)
+        {
+            auto p = Compression::decode_varbyte(ptr, offset);
+            curr_pos += p.first;
+            offset = p.second;
+            out.push_back(curr_pos);
+        }
+    }
+};
+
+PostingIteratorPtr make_posting_iterator(const TermEntry &e)
+{
+    if (seg->post_version < 5)
+        return PostingIteratorPtr(new FullPostingsIterator(get_full_postings_v3(e)));
+    if (e.doc_count >= POSTINGS_CACHE_MIN_DOCS)
+    {
+        if (DecodedPostingsPtr d = cached_postings(e))
+            return PostingIteratorPtr(new CachedTermIterator(std::move(d)));
+    }
+    return PostingIteratorPtr(new TermIterator(e));
+}
+
+// Пересечение методом leapfrog: ведущий (первый) курсор предлагает
+// кандидата, остальные догоняют его через advance().
+class AndIterator : public DocIterator
+{
+    SimpleVector<DocIteratorPtr> children;
+    int cur;
+
+    int align(int target)
+    {
+        while (target != END_DOC)
+        {
+            size_t i = 1;
+            for (; i < children.size; ++i)
+            {
+                int d = children.data[i]->advance(target);
+                if (d != target)
+                {
+                    target = children.data[0]->advance(d);
+                    break;
+                }
+            }
+            if (i == children.size)
+                return cur = target;
+        }
+        return cur = END_DOC;
+    }
+
+public:
+    // Дети уже упорядочены планировщиком: первый - самый дешёвый
+    explicit AndIterator(SimpleVector<DocIteratorPtr> &&c) : children(std::move(c)), cur(-1) {}
+
+    int doc() const override { return cur; }
+
+    int next() override
+    {
+        if (cur == END_DOC)
+            return cur;
+        return align(children.data[0]->next());
+    }
+
+    int advance(int target) override
+    {
+        if (cur >= target)
+            return cur;
+        return align(children.data[0]->advance(target));
+    }
+
+    size_t cost() const override { return children.data[0]->cost(); }
+};
+
+class OrIterator : public DocIterator
+{
+    SimpleVector<DocIteratorPtr> children;
+    int cur;
+
+public:
+    explicit OrIterator(SimpleVector<DocIteratorPtr> &&c) : children(std::move(c)), cur(-1) {}
+
+    int doc() const override { return cur; }
+
+    int next() override
+    {
+        if (cur == END_DOC)
+            return cur;
+        return advance(cur + 1);
+    }
+
+    int advance(int target) override
+    {
+        if (cur >= target)
+            return cur;
+        int m = END_DOC;
+        for (size_t i = 0; i < children.size; ++i)
+            m = std::min(m, children.data[i]->advance(target));
+        return cur = m;
+    }
+
+    size_t cost() const override
+    {
+        size_t c = 0;
+        for (size_t i = 0; i < children.size; ++i)
+            c += children.data[i]->cost();
+        return c;
+    }
+};
+
+// Все документы [0, total), которых нет во вложенном курсоре
+class ComplementIterator : public DocIterator
+{
+    DocIteratorPtr child;
+    int total;
+    int cur;
+
+public:
+    ComplementIterator(DocIteratorPtr &&c, int n) : child(std::move(c)), total(n), cur(-1) {}
+
+    int doc() const override { return cur; }
+
+    int next() override
+    {
+        if (cur == END_DOC)
+            return cur;
+        return advance(cur + 1);
+    }
+
+    int advance(int target) override
+    {
+        if (cur >= target)
+            return cur;
+        for (int t = target; t < total; ++t)
+        {
+            if (child->advance(t) != t)
+                return cur = t;
+        }
+        return cur = END_DOC;
+    }
+
+    size_t cost() const override { return total; }
+};
+
+// Разность include \ exclude: кандидаты берутся только из include, поэтому
+// стоимость a && !b зависит от размера a, а не от числа документов.
+class AndNotIterator : public DocIterator
+{
+    DocIteratorPtr include;
+    DocIteratorPtr exclude;
+    int cur;
+
+    int skip_excluded(int d)
+    {
+        while (d != END_DOC && exclude->advance(d) == d)
+            d = include->next();
+        return cur = d;
+    }
+
+public:
+    AndNotIterator(DocIteratorPtr &&inc, DocIteratorPtr &&exc) : include(std::move(inc)), exclude(std::move(exc)), cur(-1) {}
+
+    int doc() const override { return cur; }
+
+    int next() override
+    {
+        if (cur == END_DOC)
+            return cur;
+        return skip_excluded(include->next());
+    }
+
+    int advance(int target) override
+    {
+        if (cur >= target)
+            return cur;
+        return skip_excluded(include->advance(target));
+    }
+
+    size_t cost() const override { return include->cost(); }
+};
+
+DocIteratorPtr make_term_iterator(const TermEntry &e)
+{
+    if (seg->post_version < 5)
+        return DocIteratorPtr(new VectorIterator(get_postings_v3(e)));
+    return make_posting_iterator(e);
+}
+
+// Фраза и близость: термы пересекаются на уровне doc_id методом leapfrog
+// (ведёт самый редкий), позиции распаковываются только для документов,
+// где встретились все термы. В документе ищется возрастающая цепочка
+// позиций p0 < p1 < ... в порядке фразы с p_last - p0 <= max_dist, при
+// exact - подряд идущих. Для каждого p0 жадно берётся самая ранняя
+// допустимая позиция следующего терма: это минимизирует конец окна, а
+// указатели по спискам только растут, так что проверка линейна.
+class PhraseIterator : public DocIterator
+{
+    SimpleVector<PostingIteratorPtr> terms;
+    SimpleVector<SimpleVector<int>> lists;
+    SimpleVector<size_t> cursors;
+    size_t lead;
+    int max_dist;
+    bool exact;
+    int cur;
+
+    bool match()
+    {
+        for (size_t t = 0; t < terms.size; ++t)
+        {
+            terms.data[t]->positions(lists.data[t]);
+            cursors.data[t] = 0;
+        }
+
+        const SimpleVector<int> &first = lists.data[0];
+        for (size_t s = 0; s < first.size; ++s)
+        {
+            int start = first.data[s];
+            int prev = start;
+            bool ok = true;
+            for (size_t t = 1; t < terms.size && ok; ++t)
+            {
+                const SimpleVector<int> &l = lists.data[t];
+                size_t &c = cursors.data[t];
+                while (c < l.size && l.data[c] <= prev)
+                    c++;
+                if (c == l.size)
+                    return false;
+                if (exact && l.data[c] != prev + 1)
+                    ok = false;
+                prev = l.data[c];
+                if (prev - start > max_dist)
+                    ok = false;
+            }
+            if (ok)
+                return true;
+        }
+        return false;
+    }
+
+    int align(int target)
+    {
+        while (target != END_DOC)
+        {
+            size_t i = 0;
+            for (; i < terms.size; ++i)
+            {
+                if (i == lead)
+                    continue;
+                int d = terms.data[i]->advance(target);
+                if (d != target)
+                {
+                    target = terms.data[lead]->advance(d);
+                    break;
+                }
+            }
+            if (i < terms.size)
+                continue;
+            if (match())
+                return cur = target;
+            target = terms.data[lead]->next();
+        }
+        return cur = END_DOC;
+    }
+
+public:
+    PhraseIterator(SimpleVector<PostingIteratorPtr> &&t, int dist, bool is_exact)
+        : terms(std::move(t)), lead(0), max_dist(dist), exact(is_exact), cur(-1)
+    {
+        for (size_t i = 0; i < terms.size; ++i)
+        {
+            lists.push_back(SimpleVector<int>());
+            cursors.push_back(0);
+            if (terms.data[i]->cost() < terms.data[lead]->cost())
+                lead = i;
+        }
+    }
+
+    int doc() const override { return cur; }
+
+    int next() override
+    {
+        if (cur == END_DOC)
+            return cur;
+        return align(terms.data[lead]->next());
+    }
+
+    int advance(int target) override
+    {
+        if (cur >= target)
+            return cur;
+        return align(terms.data[lead]->advance(target));
+    }
+
+    size_t cost() const override { return terms.data[lead]->cost(); }
+};
+
+SimpleVector<int> sequence_search(SimpleVector<std::string> &terms, int max_dist)
+{
+    SimpleVector<int> result;
+    if (terms.size == 0)
+        return result;
+
+    SimpleVector<PostingIteratorPtr> its;
+    for (size_t i = 0; i < terms.size; ++i)
+    {
+        TermEntry e;
+        if (!find_term(terms[i], e) || e.doc_count == 0)
+            return result;
+        its.push_back(make_posting_iterator(e));
+    }
+
+    bool exact = (max_dist == (int)terms.size);
+    PhraseIterator it(std::move(its), max_dist, exact);
+    for (int d = it.next(); d != END_DOC; d = it.next())
+        result.push_back(d);
+    return result;
+}
+
+// Токены для парсера
+enum TokenType
+{
+    TOK_TERM,
+    TOK_PHRASE,
+    TOK_AND,
+    TOK_OR,
+    TOK_NOT,
+    TOK_LPAREN,
+    TOK_RPAREN,
+    TOK_END
+};
+
+struct Token
+{
+    TokenType type;
+    std::string value;
+    int dist = 0;
+};
+
+// Длина кавычки в позиции i: ASCII " или «» в UTF-8; 0, если кавычки нет
+size_t quote_len(const std::string &q, size_t i)
+{
+    if (q[i] == '"')
+        return 1;
+    if (q.compare(i, 2, "\xC2\xAB") == 0 || q.compare(i, 2, "\xC2\xBB") == 0)
+        return 2;
+    return 0;
+}
+
+// Суффикс "/N" после фразы или терма задаёт расстояние для поиска по
+// близости. Возвращает N (0, если суффикса нет) и сдвигает i за него.
+int parse_distance(const std::string &q, size_t &i)
+{
+    size_t j = i;
+    while (j < q.size() && q[j] == ' ')
+        j++;
+    if (j >= q.size() || q[j] != '/')
+        return 0;
+    j++;
+    while (j < q.size() && q[j] == ' ')
+        j++;
+    if (j >= q.size() || !std::isdigit((unsigned char)q[j]))
+        return 0;
+
+    int dist = 0;
+    while (j < q.size() && std::isdigit((unsigned char)q[j]))
+    {
+        dist = std::min(dist * 10 + (q[j] - '0'), 1000000);
+        j++;
+    }
+    i = j;
+    return dist;
+}
+
+SimpleVector<Token> tokenize_query(const std::string &query)
+{
+    SimpleVector<Token> tokens;
+    size_t i = 0;
+    while (i < query.size())
+    {
+        while (i < query.size() && query[i] == ' ')
+            i++;
+        if (i >= query.size())
+            break;
+
+        if (query[i] == '(')
+        {
+            tokens.push_back({TOK_LPAREN, "("});
+            i++;
+        }
+        else if (query[i] == ')')
+        {
+            tokens.push_back({TOK_RPAREN, ")"});
+            i++;
+        }
+        else if (query[i] == '!' && (i + 1 >= query.size() || query[i + 1] != '='))
+        {
+            tokens.push_back({TOK_NOT, "!"});
+            i++;
+        }
+        else if (i + 1 < query.size() && query[i] == '&' && query[i + 1] == '&')
+        {
+            tokens.push_back({TOK_AND, "&&"});
+            i += 2;
+        }
+        else if (i + 1 < query.size() && query[i] == '|' && query[i + 1] == '|')
+        {
+            tokens.push_back({TOK_OR, "||"});
+            i += 2;
+        }
+        else if (size_t q = quote_len(query, i))
+        {
+            size_t start = i + q;
+            size_t end = start;
+            while (end < query.size() && quote_len(query, end) == 0)
+                end++;
+            std::string text = query.substr(start, end - start);
+            i = end < query.size() ? end + quote_len(query, end) : end;
+            tokens.push_back({TOK_PHRASE, text, parse_distance(query, i)});
+        }
+        else if (std::isalnum((unsigned char)query[i]))
+        {
+            std::string term;
+            while (i < query.size() && std::isalnum((unsigned char)query[i]))
+            {
+                term += std::tolower((unsigned char)query[i]);
+                i++;
+            }
+            term = TokenizerLib::stem(term);
+            // Близость для одного терма ничего не меняет: "/N" просто отбрасывается
+            parse_distance(query, i);
+            tokens.push_back({TOK_TERM, term});
+        }
+        else
+        {
+            i++;
+        }
+    }
+    tokens.push_back({TOK_END, ""});
+    return tokens;
+}
+
+// Дерево запроса. Парсер строит его как есть, планировщик упрощает и
+// упорядочивает, и только затем по нему строятся курсоры.
+enum NodeType
+{
+    NODE_EMPTY,
+    NODE_TERM,
+    NODE_PHRASE,
+    NODE_AND,
+    NODE_OR,
+    NODE_NOT
+};
+
+struct QueryNode;
+typedef std::unique_ptr<QueryNode> QueryNodePtr;
+
+struct QueryNode
+{
+    NodeType type;
+    std::string term;
+    TermEntry entry;
+    SimpleVector<QueryNodePtr> children;
+    size_t cost;
+
+    // NODE_PHRASE: термы по порядку и допустимое расстояние
+    SimpleVector<std::string> phrase;
+    SimpleVector<TermEntry> entries;
+    int max_dist;
+
+    explicit QueryNode(NodeType t) : type(t), entry{0, 0}, cost(0), max_dist(0) {}
+};
+
+QueryNodePtr make_node(NodeType type)
+{
+    return QueryNodePtr(new QueryNode(type));
+}
+
+// Рекурсивный спуск парсер
+class BoolParser
+{
+    SimpleVector<Token> tokens;
+    size_t pos;
+
+    Token &current() { return tokens[pos]; }
+    void advance()
+    {
+        if (pos < tokens.size - 1)
+            pos++;
+    }
+
+    // factor = NOT factor | TERM | PHRASE | LPAREN expr RPAREN
+    QueryNodePtr parse_factor()
+    {
+        if (current().type == TOK_NOT)
+        {
+            advance();
+            QueryNodePtr node = make_node(NODE_NOT);
+            node->children.push_back(parse_factor());
+            return node;
+        }
+        if (current().type == TOK_LPAREN)
+        {
+            advance();
+            QueryNodePtr res = parse_or();
+            if (current().type == TOK_RPAREN)
+                advance();
+            return res;
+        }
+        if (current().type == TOK_TERM)
+        {
+            QueryNodePtr node = make_node(NODE_TERM);
+            node->term = current().value;
+            advance();
+            return node;
+        }
+        if (current().type == TOK_PHRASE)
+        {
+            // "a b" - точная фраза, "a b"/N - термы по порядку в окне N
+            QueryNodePtr node = make_node(NODE_PHRASE);
+            TokenizerLib::tokenize(current().value, node->phrase);
+            node->max_dist = current().dist > 0 ? current().dist : (int)node->phrase.size;
+            advance();
+            return node;
+        }
+        return make_node(NODE_EMPTY);
+    }
+
+    // term = factor ((AND | implicit) factor)*
+    QueryNodePtr parse_and()
+    {
+        QueryNodePtr node = make_node(NODE_AND);
+        node->children.push_back(parse_factor());
+        while (current().type == TOK_AND || current().type == TOK_TERM || current().type == TOK_PHRASE ||
+               current().type == TOK_NOT || current().type == TOK_LPAREN)
+        {
+            if (current().type == TOK_AND)
+                advance();
+            node->children.push_back(parse_factor());
+        }
+        return node;
+    }
+
+    // expr = term (OR term)*
+    QueryNodePtr parse_or()
+    {
+        QueryNodePtr node = make_node(NODE_OR);
+        node->children.push_back(parse_and());
+        while (current().type == TOK_OR)
+        {
+            advance();
+            node->children.push_back(parse_and());
+        }
+        return node;
+    }
+
+public:
+    QueryNodePtr parse(const std::string &query)
+    {
+        return parse(tokenize_query(query));
+    }
+
+    QueryNodePtr parse(SimpleVector<Token> &&query_tokens)
+    {
+        tokens = std::move(query_tokens);
+        pos = 0;
+        if (tokens.size <= 1)
+            return make_node(NODE_EMPTY);
+        return parse_or();
+    }
+};
+
+// Планировщик: снимает двойные отрицания, раскрывает вложенные AND/OR,
+// оценивает стоимость узлов по doc_count из словаря и ставит самые
+// короткие списки конъюнкции первыми. Конъюнкция с отсутствующим
+// обязательным термом сразу становится пустой, и её списки не читаются.
+QueryNodePtr plan(QueryNodePtr node)
+{
+    switch (node->type)
+    {
+    case NODE_EMPTY:
+        return node;
+
+    case NODE_TERM:
+        if (!find_term(node->term, node->entry) || node->entry.doc_count == 0)
+            return make_node(NODE_EMPTY);
+        node->cost = node->entry.doc_count;
+        return node;
+
+    case NODE_PHRASE:
+    {
+        if (node->phrase.size == 0)
+            return make_node(NODE_EMPTY);
+        node->cost = seg->doc_count;
+        for (size_t i = 0; i < node->phrase.size; ++i)
+        {
+            TermEntry e;
+            if (!find_term(node->phrase[i], e) || e.doc_count == 0)
+                return make_node(NODE_EMPTY);
+            node->entries.push_back(e);
+            node->cost = std::min<size_t>(node->cost, e.doc_count);
+        }
+        if (node->phrase.size == 1)
+        {
+            node->type = NODE_TERM;
+            node->term = node->phrase[0];
+            node->entry = node->entries[0];
+        }
+        return node;
+    }
+
+    case NODE_NOT:
+    {
+        QueryNodePtr child = plan(std::move(node->children.data[0]));
+        if (child->type == NODE_NOT)
+            return std::move(child->children.data[0]);
+        node->cost = seg->doc_count - std::min(seg->doc_count, child->cost);
+        node->children.data[0] = std::move(child);
+        return node;
+    }
+
+    case NODE_AND:
+    {
+        SimpleVector<QueryNodePtr> flat;
+        for (size_t i = 0; i < node->children.size; ++i)
+        {
+            QueryNodePtr child = plan(std::move(node->children.data[i]));
+            if (child->type == NODE_EMPTY)
+                return child;
+            if (child->type == NODE_NOT && child->children.data[0]->type == NODE_EMPTY)
+                continue;
+            if (child->type == NODE_AND)
+            {
+                for (size_t j = 0; j < child->children.size; ++j)
+                    flat.push_back(std::move(child->children.data[j]));
+            }
+            else
+                flat.push_back(std::move(child));
+        }
+        if (flat.size == 0)
+        {
+            // Остались только отрицания пустых множеств - это все документы
+            QueryNodePtr all = make_node(NODE_NOT);
+            all->children.push_back(make_node(NODE_EMPTY));
+            all->cost = seg->doc_count;
+            return all;
+        }
+        if (flat.size == 1)
+            return std::move(flat.data[0]);
+
+        std::stable_sort(flat.begin(), flat.end(), [](const QueryNodePtr &a, const QueryNodePtr &b)
+                         { return a->cost < b->cost; });
+        node->children = std::move(flat);
+        node->cost = node->children.data[0]->cost;
+        return node;
+    }
+
+    case NODE_OR:
+    {
+        SimpleVector<QueryNodePtr> flat;
+        for (size_t i = 0; i < node->children.size; ++i)
+        {
+            QueryNodePtr child = plan(std::move(node->children.data[i]));
+            if (child->type == NODE_EMPTY)
+                continue;
+            if (child->type == NODE_OR)
+            {
+                for (size_t j = 0; j < child->children.size; ++j)
+                    flat.push_back(std::move(child->children.data[j]));
+            }
+            else
+                flat.push_back(std::move(child));
+        }
+        if (flat.size == 0)
+            return make_node(NODE_EMPTY);
+        if (flat.size == 1)
+            return std::move(flat.data[0]);
+
+        node->cost = 0;
+        for (size_t i = 0; i < flat.size; ++i)
+            node->cost += flat.data[i]->cost;
+        node->cost = std::min(node->cost, seg->doc_count);
+        node->children = std::move(flat);
+        return node;
+    }
+    }
+    return node;
+}
+
+DocIteratorPtr build_iterator(const QueryNode &node)
+{
+    switch (node.type)
+    {
+    case NODE_TERM:
+        return make_term_iterator(node.entry);
+
+    case NODE_PHRASE:
+    {
+        SimpleVector<PostingIteratorPtr> its;
+        for (size_t i = 0; i < node.entries.size; ++i)
+            its.push_back(make_posting_iterator(node.entries[i]));
+        bool exact = (node.max_dist == (int)node.phrase.size);
+        return DocIteratorPtr(new PhraseIterator(std::move(its), node.max_dist, exact));
+    }
+
+    case NODE_NOT:
+        return DocIteratorPtr(new ComplementIterator(build_iterator(*node.children.data[0]), seg->doc_count));
+
+    case NODE_OR:
+    {
+        SimpleVector<DocIteratorPtr> its;
+        for (size_t i = 0; i < node.children.size; ++i)
+            its.push_back(build_iterator(*node.children.data[i]));
+        return DocIteratorPtr(new OrIterator(std::move(its)));
+    }
+
+    case NODE_AND:
+    {
+        // Отрицания не строят дополнение: a && !b && !c выполняется как
+        // a \ (b || c), кандидаты берутся только из положительных множителей.
+        SimpleVector<DocIteratorPtr> include;
+        SimpleVector<DocIteratorPtr> exclude;
+        for (size_t i = 0; i < node.children.size; ++i)
+        {
+            const QueryNode &child = *node.children.data[i];
+            if (child.type == NODE_NOT)
+                exclude.push_back(build_iterator(*child.children.data[0]));
+            else
+                include.push_back(build_iterator(child));
+        }
+
+        DocIteratorPtr excluded;
+        if (exclude.size == 1)
+            excluded = std::move(exclude.data[0]);
+        else if (exclude.size > 1)
+            excluded = DocIteratorPtr(new OrIterator(std::move(exclude)));
+
+        if (include.size == 0)
+            return DocIteratorPtr(new ComplementIterator(std::move(excluded), seg->doc_count));
+
+        DocIteratorPtr included;
+        if (include.size == 1)
+            included = std::move(include.data[0]);
+        else
+            included = DocIteratorPtr(new AndIterator(std::move(include)));
+
+        if (!excluded)
+            return included;
+        return DocIteratorPtr(new AndNotIterator(std::move(included), std::move(excluded)));
+    }
+
+    default:
+        return DocIteratorPtr(new VectorIterator(SimpleVector<int>()));
+    }
+}
+
+// Плотные запросы. Если оценка узла не меньше doc_count / DENSE_DOCS_RATIO
+// (при 32 битовая карта сегмента не больше массива int его документов),
+// весь запрос вычисляется в DocBitset: плотные операнды пересекаются,
+// объединяются и вычитаются словами, редкие проставляют или снимают свои
+// биты курсором, отрицание - инверсия слов вместо обхода всех документов
+// через ComplementIterator. Так считаются только запросы, которые всё
+// равно обходят все документы (count_all и ранжирование); в курсорах
+// плотные подузлы остаются курсорами, потому что под редким ведущим AND
+// распаковывает лишь малую часть их блоков.
+const size_t DENSE_DOCS_RATIO = 32;
+
+bool is_dense(const QueryNode &node)
+{
+    return node.cost * DENSE_DOCS_RATIO >= seg->doc_count;
+}
+
+bool is_dense_query(const QueryNode &node)
+{
+    return node.type != NODE_PHRASE && node.type != NODE_EMPTY && is_dense(node);
+}
+
+// Добавляет документы терма в bits; блоки-карты v8 переносятся байтами
+void add_postings(const TermEntry &e, DocBitset &bits)
+{
+    if (seg->post_version < 5)
+    {
+        SimpleVector<int> docs = get_postings_v3(e);
+        for (size_t i = 0; i < docs.size; ++i)
+            bits.set(docs.data[i]);
+        return;
+    }
+    PostingList pl = open_posting_list(e);
+    SimpleVector<int> docs;
+    for (uint32_t b = 0; b < pl.block_count; ++b)
+    {
+        if (pl.block_last(b) >= bits.size())
+            throw std::runtime_error("Bad postings block");
+        const uint8_t *p = pl.block_start(b);
+        if (pl.version >= 8 && *p == Compression::DOC_BLOCK_BITMAP)
+        {
+            StageTimer timer(query_stats.decode_ns);
+            uint32_t base = pl.block_base(b);
+            size_t bytes = (pl.block_last(b) - base) / 8 + 1;
+            bits.or_bytes(base, p + 1, bytes);
+            count_decoded(1 + bytes);
+            continue;
+        }
+        docs.reset();
+        decode_block(pl, b, docs);
+        for (size_t i = 0; i < docs.size; ++i)
+            bits.set(docs.data[i]);
+    }
+}
+
+void build_bitset(const QueryNode &node, DocBitset &bits);
+
+// bits |= документы узла
+void add_docs(const QueryNode &node, DocBitset &bits)
+{
+    if (node.type == NODE_TERM)
+        return add_postings(node.entry, bits);
+    if (node.type == NODE_OR)
+    {
+        for (size_t i = 0; i < node.children.size; ++i)
+            add_docs(*node.children.data[i], bits);
+        return;
+    }
+    if (is_dense_query(node))
+    {
+        DocBitset part;
+        build_bitset(node, part);
+        return bits.or_with(part);
+    }
+    DocIteratorPtr it = build_iterator(node);
+    for (int d = it->next(); d != END_DOC; d = it->next())
+        bits.set(d);
+}
+
+// bits &= ~документы узла
+void remove_docs(const QueryNode &node, DocBitset &bits)
+{
+    if (is_dense_query(node))
+    {
+        DocBitset part;
+        build_bitset(node, part);
+        return bits.and_not_with(part);
+    }
+    DocIteratorPtr it = build_iterator(node);
+    for (int d = it->next(); d != END_DOC; d = it->next())
+        bits.reset(d);
+}
+
+// bits = документы узла
+void build_bitset(const QueryNode &node, DocBitset &bits)
+{
+    switch (node.type)
+    {
+    case NODE_NOT:
+    {
+        const QueryNode &child = *node.children.data[0];
+        if (is_dense_query(child))
+        {
+            build_bitset(child, bits);
+            bits.flip();
+        }
+        else
+        {
+            bits.assign(seg->doc_count, true);
+            remove_docs(child, bits);
+        }
+        return;
+    }
+
+    case NODE_AND:
+    {
+        // Первый положительный множитель задаёт начальное множество, без
+        // них начинаем со всех документов
+        bool started = false;
+        DocBitset part;
+        for (size_t i = 0; i < node.children.size; ++i)
+        {
+            const QueryNode &child = *node.children.data[i];
+            if (child.type == NODE_NOT)
+                continue;
+            if (!started)
+                build_bitset(child, bits);
+            else
+            {
+                build_bitset(child, part);
+                bits.and_with(part);
+            }
+            started = true;
+        }
+        if (!started)
+            bits.assign(seg->doc_count, true);
+        for (size_t i = 0; i < node.children.size; ++i)
+        {
+            const QueryNode &child = *node.children.data[i];
+            if (child.type == NODE_NOT)
+                remove_docs(*child.children.data[0], bits);
+        }
+        return;
+    }
+
+    default:
+        bits.assign(seg->doc_count, false);
+        add_docs(node, bits);
+    }
+}
+
+// Курсор по вычисленной битовой карте
+class BitsetIterator : public DocIterator
+{
+    DocBitset bits;
+    size_t count;
+    int cur;
+
+public:
+    explicit BitsetIterator(DocBitset &&b) : bits(std::move(b)), count(bits.count()), cur(-1) {}
+
+    int doc() const override { return cur; }
+
+    int next() override
+    {
+        if (cur == END_DOC)
+            return cur;
+        return advance(cur + 1);
+    }
+
+    int advance(int target) override
+    {
+        if (cur >= target)
+            return cur;
+        int d = bits.next(target);
+        return cur = d < 0 ? END_DOC : d;
+    }
+
+    size_t cost() const override { return count; }
+};
+
+// Документы запроса без удалённых
+void build_live_bitset(const QueryNode &root, DocBitset &bits)
+{
+    build_bitset(root, bits);
+    if (seg->deleted_bits)
+        bits.and_not_bytes(seg->deleted_bits);
+}
+
+// Кеш результатов. Ключ - режим и нормализованные токены запроса
+// (термы уже приведены к нижнему регистру и стеммированы), поэтому
+// "Running  dogs" и "run dog" делят одну запись. Запись с limit = N
+// отвечает и на меньшие limit: первые документы от limit не зависят.
+struct CachedResult
+{
+    size_t total = 0;
+    size_t limit = 0;
+    SimpleVector<ScoredDoc> top;
+};
+
+SharedCache<CachedResult> result_cache(DEFAULT_RESULT_CACHE_BYTES);
+
+std::string result_cache_key(char mode, const SimpleVector<Token> &tokens)
+{
+    std::string key(1, mode);
+    SimpleVector<std::string> words;
+    for (size_t i = 0; i < tokens.size; ++i)
+    {
+        const Token &t = tokens.data[i];
+        key += '\x1F';
+        key += (char)('A' + t.type);
+        if (t.type == TOK_TERM)
+            key += t.value;
+        else if (t.type == TOK_PHRASE)
+        {
+            words.reset();
+            TokenizerLib::tokenize(t.value, words);
+            for (size_t j = 0; j < words.size; ++j)
+            {
+                key += ' ';
+                key += words.data[j];
+            }
+            key += '/' + std::to_string(t.dist);
+        }
+    }
+    return key;
+}
+
+// Первые limit документов из кеша; false, если записи нет или в ней
+// меньше документов, чем нужно
+bool lookup_result(const std::string &key, uint64_t gen, size_t limit, size_t &total, SimpleVector<ScoredDoc> &top)
+{
+    std::lock_guard<std::mutex> guard(result_cache.lock);
+    if (!result_cache.sync(gen))
+        return false;
+    CachedResult *r = result_cache.cache.get(key);
+    if (!r || (r->limit < limit && r->top.size == r->limit))
+    {
+        result_cache.misses++;
+        return false;
+    }
+    result_cache.hits++;
+    total = r->total;
+    for (size_t i = 0; i < r->top.size && i < limit; ++i)
+        top.push_back(r->top.data[i]);
+    return true;
+}
+
+void store_result(const std::string &key, uint64_t gen, size_t limit, size_t total, const SimpleVector<ScoredDoc> &top)
+{
+    CachedResult r;
+    r.total = total;
+    r.limit = limit;
+    r.top = top;
+    size_t bytes = sizeof(CachedResult) + top.size * sizeof(ScoredDoc);
+    std::lock_guard<std::mutex> guard(result_cache.lock);
+    if (result_cache.sync(gen))
+        result_cache.cache.put(key, std::move(r), bytes);
+}
+
+void set_cache_limits(size_t result_bytes, size_t postings_bytes)
+{
+    {
+        std::lock_guard<std::mutex> guard(result_cache.lock);
+        result_cache.cache.set_limit(result_bytes);
+    }
+    std::lock_guard<std::mutex> guard(postings_cache.lock);
+    postings_cache.cache.set_limit(postings_bytes);
+}
+
+CacheStats result_cache_stats()
+{
+    return result_cache.stats();
+}
+
+CacheStats postings_cache_stats()
+{
+    return postings_cache.stats();
+}
+
+// Выполняет запрос потоком, без промежуточных списков: первые limit
+// doc_id кладутся в top. Возвращает число найденных документов; при
+// count_all == false обход останавливается на limit-м документе, такие
+// неполные ответы не кешируются.
+size_t evaluate(const std::string &query, size_t limit, SimpleVector<int> &top, bool count_all)
+{
+    IndexPin pin;
+    SimpleVector<Token> tokens;
+    {
+        StageTimer timer(query_stats.parse_ns);
+        tokens = tokenize_query(query);
+    }
+    std::string key;
+    uint64_t gen = ix->generation;
+    if (count_all)
+    {
+        key = result_cache_key('b', tokens);
+        SimpleVector<ScoredDoc> cached;
+        size_t total;
+        if (lookup_result(key, gen, limit, total, cached))
+        {
+            for (size_t i = 0; i < cached.size; ++i)
+                top.push_back(cached.data[i].doc_id);
+            return total;
+        }
+    }
+
+    size_t total = 0;
+    SimpleVector<ScoredDoc> found;
+    for (size_t i = 0; i < ix->segments.size && (count_all || total < limit); ++i)
+    {
+        SegmentScope scope(*ix->segments.data[i]);
+        QueryNodePtr root;
+        {
+            StageTimer timer(query_stats.parse_ns);
+            BoolParser parser;
+            root = plan(parser.parse(SimpleVector<Token>(tokens)));
+        }
+        if (root->type == NODE_EMPTY)
+            continue;
+        StageTimer timer(query_stats.eval_ns);
+        if (count_all && is_dense_query(*root))
+        {
+            DocBitset bits;
+            build_live_bitset(*root, bits);
+            for (int d = bits.next(0); d >= 0 && found.size < limit; d = bits.next(d + 1))
+                found.push_back({seg->doc_base + d, 0.0});
+            total += bits.count();
+            continue;
+        }
+        DocIteratorPtr it = build_iterator(*root);
+        for (int d = it->next(); d != END_DOC; d = it->next())
+        {
+            if (seg->is_deleted(d))
+                continue;
+            if (total < limit)
+                found.push_back({seg->doc_base + d, 0.0});
+            total++;
+            if (!count_all && total >= limit)
+                break;
+        }
+    }
+    for (size_t i = 0; i < found.size; ++i)
+        top.push_back(found.data[i].doc_id);
+    if (count_all)
+        store_result(key, gen, limit, total, found);
+    return total;
+}
+
+// Ранжирование BM25. Для индексов без index.lengths длины документов
+// восстанавливаются при загрузке суммированием freq по всем спискам.
+const double BM25_K1 = 1.2;
+const double BM25_B = 0.75;
+
+bool use_ranking = false;
+
+void compute_doc_lengths(Segment &s)
+{
+    s.doc_lengths.clear();
+    for (size_t i = 0; i < s.doc_count; ++i)
+        s.doc_lengths.push_back(0);
+
+    for_each_term_entry([&s](const TermEntry &e)
+    {
+        PostingIteratorPtr it = make_posting_iterator(e);
+        for (int d = it->next(); d != END_DOC; d = it->next())
+            if (d < (int)s.doc_count)
+                s.doc_lengths.data[d] += it->freq();
+    });
+
+    s.total_tokens = 0;
+    s.min_doc_length = s.doc_count > 0 ? s.doc_lengths.data[0] : 0;
+    for (size_t i = 0; i < s.doc_count; ++i)
+    {
+        s.total_tokens += s.doc_lengths.data[i];
+        s.min_doc_length = std::min(s.min_doc_length, s.doc_lengths.data[i]);
+    }
+    double avg = s.doc_count > 0 && s.total_tokens > 0 ? (double)s.total_tokens / s.doc_count : 1;
+    std::cerr << "Document lengths: " << s.total_tokens << " tokens, avg " << avg << std::endl;
+}
+
+double bm25_idf(uint32_t df)
+{
+    return std::log(1.0 + (ix->doc_count - df + 0.5) / (df + 0.5));
+}
+
+double bm25_tf(uint32_t tf, uint32_t dl)
+{
+    double norm = BM25_K1 * (1.0 - BM25_B + BM25_B * dl / ix->avg_doc_length);
+    return tf * (BM25_K1 + 1.0) / (tf + norm);
+}
+
+// Верхняя граница вклада терма при freq <= max_freq: вклад растёт по freq
+// и убывает по длине, поэтому берётся самый короткий документ. Небольшой
+// запас покрывает разный порядок сложения в границе и в самом score.
+double bm25_bound(double idf, uint32_t max_freq)
+{
+    if (max_freq == UNKNOWN_MAX_FREQ)
+        return idf * (BM25_K1 + 1.0) * 1.000001;
+    return idf * bm25_tf(max_freq, ix->min_doc_length) * 1.000001;
+}
+
+// a выше b в выдаче: больший score, при равенстве меньший doc_id
+bool ranks_before(const ScoredDoc &a, const ScoredDoc &b)
+{
+    if (a.score != b.score)
+        return a.score > b.score;
+    return a.doc_id < b.doc_id;
+}
+
+// Ограниченная куча лучших k документов, в вершине - худший из них
+class TopK
+{
+    SimpleVector<ScoredDoc> heap;
+    size_t k;
+
+public:
+    explicit TopK(size_t limit) : k(limit) {}
+
+    bool full() const { return heap.size >= k; }
+
+    // Документы перебираются по возрастанию doc_id, поэтому новый документ
+    // попадает в полную кучу, только если его score строго больше порога.
+    // При k == 0 в кучу не попадает ничего, документы только считаются.
+    double threshold() const
+    {
+        if (k == 0)
+            return HUGE_VAL;
+        return full() ? heap.data[0].score : -1.0;
+    }
+
+    void push(int doc_id, double score)
+    {
+        ScoredDoc d{doc_id, score};
+        if (k == 0)
+            return;
+        if (!full())
+        {
+            heap.push_back(d);
+            std::push_heap(heap.begin(), heap.end(), ranks_before);
+        }
+        else if (ranks_before(d, heap.data[0]))
+        {
+            std::pop_heap(heap.begin(), heap.end(), ranks_before);
+            heap.data[heap.size - 1] = d;
+            std::push_heap(heap.begin(), heap.end(), ranks_before);
+        }
+    }
+
+    void sorted(SimpleVector<ScoredDoc> &out) const
+    {
+        out = heap;
+        std::sort(out.begin(), out.end(), ranks_before);
+    }
+};
+
+struct TermScorer
+{
+    PostingIteratorPtr it;
+    double idf;
+    double max_score;
+};
+
+struct ScoredTerm
+{
+    TermEntry entry;
+    std::string_view term;
+};
+
+// Положительные термы запроса (вне NOT), каждый не более одного раза
+void collect_scored_terms(const QueryNode &node, SimpleVector<ScoredTerm> &out)
+{
+    auto add = [&out](const TermEntry &e, std::string_view term)
+    {
+        for (size_t i = 0; i < out.size; ++i)
+            if (out.data[i].entry.offset == e.offset)
+                return;
+        out.push_back({e, term});
+    };
+
+    switch (node.type)
+    {
+    case NODE_TERM:
+        add(node.entry, node.term);
+        break;
+    case NODE_PHRASE:
+        for (size_t i = 0; i < node.entries.size; ++i)
+            add(node.entries[i], node.phrase[i]);
+        break;
+    case NODE_AND:
+    case NODE_OR:
+        for (size_t i = 0; i < node.children.size; ++i)
+            collect_scored_terms(*node.children.data[i], out);
+        break;
+    default:
+        break;
+    }
+}
+
+// doc_freq терма по всем сегментам; local - уже найденный в текущем
+uint32_t total_doc_freq(std::string_view term, uint32_t local)
+{
+    if (ix->segments.size == 1)
+        return local;
+    uint32_t df = 0;
+    for (size_t i = 0; i < ix->segments.size; ++i)
+    {
+        const Segment &s = *ix->segments.data[i];
+        if (&s == seg)
+        {
+            df += local;
+            continue;
+        }
+        SegmentScope scope(s);
+        TermEntry e;
+        if (find_term(term, e))
+            df += e.doc_count;
+    }
+    return df;
+}
+
+void make_scorers(const SimpleVector<ScoredTerm> &terms, SimpleVector<TermScorer> &out)
+{
+    for (size_t i = 0; i < terms.size; ++i)
+    {
+        const TermEntry &e = terms.data[i].entry;
+        TermScorer t;
+        t.it = make_posting_iterator(e);
+        t.idf = bm25_idf(total_doc_freq(terms.data[i].term, e.doc_count));
+        t.max_score = bm25_bound(t.idf, t.it->max_freq());
+        out.push_back(std::move(t));
+    }
+}
+
+// Block-max WAND для дизъюнкции термов. Курсоры упорядочены по текущему
+// doc_id; pivot - первый документ, на котором сумма глобальных границ
+// превышает порог кучи, документы до него пропускаются. Затем та же
+// проверка делается по границам блоков, содержащих pivot: если и она не
+// проходит, курсоры перепрыгивают сразу за ближайший конец блока.
+void wand_top_k(SimpleVector<TermScorer> &terms, TopK &top)
+{
+    SimpleVector<TermScorer *> order;
+    for (size_t i = 0; i < terms.size; ++i)
+    {
+        terms.data[i].it->next();
+        order.push_back(&terms.data[i]);
+    }
+    size_t n = order.size;
+    SimpleVector<double> parts;
+    for (size_t i = 0; i < n; ++i)
+        parts.push_back(0);
+
+    while (true)
+    {
+        // Порядок между шагами почти не меняется, вставки хватает
+        for (size_t i = 1; i < n; ++i)
+        {
+            TermScorer *t = order.data[i];
+            size_t j = i;
+            while (j > 0 && order.data[j - 1]->it->doc() > t->it->doc())
+            {
+                order.data[j] = order.data[j - 1];
+                j--;
+            }
+            order.data[j] = t;
+        }
+
+        double threshold = top.threshold();
+        double acc = 0;
+        size_t p = n;
+        for (size_t i = 0; i < n && order.data[i]->it->doc() != END_DOC; ++i)
+        {
+            acc += order.data[i]->max_score;
+            if (acc > threshold)
+            {
+                p = i;
+                break;
+            }
+        }
+        if (p == n)
+            break;
+
+        int pivot = order.data[p]->it->doc();
+        while (p + 1 < n && order.data[p + 1]->it->doc() == pivot)
+            p++;
+
+        if (top.full())
+        {
+            double block_acc = 0;
+            int next = END_DOC;
+            for (size_t i = 0; i <= p; ++i)
+            {
+                int last;
+                uint32_t mf = order.data[i]->it->max_freq_at(pivot, last);
+                block_acc += bm25_bound(order.data[i]->idf, mf);
+                next = std::min(next, last + 1);
+            }
+            if (block_acc <= threshold)
+            {
+                if (p + 1 < n)
+                    next = std::min(next, order.data[p + 1]->it->doc());
+                for (size_t i = 0; i <= p; ++i)
+                    order.data[i]->it->advance(next);
+                continue;
+            }
+        }
+
+        if (order.data[0]->it->doc() == pivot)
+        {
+            if (!seg->is_deleted(pivot))
+            {
+                // Вклады складываются в порядке terms, как в полном переборе
+                // rank_segment: иначе score расходится в последних битах и
+                // равные документы меняются местами
+                uint32_t dl = doc_length(pivot);
+                for (size_t i = 0; i < n; ++i)
+                    parts.data[i] = 0;
+                for (size_t i = 0; i <= p; ++i)
+                    parts.data[order.data[i] - terms.data] = order.data[i]->idf * bm25_tf(order.data[i]->it->freq(), dl);
+                double score = 0;
+                for (size_t i = 0; i < n; ++i)
+                    score += parts.data[i];
+                top.push(seg->doc_base + pivot, score);
+            }
+            for (size_t i = 0; i <= p; ++i)
+                order.data[i]->it->next();
+        }
+        else
+        {
+            for (size_t i = 0; i < p && order.data[i]->it->doc() < pivot; ++i)
+                order.data[i]->it->advance(pivot);
+        }
+    }
+}
+
+bool is_term_disjunction(const QueryNode &node)
+{
+    if (node.type == NODE_TERM)
+        return true;
+    if (node.type != NODE_OR)
+        return false;
+    for (size_t i = 0; i < node.children.size; ++i)
+        if (node.children.data[i]->type != NODE_TERM)
+            return false;
+    return true;
+}
+
+// Ранжирует документы сегмента seg в общую кучу (сегменты идут по
+// возрастанию doc_base, так что порядок doc_id для TopK сохраняется).
+// Возвращает число найденных в сегменте документов.
+size_t rank_segment(const SimpleVector<Token> &tokens, TopK &heap)
+{
+    QueryNodePtr root;
+    {
+        StageTimer timer(query_stats.parse_ns);
+        BoolParser parser;
+        root = plan(parser.parse(SimpleVector<Token>(tokens)));
+    }
+    if (root->type == NODE_EMPTY)
+        return 0;
+    StageTimer timer(query_stats.eval_ns);
+
+    SimpleVector<ScoredTerm> entries;
+    collect_scored_terms(*root, entries);
+    SimpleVector<TermScorer> terms;
+    make_scorers(entries, terms);
+
+    size_t total = 0;
+    DocIteratorPtr it;
+    bool dense = is_dense_query(*root);
+    if (dense)
+    {
+        // Удалённые сняты с карты сразу, проверки ниже их уже не встретят
+        DocBitset bits;
+        build_live_bitset(*root, bits);
+        it = DocIteratorPtr(new BitsetIterator(std::move(bits)));
+    }
+    else
+        it = build_iterator(*root);
+    if (is_term_disjunction(*root))
+    {
+        wand_top_k(terms, heap);
+        if (dense)
+            return it->cost();
+        for (int d = it->next(); d != END_DOC; d = it->next())
+            if (!seg->is_deleted(d))
+                total++;
+        return total;
+    }
+
+    double max_score = 0;
+    for (size_t i = 0; i < terms.size; ++i)
+        max_score += terms.data[i].max_score;
+
+    for (int d = it->next(); d != END_DOC; d = it->next())
+    {
+        if (seg->is_deleted(d))
+            continue;
+        total++;
+        if (max_score <= heap.threshold())
+            continue;
+        double score = 0;
+        uint32_t dl = doc_length(d);
+        for (size_t i = 0; i < terms.size; ++i)
+        {
+            PostingIterator &t = *terms.data[i].it;
+            if (t.advance(d) == d)
+                score += terms.data[i].idf * bm25_tf(t.freq(), dl);
+        }
+        heap.push(seg->doc_base + d, score);
+    }
+    return total;
+}
+
+// Ранжированный поиск: limit лучших по BM25 документов кладутся в top по
+// убыванию score. Дизъюнкции термов идут через WAND, остальные запросы
+// оценивают каждый найденный документ по положительным термам. Возвращает
+// полное число найденных документов.
+size_t evaluate_ranked(const std::string &query, size_t limit, SimpleVector<ScoredDoc> &top)
+{
+    IndexPin pin;
+    SimpleVector<Token> tokens;
+    {
+        StageTimer timer(query_stats.parse_ns);
+        tokens = tokenize_query(query);
+    }
+    std::string key = result_cache_key('r', tokens);
+    uint64_t gen = ix->generation;
+    size_t cached_total;
+    if (lookup_result(key, gen, limit, cached_total, top))
+        return cached_total;
+
+    TopK heap(limit);
+    size_t total = 0;
+    for (size_t i = 0; i < ix->segments.size; ++i)
+    {
+        SegmentScope scope(*ix->segments.data[i]);
+        total += rank_segment(tokens, heap);
+    }
+    heap.sorted(top);
+    store_result(key, gen, limit, total, top);
+    return total;
+}
+
+void load_segment(Segment &s, const std::string &dir)
+{
+    if (use_mmap)
+        load_index_mmap(s, dir);
+    else
+        load_index(s, dir);
+    if (Shards::read_globals(dir, s.globals) && s.globals.size != s.doc_count)
+        throw std::runtime_error("Doc numbers in " + dir + " do not match its docs");
+}
+
+// Каталог с index.segments открывается сегментами из манифеста, обычный
+// каталог индекса - одним сегментом
+void load_segments(IndexSnapshot &snap, const std::string &index_dir)
+{
+    if (Shards::is_sharded(index_dir))
+        throw std::runtime_error(index_dir + " is a sharded index; serve it with bin/search, which starts a process per shard");
+    if (!Segments::is_segmented(index_dir))
+    {
+        snap.segments.push_back(std::unique_ptr<Segment>(new Segment));
+        load_segment(*snap.segments.data[0], index_dir);
+        return;
+    }
+
+    Segments::Manifest m = Segments::read_manifest(index_dir);
+    size_t deleted = 0;
+    for (size_t i = 0; i < m.segments.size; ++i)
+    {
+        const Segments::SegmentInfo &info = m.segments[i];
+        std::unique_ptr<Segment> s(new Segment);
+        std::string dir = Segments::segment_dir(index_dir, info.id);
+        load_segment(*s, dir);
+        if (s->doc_count != info.doc_count)
+            throw std::runtime_error("Segment " + dir + " does not match the manifest");
+        if (info.del_count > 0)
+        {
+            Segments::read_deletions(index_dir, info, s->deleted);
+            s->deleted_bits = s->deleted.data;
+            deleted += info.del_count;
+        }
+        snap.segments.push_back(std::move(s));
+    }
+    std::cerr << "Opened " << m.segments.size << " segments, " << deleted << " deleted docs." << std::endl;
+}
+
+void open_index(const std::string &index_dir)
+{
+    std::shared_ptr<IndexSnapshot> snap(new IndexSnapshot);
+    load_segments(*snap, index_dir);
+
+    // Длины считаются курсорами, которые читают снимок через ix и seg
+    struct Restore
+    {
+        const IndexSnapshot *prev;
+        ~Restore() { ix = prev; }
+    } restore{ix};
+    ix = snap.get();
+
+    uint64_t total_tokens = 0;
+    bool have_min = false;
+    snap->has_globals = snap->segments.size > 0;
+    for (size_t i = 0; i < snap->segments.size; ++i)
+    {
+        Segment &s = *snap->segments.data[i];
+        s.ordinal = i;
+        if (s.globals.size == 0 && s.doc_count > 0)
+            snap->has_globals = false;
+        s.doc_base = snap->doc_count;
+        snap->doc_count += s.doc_count;
+        if (use_ranking && !s.length_codes)
+        {
+            SegmentScope scope(s);
+            compute_doc_lengths(s);
+        }
+        total_tokens += s.total_tokens;
+        if (s.doc_count > 0)
+        {
+            snap->min_doc_length = have_min ? std::min(snap->min_doc_length, s.min_doc_length) : s.min_doc_length;
+            have_min = true;
+        }
+    }
+    snap->avg_doc_length = snap->doc_count > 0 && total_tokens > 0 ? (double)total_tokens / snap->doc_count : 1;
+
+    std::lock_guard<std::mutex> guard(publish_mutex);
+    snap->generation = ++last_generation;
+    IndexSnapshotPtr published(std::move(snap));
+    std::atomic_store(&live_index, std::move(published));
+}
@@ -0,0 +1,123 @@
+#ifndef SEARCH_CORE_HPP
+#define SEARCH_CORE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include "common.hpp"
+#include "lru_cache.hpp"
+
+// Ядро поиска: загрузка индекса и вычисление запросов, общее для bin/search
+// и libsearch. Индекс один на процесс: open_index публикует неизменяемый
+// снимок, запросы только читают его, поэтому их можно вычислять из
+// нескольких потоков сразу, а повторный open_index подменяет снимок, не
+// останавливая их.
+
+struct DocView {
+    std::string_view url;
+    std::string_view title;
+};
+
+struct ScoredDoc {
+    int doc_id;
+    double score;
+};
+
+// Режимы задаются до open_index
+extern bool use_mmap;
+extern bool use_ranking;
+
+// Загружает индекс (отображает файлы при use_mmap), готовит длины
+// документов для BM25 и атомарно делает его текущим. Каталог с
+// index.segments открывается как набор сегментов (segments.hpp): номера
+// документов идут подряд по сегментам, удалённые документы в выдачу не
+// попадают. Шардированный каталог (shards.hpp) сам по себе не
+// открывается: его шарды обслуживают отдельные процессы bin/search.
+// Запросы, начатые до подмены, дорабатывают на прежнем индексе; он
+// освобождается вместе с последним из них. При ошибке
+// (std::runtime_error) текущий индекс остаётся.
+void open_index(const std::string& index_dir);
+
+struct IndexSnapshot;
+
+// Закрепляет текущий индекс за потоком до конца области видимости:
+// evaluate, get_doc и index_doc_count внутри видят один и тот же индекс,
+// даже если его тем временем подменили. Вложенные IndexPin допустимы.
+class IndexPin {
+public:
+    IndexPin();
+    ~IndexPin();
+
+    IndexPin(const IndexPin&) = delete;
+    IndexPin& operator=(const IndexPin&) = delete;
+
+private:
+    std::shared_ptr<const IndexSnapshot> held;
+    const IndexSnapshot* prev;
+};
+
+// Число документов закреплённого (или текущего) индекса; 0 до open_index
+size_t index_doc_count();
+
+// Адрес и заголовок документа. Представления живут, пока жив индекс: под
+// IndexPin - до конца его области, без него - до следующего обращения к
+// индексу из этого потока. Для сжатого index.docs (v4) они смотрят в
+// распакованный блок потока и действительны только до следующего get_doc
+// в этом потоке.
+DocView get_doc(size_t id);
+
+// Индекс шарда (shards.hpp) нумерует документы ещё и общими номерами
+// всего шардированного индекса из index.globals; они возрастают вместе с
+// локальными. global_doc_id переводит локальный номер в общий,
+// local_doc_id - обратно (-1, если такого документа здесь нет). Без
+// index.globals номера совпадают.
+uint32_t global_doc_id(size_t id);
+long long local_doc_id(uint32_t global);
+
+// Булев поиск: первые limit doc_id по возрастанию в top; возвращает полное
+// число найденных (при count_all) документов
+size_t evaluate(const std::string& query, size_t limit, SimpleVector<int>& top, bool count_all = true);
+
+// Ранжированный поиск: limit лучших по BM25 документов по убыванию score
+size_t evaluate_ranked(const std::string& query, size_t limit, SimpleVector<ScoredDoc>& top);
+
+// Объединение и пересечение возрастающих списков doc_id
+SimpleVector<int> set_union(const SimpleVector<int>& a, const SimpleVector<int>& b);
+SimpleVector<int> set_intersect(const SimpleVector<int>& a, const SimpleVector<int>& b);
+
+// a выше b в выдаче: больший score, при равенстве меньший doc_id
+bool ranks_before(const ScoredDoc& a, const ScoredDoc& b);
+
+// Кеш результатов запросов и кеш распакованных списков частых термов.
+// Лимиты в байтах, 0 выключает кеш; менять можно и между запросами. Оба
+// кеша очищаются сами, когда загружается новый индекс.
+const size_t DEFAULT_RESULT_CACHE_BYTES = 16 << 20;
+const size_t DEFAULT_POSTINGS_CACHE_BYTES = 64 << 20;
+
+void set_cache_limits(size_t result_bytes, size_t postings_bytes);
+CacheStats result_cache_stats();
+CacheStats postings_cache_stats();
+
+// Счётчики этапов запросов (--stats в bin/search). Пока collect_stats
+// выключен, ядро их не ведёт и часы не читает; включается до запросов.
+// Счётчики у каждого потока свои. decode_ns и bytes_decoded - распаковка
+// блоков doc_id и freq (позиции фраз не входят); eval_ns - обход курсоров
+// и битовых карт с ранжированием, распаковка внутри него тоже
+// считается, так что на сами операции над множествами приходится
+// eval_ns - decode_ns.
+struct QueryStats {
+    uint64_t parse_ns = 0;
+    uint64_t decode_ns = 0;
+    uint64_t eval_ns = 0;
+    uint64_t bytes_decoded = 0;
+    uint64_t blocks_decoded = 0;
+};
+
+extern bool collect_stats;
+
+// Счётчики потока с прошлого вызова; обнуляет их
+QueryStats take_query_stats();
+
+#endif
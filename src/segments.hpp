@@ -0,0 +1,158 @@
+#ifndef SEGMENTS_HPP
+#define SEGMENTS_HPP
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include "common.hpp"
+
+// Сегментированный индекс: каталог с файлом index.segments и подкаталогами
+// seg-NNNNNN, каждый из которых - обычный неизменяемый индекс (docs, dict,
+// postings, positions, lengths). Номера документов сегментов идут подряд в
+// порядке манифеста. Удалённые документы отмечены битовой картой
+// index.deleted.G рядом с сегментом; G растёт с каждым изменением карты,
+// файлы карт, как и сегменты, не перезаписываются. Манифест меняется
+// только целиком через временный файл и rename, поэтому читатель видит
+// либо старый набор сегментов, либо новый.
+//
+// index.segments: "SEGS", версия (uint16), следующий номер сегмента
+// (uint32), число сегментов (uint32), затем на сегмент его номер, число
+// документов, поколение карты удалений (0 - карты нет) и число удалённых
+// документов, все uint32.
+// index.deleted.G: "DELS", версия (uint16), число документов (uint32),
+// затем бит на документ, младший бит байта - меньший номер.
+namespace Segments {
+
+const char MANIFEST_FILE[] = "index.segments";
+const uint16_t MANIFEST_VERSION = 1;
+const uint16_t DELETIONS_VERSION = 1;
+
+struct SegmentInfo {
+    uint32_t id = 0;
+    uint32_t doc_count = 0;
+    uint32_t del_gen = 0;
+    uint32_t del_count = 0;
+
+    uint32_t live_docs() const { return doc_count - del_count; }
+};
+
+struct Manifest {
+    uint32_t next_id = 1;
+    SimpleVector<SegmentInfo> segments;
+};
+
+inline std::string manifest_path(const std::string& index_dir) {
+    return index_dir + "/" + MANIFEST_FILE;
+}
+
+inline std::string segment_dir(const std::string& index_dir, uint32_t id) {
+    char name[16];
+    std::snprintf(name, sizeof(name), "seg-%06u", id);
+    return index_dir + "/" + name;
+}
+
+inline std::string deletions_path(const std::string& index_dir, const SegmentInfo& seg) {
+    return segment_dir(index_dir, seg.id) + "/index.deleted." + std::to_string(seg.del_gen);
+}
+
+inline bool is_segmented(const std::string& index_dir) {
+    return std::ifstream(manifest_path(index_dir)).good();
+}
+
+template <typename T>
+bool read_field(std::ifstream& f, T& value) {
+    return (bool)f.read((char*)&value, sizeof(T));
+}
+
+inline Manifest read_manifest(const std::string& index_dir) {
+    std::string path = manifest_path(index_dir);
+    std::ifstream f(path, std::ios::binary);
+    if (!f) throw std::runtime_error("Cannot open " + path);
+
+    char magic[4];
+    uint16_t version = 0;
+    uint32_t count = 0;
+    Manifest m;
+    if (!f.read(magic, 4) || std::string(magic, 4) != "SEGS" || !read_field(f, version) || version != MANIFEST_VERSION)
+        throw std::runtime_error("Bad header in " + path);
+    if (!read_field(f, m.next_id) || !read_field(f, count))
+        throw std::runtime_error("Truncated " + path);
+    for (uint32_t i = 0; i < count; ++i) {
+        SegmentInfo s;
+        if (!read_field(f, s.id) || !read_field(f, s.doc_count) || !read_field(f, s.del_gen) || !read_field(f, s.del_count))
+            throw std::runtime_error("Truncated " + path);
+        if (s.del_count > s.doc_count)
+            throw std::runtime_error("Bad segment entry in " + path);
+        m.segments.push_back(s);
+    }
+    return m;
+}
+
+// Записывает манифест во временный файл и атомарно подменяет им текущий
+inline void write_manifest(const std::string& index_dir, const Manifest& m) {
+    std::string path = manifest_path(index_dir);
+    std::string tmp = path + ".tmp";
+    {
+        std::ofstream f(tmp, std::ios::binary | std::ios::trunc);
+        uint32_t count = m.segments.size;
+        f.write("SEGS", 4);
+        f.write((const char*)&MANIFEST_VERSION, 2);
+        f.write((const char*)&m.next_id, 4);
+        f.write((const char*)&count, 4);
+        for (size_t i = 0; i < m.segments.size; ++i) {
+            const SegmentInfo& s = m.segments[i];
+            f.write((const char*)&s.id, 4);
+            f.write((const char*)&s.doc_count, 4);
+            f.write((const char*)&s.del_gen, 4);
+            f.write((const char*)&s.del_count, 4);
+        }
+        f.flush();
+        if (!f) throw std::runtime_error("Cannot write " + tmp);
+    }
+    if (std::rename(tmp.c_str(), path.c_str()) != 0)
+        throw std::runtime_error("Cannot replace " + path);
+}
+
+// Битовая карта удалений сегмента; без карты - doc_count нулевых бит
+inline void read_deletions(const std::string& index_dir, const SegmentInfo& seg, SimpleVector<uint8_t>& bits) {
+    bits.reset();
+    size_t bytes = ((size_t)seg.doc_count + 7) / 8;
+    for (size_t i = 0; i < bytes; ++i) bits.push_back(0);
+    if (seg.del_gen == 0) return;
+    std::string path = deletions_path(index_dir, seg);
+    std::ifstream f(path, std::ios::binary);
+    char magic[4];
+    uint16_t version = 0;
+    uint32_t count = 0;
+    if (!f || !f.read(magic, 4) || std::string(magic, 4) != "DELS" || !read_field(f, version) ||
+        version != DELETIONS_VERSION || !read_field(f, count) || count != seg.doc_count)
+        throw std::runtime_error("Bad deletions file " + path);
+    if (bytes > 0 && !f.read((char*)bits.data, bytes))
+        throw std::runtime_error("Truncated " + path);
+}
+
+// Пишет карту с поколением seg.del_gen
+inline void write_deletions(const std::string& index_dir, const SegmentInfo& seg, const SimpleVector<uint8_t>& bits) {
+    std::string path = deletions_path(index_dir, seg);
+    std::ofstream f(path, std::ios::binary | std::ios::trunc);
+    f.write("DELS", 4);
+    f.write((const char*)&DELETIONS_VERSION, 2);
+    f.write((const char*)&seg.doc_count, 4);
+    f.write((const char*)bits.data, bits.size);
+    f.flush();
+    if (!f) throw std::runtime_error("Cannot write " + path);
+}
+
+inline bool is_deleted(const uint8_t* bits, uint32_t doc) {
+    return bits && (bits[doc >> 3] >> (doc & 7)) & 1;
+}
+
+inline void mark_deleted(SimpleVector<uint8_t>& bits, uint32_t doc) {
+    bits[doc >> 3] |= (uint8_t)(1 << (doc & 7));
+}
+
+}
+
+#endif
@@ -0,0 +1,144 @@
+#ifndef SHARDS_HPP
+#define SHARDS_HPP
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include "common.hpp"
+
+// Шардированный индекс: каталог с файлом index.shards и подкаталогами
+// shard-K, каждый из которых - обычный индекс (одиночный или
+// сегментированный), который обслуживает свой процесс bin/search.
+// Документы делятся по хешу url или непрерывными диапазонами входа.
+// Шард по хешу вычисляется FNV-1a от url и входит в формат: с другим
+// хешем --append отправил бы новую версию документа не в тот шард, где
+// лежит старая.
+//
+// Документ получает общий номер - порядковый номер во входе сборки, для
+// --append продолжающий нумерацию с next_global. Это номер документа в
+// одиночном индексе из того же входа, по нему координатор сливает ответы
+// шардов в том же порядке. Каждый индекс шарда (и каждый его сегмент)
+// хранит общие номера своих документов в index.globals; внутри шарда они
+// возрастают вместе с локальными номерами.
+//
+// index.shards: "SHRD", версия (uint16), число шардов (uint32), способ
+// деления (uint8: 0 - хеш url, 1 - диапазоны), next_global (uint32).
+// index.globals: "GLBL", версия (uint16), число документов (uint32), затем
+// общий номер каждого документа (uint32).
+namespace Shards {
+
+const char LAYOUT_FILE[] = "index.shards";
+const char GLOBALS_FILE[] = "index.globals";
+const uint16_t LAYOUT_VERSION = 2;
+const uint16_t GLOBALS_VERSION = 1;
+const uint32_t MAX_SHARDS = 1024;
+
+enum class Split : uint8_t { HASH = 0, RANGE = 1 };
+
+struct Layout {
+    uint32_t count = 0;
+    Split split = Split::HASH;
+    uint32_t next_global = 0;
+};
+
+inline std::string layout_path(const std::string& index_dir) {
+    return index_dir + "/" + LAYOUT_FILE;
+}
+
+inline std::string shard_dir(const std::string& index_dir, uint32_t shard) {
+    return index_dir + "/shard-" + std::to_string(shard);
+}
+
+inline bool is_sharded(const std::string& index_dir) {
+    return std::ifstream(layout_path(index_dir)).good();
+}
+
+inline uint32_t shard_of_url(std::string_view url, uint32_t count) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (unsigned char c : url) {
+        h ^= c;
+        h *= 0x100000001b3ull;
+    }
+    return h % count;
+}
+
+inline Layout read_layout(const std::string& index_dir) {
+    std::string path = layout_path(index_dir);
+    std::ifstream f(path, std::ios::binary);
+    if (!f) throw std::runtime_error("Cannot open " + path);
+
+    char magic[4];
+    uint16_t version = 0;
+    uint8_t split = 0;
+    Layout l;
+    if (!f.read(magic, 4) || std::string(magic, 4) != "SHRD" || !f.read((char*)&version, 2) || version != LAYOUT_VERSION)
+        throw std::runtime_error("Bad header in " + path);
+    if (!f.read((char*)&l.count, 4) || !f.read((char*)&split, 1) || !f.read((char*)&l.next_global, 4))
+        throw std::runtime_error("Truncated " + path);
+    if (l.count == 0 || l.count > MAX_SHARDS || split > (uint8_t)Split::RANGE)
+        throw std::runtime_error("Bad layout in " + path);
+    l.split = (Split)split;
+    return l;
+}
+
+inline void write_layout(const std::string& index_dir, const Layout& l) {
+    std::string path = layout_path(index_dir);
+    std::string tmp = path + ".tmp";
+    {
+        std::ofstream f(tmp, std::ios::binary | std::ios::trunc);
+        uint8_t split = (uint8_t)l.split;
+        f.write("SHRD", 4);
+        f.write((const char*)&LAYOUT_VERSION, 2);
+        f.write((const char*)&l.count, 4);
+        f.write((const char*)&split, 1);
+        f.write((const char*)&l.next_global, 4);
+        f.flush();
+        if (!f) throw std::runtime_error("Cannot write " + tmp);
+    }
+    if (std::rename(tmp.c_str(), path.c_str()) != 0)
+        throw std::runtime_error("Cannot replace " + path);
+}
+
+inline std::string globals_path(const std::string& dir) {
+    return dir + "/" + GLOBALS_FILE;
+}
+
+// Общие номера документов индекса dir; false, если index.globals нет
+inline bool read_globals(const std::string& dir, SimpleVector<uint32_t>& ids) {
+    ids.reset();
+    std::string path = globals_path(dir);
+    std::ifstream f(path, std::ios::binary);
+    if (!f) return false;
+
+    char magic[4];
+    uint16_t version = 0;
+    uint32_t count = 0;
+    if (!f.read(magic, 4) || std::string(magic, 4) != "GLBL" || !f.read((char*)&version, 2) || version != GLOBALS_VERSION ||
+        !f.read((char*)&count, 4))
+        throw std::runtime_error("Bad header in " + path);
+    for (uint32_t i = 0; i < count; ++i) ids.push_back(0);
+    if (count > 0 && !f.read((char*)ids.data, (size_t)count * 4))
+        throw std::runtime_error("Truncated " + path);
+    for (uint32_t i = 1; i < count; ++i)
+        if (ids[i] <= ids[i - 1]) throw std::runtime_error("Unordered doc numbers in " + path);
+    return true;
+}
+
+inline void write_globals(const std::string& dir, const SimpleVector<uint32_t>& ids) {
+    std::string path = globals_path(dir);
+    std::ofstream f(path, std::ios::binary | std::ios::trunc);
+    uint32_t count = ids.size;
+    f.write("GLBL", 4);
+    f.write((const char*)&GLOBALS_VERSION, 2);
+    f.write((const char*)&count, 4);
+    f.write((const char*)ids.data, (size_t)count * 4);
+    f.flush();
+    if (!f) throw std::runtime_error("Cannot write " + path);
+}
+
+}
+
+#endif
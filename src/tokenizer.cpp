@@ -1,449 +1,147 @@
-#include <cctype>
+#include <cstdint>
 #include <iostream>
 #include <string>
-
-namespace
+#include <string_view>
+
+#include "common.hpp"
+#include "hash_table.hpp"
+#include "tokenizer_lib.hpp"
+
+// Стеммер Портера и поиск границ токенов - общие с индексатором и поиском
+// из tokenizer_lib.hpp, чтобы термы запроса и индекса совпадали байт в байт.
+//
+// Построчный режим: на каждую входную строку - по терму на строку и
+// "__END_DOC__", вывод сбрасывается после каждого документа.
+//
+// Пакетный режим (--batch): каждая входная строка - документ, строка
+// "__END_BATCH__" (или конец ввода) закрывает пакет. На документ выводится
+// одна строка с термами через пробел, в конце пакета - "__END_BATCH__".
+// Ответ на пакет копится в памяти и пишется одним куском после чтения
+// всего пакета, поэтому клиент может сначала записать пакет целиком, а
+// потом читать ответ.
+//
+// С --ids (включает --batch) вместо термов выводятся номера: строка
+// документа - "<новые термы>\t<номера>", где новые термы (через пробел)
+// впервые встретились в этом документе и получают следующие номера по
+// порядку. Клиент восстанавливает словарь, дописывая новые термы в конец.
+
+const std::string END_BATCH = "__END_BATCH__";
+
+struct BatchOutput
 {
-
-    bool is_consonant(const std::string &w, int i)
-    {
-        const char ch = w[static_cast<size_t>(i)];
-        switch (ch)
-        {
-        case 'a':
-        case 'e':
-        case 'i':
-        case 'o':
-        case 'u':
-            return false;
-        case 'y':
-            if (i == 0)
-            {
-                return true;
-            }
-            return !is_consonant(w, i - 1);
-        default:
-            return true;
-        }
-    }
-
-    int measure(const std::string &w)
-    {
-        const int len = static_cast<int>(w.size());
-        int n = 0;
-        int i = 0;
-
-        while (i < len && is_consonant(w, i))
-        {
-            i++;
-        }
-
-        while (i < len)
-        {
-            while (i < len && !is_consonant(w, i))
-            {
-                i++;
-            }
-            if (i >= len)
-            {
-                break;
-            }
-
-            while (i < len && is_consonant(w, i))
-            {
-                i++;
-            }
-            n++;
-        }
-
-        return n;
-    }
-
-    bool contains_vowel(const std::string &w)
-    {
-        for (int i = 0; i < static_cast<int>(w.size()); i++)
-        {
-            if (!is_consonant(w, i))
-            {
-                return true;
-            }
-        }
-        return false;
-    }
-
-    bool ends_with(const std::string &w, const std::string &suffix)
-    {
-        if (w.size() < suffix.size())
-        {
-            return false;
-        }
-        return w.compare(w.size() - suffix.size(), suffix.size(), suffix) == 0;
-    }
-
-    std::string stem_part(const std::string &w, const std::string &suffix)
-    {
-        return w.substr(0, w.size() - suffix.size());
-    }
-
-    bool double_consonant(const std::string &w)
-    {
-        if (w.size() < 2)
-        {
-            return false;
-        }
-        const size_t n = w.size();
-        if (w[n - 1] != w[n - 2])
-        {
-            return false;
-        }
-        return is_consonant(w, static_cast<int>(n - 1));
-    }
-
-    bool cvc(const std::string &w)
-    {
-        if (w.size() < 3)
-        {
-            return false;
-        }
-        const int i = static_cast<int>(w.size() - 1);
-        if (!is_consonant(w, i))
-        {
-            return false;
-        }
-        if (is_consonant(w, i - 1))
-        {
-            return false;
-        }
-        if (!is_consonant(w, i - 2))
-        {
-            return false;
-        }
-        const char last = w.back();
-        if (last == 'w' || last == 'x' || last == 'y')
-        {
-            return false;
-        }
-        return true;
-    }
-
-    void replace_suffix(std::string &w, const std::string &suffix, const std::string &replacement)
-    {
-        w.erase(w.size() - suffix.size());
-        w += replacement;
-    }
-
-    void step1a(std::string &w)
-    {
-        if (ends_with(w, "sses"))
-        {
-            replace_suffix(w, "sses", "ss");
-            return;
-        }
-        if (ends_with(w, "ies"))
-        {
-            replace_suffix(w, "ies", "i");
+    std::string out;
+    bool with_ids = false;
+    FlatHashMap<uint32_t> ids;
+    std::string new_terms;
+    std::string doc_ids;
+
+    void add_document(TokenizerLib::Tokenizer &tokenizer, const std::string &line)
+    {
+        if (!with_ids)
+        {
+            bool first = true;
+            auto append = [&](std::string_view term, TokenizerLib::StemCache::Entry *)
+            {
+                if (!first)
+                    out += ' ';
+                out.append(term.data(), term.size());
+                first = false;
+            };
+            tokenizer.scan(line, append);
+            out += '\n';
             return;
         }
-        if (ends_with(w, "ss"))
-        {
-            return;
-        }
-        if (ends_with(w, "s"))
-        {
-            w.pop_back();
-        }
-    }
-
-    void step1b(std::string &w)
-    {
-        if (ends_with(w, "eed"))
-        {
-            std::string stem = stem_part(w, "eed");
-            if (measure(stem) > 0)
-            {
-                replace_suffix(w, "eed", "ee");
-            }
-            return;
-        }
-
-        bool removed = false;
-        std::string stem;
 
-        if (ends_with(w, "ed"))
+        new_terms.clear();
+        doc_ids.clear();
+        auto append = [&](std::string_view term, TokenizerLib::StemCache::Entry *)
         {
-            stem = stem_part(w, "ed");
-            if (contains_vowel(stem))
+            uint32_t &id = ids[term];
+            if (id == 0)
             {
-                w = stem;
-                removed = true;
+                id = ids.size();
+                if (!new_terms.empty())
+                    new_terms += ' ';
+                new_terms.append(term.data(), term.size());
             }
-        }
-        else if (ends_with(w, "ing"))
-        {
-            stem = stem_part(w, "ing");
-            if (contains_vowel(stem))
-            {
-                w = stem;
-                removed = true;
-            }
-        }
-
-        if (!removed)
-        {
-            return;
-        }
-
-        if (ends_with(w, "at") || ends_with(w, "bl") || ends_with(w, "iz"))
-        {
-            w += "e";
-            return;
-        }
-
-        if (double_consonant(w))
-        {
-            const char last = w.back();
-            if (last != 'l' && last != 's' && last != 'z')
-            {
-                w.pop_back();
-            }
-            return;
-        }
-
-        if (measure(w) == 1 && cvc(w))
-        {
-            w += "e";
-        }
-    }
-
-    void step1c(std::string &w)
-    {
-        if (!ends_with(w, "y"))
-        {
-            return;
-        }
-        std::string stem = stem_part(w, "y");
-        if (contains_vowel(stem))
-        {
-            w[w.size() - 1] = 'i';
-        }
-    }
-
-    struct Rule
-    {
-        const char *suffix;
-        const char *replacement;
-    };
-
-    void step2(std::string &w)
-    {
-        static const Rule rules[] = {
-            {"ational", "ate"},
-            {"tional", "tion"},
-            {"enci", "ence"},
-            {"anci", "ance"},
-            {"izer", "ize"},
-            {"abli", "able"},
-            {"alli", "al"},
-            {"entli", "ent"},
-            {"eli", "e"},
-            {"ousli", "ous"},
-            {"ization", "ize"},
-            {"ation", "ate"},
-            {"ator", "ate"},
-            {"alism", "al"},
-            {"iveness", "ive"},
-            {"fulness", "ful"},
-            {"ousness", "ous"},
-            {"aliti", "al"},
-            {"iviti", "ive"},
-            {"biliti", "ble"},
+            if (!doc_ids.empty())
+                doc_ids += ' ';
+            doc_ids += std::to_string(id - 1);
         };
-
-        for (const auto &r : rules)
-        {
-            const std::string suf(r.suffix);
-            if (!ends_with(w, suf))
-            {
-                continue;
-            }
-            const std::string stem = stem_part(w, suf);
-            if (measure(stem) > 0)
-            {
-                replace_suffix(w, suf, r.replacement);
-            }
-            return;
-        }
+        tokenizer.scan(line, append);
+        out += new_terms;
+        out += '\t';
+        out += doc_ids;
+        out += '\n';
     }
 
-    void step3(std::string &w)
+    void end_batch()
     {
-        static const Rule rules[] = {
-            {"icate", "ic"},
-            {"ative", ""},
-            {"alize", "al"},
-            {"iciti", "ic"},
-            {"ical", "ic"},
-            {"ful", ""},
-            {"ness", ""},
-        };
-
-        for (const auto &r : rules)
-        {
-            const std::string suf(r.suffix);
-            if (!ends_with(w, suf))
-            {
-                continue;
-            }
-            const std::string stem = stem_part(w, suf);
-            if (measure(stem) > 0)
-            {
-                replace_suffix(w, suf, r.replacement);
-            }
-            return;
-        }
+        out += END_BATCH;
+        out += '\n';
+        std::cout.write(out.data(), out.size());
+        std::cout.flush();
+        out.clear();
     }
+};
 
-    void step4(std::string &w)
-    {
-        static const char *suffixes[] = {
-            "al",
-            "ance",
-            "ence",
-            "er",
-            "ic",
-            "able",
-            "ible",
-            "ant",
-            "ement",
-            "ment",
-            "ent",
-            "ou",
-            "ism",
-            "ate",
-            "iti",
-            "ous",
-            "ive",
-            "ize",
-        };
-
-        for (const char *s : suffixes)
-        {
-            const std::string suf(s);
-            if (!ends_with(w, suf))
-            {
-                continue;
-            }
-            const std::string stem = stem_part(w, suf);
-            if (measure(stem) > 1)
-            {
-                w = stem;
-            }
-            return;
-        }
-
-        if (ends_with(w, "ion"))
-        {
-            const std::string stem = stem_part(w, "ion");
-            if (stem.size() >= 1)
-            {
-                const char prev = stem.back();
-                if ((prev == 's' || prev == 't') && measure(stem) > 1)
-                {
-                    w = stem;
-                }
-            }
-        }
-    }
-
-    void step5a(std::string &w)
-    {
-        if (!ends_with(w, "e"))
-        {
-            return;
-        }
-        const std::string stem = stem_part(w, "e");
-        const int m = measure(stem);
-        if (m > 1)
-        {
-            w = stem;
-            return;
-        }
-        if (m == 1 && !cvc(stem))
-        {
-            w = stem;
-        }
-    }
-
-    void step5b(std::string &w)
-    {
-        if (measure(w) > 1 && ends_with(w, "ll"))
-        {
-            w.pop_back();
-        }
-    }
+int main(int argc, char *argv[])
+{
+    std::ios::sync_with_stdio(false);
+    std::cin.tie(nullptr);
 
-    std::string porter_stem(std::string w)
+    bool batch = false;
+    BatchOutput output;
+    for (int i = 1; i < argc; ++i)
     {
-        if (w.size() <= 2)
+        std::string arg = argv[i];
+        if (arg == "--batch")
         {
-            return w;
+            batch = true;
         }
-
-        step1a(w);
-        step1b(w);
-        step1c(w);
-        step2(w);
-        step3(w);
-        step4(w);
-        step5a(w);
-        step5b(w);
-        return w;
-    }
-
-    bool is_token_char(unsigned char ch)
-    {
-        return std::isalnum(ch) != 0;
-    }
-
-    void flush_token(std::string &token)
-    {
-        if (token.empty())
+        else if (arg == "--ids")
         {
-            return;
+            batch = true;
+            output.with_ids = true;
         }
-        std::string out = porter_stem(token);
-        if (!out.empty())
+        else
         {
-            std::cout << out << "\n";
+            std::cerr << "Usage: tokenizer [--batch] [--ids]" << std::endl;
+            return 1;
         }
-        token.clear();
     }
 
-}
-
-int main()
-{
-    std::ios::sync_with_stdio(false);
-    std::cin.tie(nullptr);
-
+    TokenizerLib::StemCache stem_cache;
+    TokenizerLib::Tokenizer tokenizer(&stem_cache);
+    SimpleVector<std::string_view> tokens;
     std::string line;
+    bool pending = false;
     while (std::getline(std::cin, line))
     {
-        std::string token;
-        for (char ch : line)
+        if (batch)
         {
-            const unsigned char uch = static_cast<unsigned char>(ch);
-            if (is_token_char(uch))
+            if (line == END_BATCH)
             {
-                token.push_back(static_cast<char>(std::tolower(uch)));
+                output.end_batch();
+                pending = false;
             }
             else
             {
-                flush_token(token);
+                output.add_document(tokenizer, line);
+                pending = true;
             }
+            continue;
+        }
+
+        tokens.reset();
+        tokenizer.tokenize(line, tokens);
+        for (size_t i = 0; i < tokens.size; ++i)
+        {
+            std::cout << tokens[i] << "\n";
         }
-        flush_token(token);
         std::cout << "__END_DOC__" << std::endl;
     }
+    if (pending)
+        output.end_batch();
     return 0;
 }
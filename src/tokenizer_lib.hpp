@@ -2,24 +2,37 @@
 #define TOKENIZER_LIB_HPP
 
 #include <string>
+#include <string_view>
 #include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <new>
+#include <algorithm>
 #include "common.hpp"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 namespace TokenizerLib {
 
-bool is_consonant(const std::string& w, int i) {
-    const char ch = w[static_cast<size_t>(i)];
-    switch (ch) {
+// Стеммер Портера работает на месте: ни одно правило не удлиняет слово,
+// поэтому результат всегда помещается в исходные байты. Проверки
+// принимают string_view, суффиксы - литералы, без копий и выделений.
+
+inline bool is_consonant(std::string_view w, size_t i) {
+    switch (w[i]) {
         case 'a': case 'e': case 'i': case 'o': case 'u': return false;
         case 'y': return (i == 0) ? true : !is_consonant(w, i - 1);
         default: return true;
     }
 }
 
-int measure(const std::string& w) {
-    const int len = static_cast<int>(w.size());
+inline int measure(std::string_view w) {
+    const size_t len = w.size();
     int n = 0;
-    int i = 0;
+    size_t i = 0;
     while (i < len && is_consonant(w, i)) i++;
     while (i < len) {
         while (i < len && !is_consonant(w, i)) i++;
@@ -30,78 +43,92 @@ int measure(const std::string& w) {
     return n;
 }
 
-bool contains_vowel(const std::string& w) {
+inline bool contains_vowel(std::string_view w) {
     for (size_t i = 0; i < w.size(); i++) if (!is_consonant(w, i)) return true;
     return false;
 }
 
-bool ends_with(const std::string& w, const std::string& suffix) {
+inline bool ends_with(std::string_view w, std::string_view suffix) {
     if (w.size() < suffix.size()) return false;
-    return w.compare(w.size() - suffix.size(), suffix.size(), suffix) == 0;
+    return std::memcmp(w.data() + w.size() - suffix.size(), suffix.data(), suffix.size()) == 0;
 }
 
-std::string stem_part(const std::string& w, const std::string& suffix) {
-    return w.substr(0, w.size() - suffix.size());
-}
-
-bool double_consonant(const std::string& w) {
+inline bool double_consonant(std::string_view w) {
     if (w.size() < 2) return false;
     if (w.back() != w[w.size() - 2]) return false;
     return is_consonant(w, w.size() - 1);
 }
 
-bool cvc(const std::string& w) {
+inline bool cvc(std::string_view w) {
     if (w.size() < 3) return false;
     if (!is_consonant(w, w.size() - 1) || is_consonant(w, w.size() - 2) || !is_consonant(w, w.size() - 3)) return false;
     const char last = w.back();
     return !(last == 'w' || last == 'x' || last == 'y');
 }
 
-void replace_suffix(std::string& w, const std::string& suffix, const std::string& replacement) {
-    w.erase(w.size() - suffix.size());
-    w += replacement;
-}
+// Слово в чужом буфере, которое шаги стеммера укорачивают на месте
+struct Word {
+    char* s;
+    size_t len;
 
-void step1a(std::string& w) {
-    if (ends_with(w, "sses")) replace_suffix(w, "sses", "ss");
-    else if (ends_with(w, "ies")) replace_suffix(w, "ies", "i");
-    else if (ends_with(w, "ss")) return;
-    else if (ends_with(w, "s")) w.pop_back();
+    std::string_view view() const { return std::string_view(s, len); }
+    std::string_view stem_part(std::string_view suffix) const { return std::string_view(s, len - suffix.size()); }
+    bool ends_with(std::string_view suffix) const { return TokenizerLib::ends_with(view(), suffix); }
+    char back() const { return s[len - 1]; }
+    void pop_back() { len--; }
+    void push_back(char ch) { s[len++] = ch; }
+    void cut_to(std::string_view stem) { len = stem.size(); }
+
+    void replace_suffix(std::string_view suffix, std::string_view replacement) {
+        len -= suffix.size();
+        std::memcpy(s + len, replacement.data(), replacement.size());
+        len += replacement.size();
+    }
+};
+
+inline void step1a(Word& w) {
+    if (w.ends_with("sses")) w.replace_suffix("sses", "ss");
+    else if (w.ends_with("ies")) w.replace_suffix("ies", "i");
+    else if (w.ends_with("ss")) return;
+    else if (w.ends_with("s")) w.pop_back();
 }
 
-void step1b(std::string& w) {
-    if (ends_with(w, "eed")) {
-        std::string stem = stem_part(w, "eed");
-        if (measure(stem) > 0) replace_suffix(w, "eed", "ee");
+// Добавление "e" после снятия "ed"/"ing" возвращает слово не длиннее исходного
+inline void step1b(Word& w) {
+    if (w.ends_with("eed")) {
+        if (measure(w.stem_part("eed")) > 0) w.replace_suffix("eed", "ee");
         return;
     }
     bool removed = false;
-    std::string stem;
-    if (ends_with(w, "ed")) {
-        stem = stem_part(w, "ed");
-        if (contains_vowel(stem)) { w = stem; removed = true; }
-    } else if (ends_with(w, "ing")) {
-        stem = stem_part(w, "ing");
-        if (contains_vowel(stem)) { w = stem; removed = true; }
+    if (w.ends_with("ed")) {
+        std::string_view stem = w.stem_part("ed");
+        if (contains_vowel(stem)) { w.cut_to(stem); removed = true; }
+    } else if (w.ends_with("ing")) {
+        std::string_view stem = w.stem_part("ing");
+        if (contains_vowel(stem)) { w.cut_to(stem); removed = true; }
     }
     if (removed) {
-        if (ends_with(w, "at") || ends_with(w, "bl") || ends_with(w, "iz")) w += "e";
-        else if (double_consonant(w)) {
+        if (w.ends_with("at") || w.ends_with("bl") || w.ends_with("iz")) w.push_back('e');
+        else if (double_consonant(w.view())) {
             const char last = w.back();
             if (last != 'l' && last != 's' && last != 'z') w.pop_back();
-        } else if (measure(w) == 1 && cvc(w)) w += "e";
+        } else if (measure(w.view()) == 1 && cvc(w.view())) w.push_back('e');
     }
 }
 
-void step1c(std::string& w) {
-    if (ends_with(w, "y")) {
-        std::string stem = stem_part(w, "y");
-        if (contains_vowel(stem)) w.back() = 'i';
+inline void step1c(Word& w) {
+    if (w.ends_with("y")) {
+        if (contains_vowel(w.stem_part("y"))) w.s[w.len - 1] = 'i';
     }
 }
 
-void step2(std::string& w) {
-    static const struct { const char* s; const char* r; } rules[] = {
+struct Rule {
+    std::string_view suffix;
+    std::string_view replacement;
+};
+
+inline void step2(Word& w) {
+    static const Rule rules[] = {
         {"ational", "ate"}, {"tional", "tion"}, {"enci", "ence"}, {"anci", "ance"},
         {"izer", "ize"}, {"abli", "able"}, {"alli", "al"}, {"entli", "ent"},
         {"eli", "e"}, {"ousli", "ous"}, {"ization", "ize"}, {"ation", "ate"},
@@ -109,79 +136,249 @@ void step2(std::string& w) {
         {"ousness", "ous"}, {"aliti", "al"}, {"iviti", "ive"}, {"biliti", "ble"}
     };
     for (const auto& rule : rules) {
-        if (ends_with(w, rule.s)) {
-            std::string stem = stem_part(w, rule.s);
-            if (measure(stem) > 0) replace_suffix(w, rule.s, rule.r);
+        if (w.ends_with(rule.suffix)) {
+            if (measure(w.stem_part(rule.suffix)) > 0) w.replace_suffix(rule.suffix, rule.replacement);
             return;
         }
     }
 }
 
-void step3(std::string& w) {
-    static const struct { const char* s; const char* r; } rules[] = {
+inline void step3(Word& w) {
+    static const Rule rules[] = {
         {"icate", "ic"}, {"ative", ""}, {"alize", "al"}, {"iciti", "ic"},
         {"ical", "ic"}, {"ful", ""}, {"ness", ""}
     };
     for (const auto& rule : rules) {
-        if (ends_with(w, rule.s)) {
-            std::string stem = stem_part(w, rule.s);
-            if (measure(stem) > 0) replace_suffix(w, rule.s, rule.r);
+        if (w.ends_with(rule.suffix)) {
+            if (measure(w.stem_part(rule.suffix)) > 0) w.replace_suffix(rule.suffix, rule.replacement);
             return;
         }
     }
 }
 
-void step4(std::string& w) {
-    static const char* suffixes[] = {
+inline void step4(Word& w) {
+    static const std::string_view suffixes[] = {
         "al", "ance", "ence", "er", "ic", "able", "ible", "ant", "ement", "ment", "ent",
         "ou", "ism", "ate", "iti", "ous", "ive", "ize"
     };
-    for (const char* s : suffixes) {
-        if (ends_with(w, s)) {
-            std::string stem = stem_part(w, s);
-            if (measure(stem) > 1) w = stem;
+    for (std::string_view s : suffixes) {
+        if (w.ends_with(s)) {
+            std::string_view stem = w.stem_part(s);
+            if (measure(stem) > 1) w.cut_to(stem);
             return;
         }
     }
-    if (ends_with(w, "ion")) {
-        std::string stem = stem_part(w, "ion");
+    if (w.ends_with("ion")) {
+        std::string_view stem = w.stem_part("ion");
         if (stem.size() >= 1) {
             char prev = stem.back();
-            if ((prev == 's' || prev == 't') && measure(stem) > 1) w = stem;
+            if ((prev == 's' || prev == 't') && measure(stem) > 1) w.cut_to(stem);
         }
     }
 }
 
-void step5(std::string& w) {
-    if (ends_with(w, "e")) {
-        std::string stem = stem_part(w, "e");
+inline void step5(Word& w) {
+    if (w.ends_with("e")) {
+        std::string_view stem = w.stem_part("e");
         int m = measure(stem);
-        if (m > 1 || (m == 1 && !cvc(stem))) w = stem;
+        if (m > 1 || (m == 1 && !cvc(stem))) w.cut_to(stem);
     }
-    if (measure(w) > 1 && ends_with(w, "ll")) w.pop_back();
+    if (measure(w.view()) > 1 && w.ends_with("ll")) w.pop_back();
 }
 
-std::string stem(std::string w) {
-    if (w.size() <= 2) return w;
+// Стемминг s[0..len) на месте; возвращает новую длину
+inline size_t stem_in_place(char* s, size_t len) {
+    if (len <= 2) return len;
+    Word w{s, len};
     step1a(w); step1b(w); step1c(w); step2(w); step3(w); step4(w); step5(w);
-    return w;
+    return w.len;
+}
+
+// Байт токена - ASCII-буква или цифра, как std::isalnum в локали "C"
+inline bool is_token_char(unsigned char ch) {
+    return (unsigned)(ch - '0') < 10 || (unsigned)((ch | 0x20) - 'a') < 26;
+}
+
+// Копирует len <= 16 байт из in в out, приводя ASCII-буквы к нижнему
+// регистру; возвращает маску байтов токена (бит i - байт i). Полный блок
+// классифицируется SSE2 за раз, хвост - побайтно.
+inline uint32_t lower_block(const char* in, char* out, size_t len) {
+#if defined(__SSE2__)
+    if (len == 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)in);
+        // Сдвиг диапазона к -128 превращает беззнаковую проверку в знаковую
+        __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+        __m128i alpha = _mm_cmplt_epi8(_mm_add_epi8(lower, _mm_set1_epi8((char)(128 - 'a'))),
+                                       _mm_set1_epi8((char)(-128 + 26)));
+        __m128i digit = _mm_cmplt_epi8(_mm_add_epi8(v, _mm_set1_epi8((char)(128 - '0'))),
+                                       _mm_set1_epi8((char)(-128 + 10)));
+        _mm_storeu_si128((__m128i*)out, _mm_or_si128(v, _mm_and_si128(alpha, _mm_set1_epi8(0x20))));
+        return _mm_movemask_epi8(_mm_or_si128(alpha, digit));
+    }
+#endif
+    uint32_t mask = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char ch = in[i];
+        bool alpha = (unsigned)((ch | 0x20) - 'a') < 26;
+        out[i] = alpha ? (ch | 0x20) : ch;
+        if (alpha || (unsigned)(ch - '0') < 10) mask |= 1u << i;
+    }
+    return mask;
 }
 
-void tokenize(const std::string& text, SimpleVector<std::string>& tokens) {
-    std::string token;
-    for (char ch : text) {
-        if (std::isalnum((unsigned char)ch)) {
-            token.push_back(std::tolower((unsigned char)ch));
-        } else {
-            if (!token.empty()) {
-                tokens.push_back(stem(token));
-                token.clear();
+// Кеш стемм: текст следует закону Ципфа, и горячие слова незачем заново
+// прогонять через все шаги Портера. Таблица прямого отображения из
+// степени двойки записей по 64 байта, ограничена по памяти; при коллизии
+// запись просто перезаписывается. Кешируются токены до MAX_LEN байт.
+// В записи можно хранить номер терма вызывающего (индексатор), номера
+// живут до invalidate_ids(). Кеш не потокобезопасен: по одному на поток.
+class StemCache {
+public:
+    static const size_t MAX_LEN = 24;
+    static const uint32_t NO_ID = 0xFFFFFFFF;
+
+    struct alignas(64) Entry {
+        uint64_t raw[MAX_LEN / 8];
+        char stem[MAX_LEN];
+        uint32_t id;
+        uint32_t id_generation;
+        uint8_t raw_len;
+        uint8_t stem_len;
+    };
+
+    explicit StemCache(size_t entries = 1 << 14) : mask(0), generation(1) {
+        size_t n = 1;
+        while (n < entries) n <<= 1;
+        table = (Entry*)std::aligned_alloc(alignof(Entry), n * sizeof(Entry));
+        if (!table) throw std::bad_alloc();
+        mask = n - 1;
+        for (size_t i = 0; i < n; ++i) table[i].raw_len = 0;
+    }
+
+    StemCache(const StemCache&) = delete;
+    StemCache& operator=(const StemCache&) = delete;
+
+    ~StemCache() { std::free(table); }
+
+    // Стемма токена s[0..len) записывается на его место; возвращает новую
+    // длину и запись кеша (nullptr, если токен слишком длинный)
+    size_t stem(char* s, size_t len, Entry*& entry) {
+        if (len > MAX_LEN || len == 0) {
+            entry = nullptr;
+            return stem_in_place(s, len);
+        }
+        uint64_t raw[MAX_LEN / 8] = {0, 0, 0};
+        std::memcpy(raw, s, len);
+        uint64_t h = (raw[0] * 0x9E3779B97F4A7C15ull) ^ (raw[1] * 0xC2B2AE3D27D4EB4Full)
+                   ^ (raw[2] * 0x165667B19E3779F9ull) ^ len;
+        Entry& e = table[(h ^ (h >> 29)) & mask];
+        entry = &e;
+        if (e.raw_len == len && e.raw[0] == raw[0] && e.raw[1] == raw[1] && e.raw[2] == raw[2]) {
+            hits++;
+            std::memcpy(s, e.stem, e.stem_len);
+            return e.stem_len;
+        }
+        misses++;
+        size_t stem_len = stem_in_place(s, len);
+        std::memcpy(e.raw, raw, sizeof(raw));
+        std::memcpy(e.stem, s, stem_len);
+        e.raw_len = len;
+        e.stem_len = stem_len;
+        e.id_generation = 0;
+        return stem_len;
+    }
+
+    uint32_t id(const Entry* e) const {
+        return e && e->id_generation == generation ? e->id : NO_ID;
+    }
+
+    void set_id(Entry* e, uint32_t id) {
+        if (!e) return;
+        e->id = id;
+        e->id_generation = generation;
+    }
+
+    // Сбрасывает все номера термов: словарь вызывающего начат заново
+    void invalidate_ids() { generation++; }
+
+    size_t hits = 0;
+    size_t misses = 0;
+
+private:
+    Entry* table;
+    size_t mask;
+    uint32_t generation;
+};
+
+// Токенизатор с переиспользуемым буфером: текст блоками по 16 байт
+// копируется в buf в нижнем регистре, границы токенов берутся из переходов
+// в маске класса, каждый токен стеммируется на своём месте в buf (через
+// кеш, если он задан). Наружу отдаются string_view на буфер,
+// действительные до следующего вызова.
+class Tokenizer {
+public:
+    explicit Tokenizer(StemCache* c = nullptr) : cache(c) {}
+
+    // f(term, entry) для каждого токена по порядку; entry - запись кеша
+    // стемм или nullptr, она действительна только внутри вызова f
+    template <typename F>
+    void scan(std::string_view text, F f) {
+        const size_t n = text.size();
+        if (buf.size() < n) buf.resize(n);
+        char* out = &buf[0];
+        bool in_token = false;
+        size_t start = 0;
+        for (size_t b = 0; b < n; b += 16) {
+            size_t len = std::min<size_t>(16, n - b);
+            uint32_t mask = lower_block(text.data() + b, out + b, len);
+            uint32_t valid = len == 16 ? 0xFFFF : (1u << len) - 1;
+            // Бит i в prev - был ли байт перед i-м байтом блока частью токена
+            uint32_t prev = (mask << 1) | (in_token ? 1 : 0);
+            uint32_t starts = mask & ~prev;
+            uint32_t ends = ~mask & prev & valid;
+            for (uint32_t events = starts | ends; events; events &= events - 1) {
+                size_t i = b + __builtin_ctz(events);
+                if (starts & (events & -events)) start = i;
+                else emit(out + start, i - start, f);
             }
+            in_token = (mask >> (len - 1)) & 1;
         }
+        if (in_token) emit(out + start, n - start, f);
+    }
+
+    void tokenize(std::string_view text, SimpleVector<std::string_view>& tokens) {
+        scan(text, [&](std::string_view term, StemCache::Entry*) { tokens.push_back(term); });
     }
-    if (!token.empty()) {
-        tokens.push_back(stem(token));
+
+private:
+    std::string buf;
+    StemCache* cache;
+
+    template <typename F>
+    void emit(char* s, size_t len, F& f) {
+        StemCache::Entry* entry = nullptr;
+        len = cache ? cache->stem(s, len, entry) : stem_in_place(s, len);
+        f(std::string_view(s, len), entry);
     }
+};
+
+// Кеш стемм текущего потока для разбора запросов
+inline StemCache& thread_stem_cache() {
+    thread_local StemCache cache;
+    return cache;
+}
+
+inline void tokenize(const std::string& text, SimpleVector<std::string>& tokens) {
+    Tokenizer tokenizer(&thread_stem_cache());
+    SimpleVector<std::string_view> views;
+    tokenizer.tokenize(text, views);
+    for (size_t i = 0; i < views.size; ++i) tokens.push_back(std::string(views[i]));
+}
+
+inline std::string stem(std::string w) {
+    StemCache::Entry* entry;
+    w.resize(thread_stem_cache().stem(&w[0], w.size(), entry));
+    return w;
 }
 
 }